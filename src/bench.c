@@ -0,0 +1,496 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "image.h"
+#include "matrix.h"
+#include "args.h"
+#include "simd.h"
+#include "parallel.h"
+#include "bench.h"
+
+// Not in image.h
+matrix RANSAC(match *m, int n, float thresh, int k, int cutoff);
+layer make_layer(int input, int output, ACTIVATION activation);
+matrix forward_model(model m, matrix X);
+void backward_model(model m, matrix dL);
+
+#define MAX_SIZES 16
+#define MAX_RESULTS 1024
+#define MAX_CORNERS 2000
+
+// Inputs shared by every kernel at one size. Images are tiled from the
+// Rainier pair, so content and corner density are the same from run to run
+// and don't change with size.
+typedef struct{
+    image a, b;
+    image scratch;
+    image gauss;
+    image emboss, gx;
+    image disk4, disk7;
+    image box31;
+    packed_image a8;
+    descriptor *da, *db;
+    int na, nb;
+    match *m;
+    int nm;
+    matrix H;
+    model net;
+    matrix X, dL;
+} bench_data;
+
+typedef void bench_fn(bench_data *d);
+
+typedef struct{
+    const char *kernel;
+    int w, h, c;
+    int reps;
+    double median, p95, min;
+    double mps;
+    double psnr;    // quality of resizers, 0 if not measured
+} bench_result;
+
+static double now_ms()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1e3 + t.tv_nsec/1e6;
+}
+
+static void bench_convolve(bench_data *d) { free_image(convolve_image(d->a, d->gauss, 1)); }
+static void bench_convolve_u8(bench_data *d) { free_packed_image(convolve_packed(d->a8, d->gauss, 1)); }
+static void bench_3x3(bench_data *d) { free_image(convolve_image(d->a, d->emboss, 1)); }
+static void bench_gradient(bench_data *d) { free_image(convolve_image(d->a, d->gx, 0)); }
+static void bench_sobel(bench_data *d)
+{
+    image *s = sobel_image(d->a);
+    free_image(s[0]);
+    free_image(s[1]);
+    free(s);
+}
+static void bench_colorize(bench_data *d) { free_image(colorize_sobel(d->a)); }
+static void bench_disk4(bench_data *d) { free_image(convolve_image(d->a, d->disk4, 1)); }
+static void bench_disk7(bench_data *d) { free_image(convolve_image(d->a, d->disk7, 1)); }
+static void bench_box31(bench_data *d) { free_image(convolve_image(d->a, d->box31, 1)); }
+static void bench_smooth(bench_data *d) { free_image(smooth_image(d->a, 2)); }
+static void bench_smooth8(bench_data *d) { free_image(smooth_image(d->a, 8)); }
+static void bench_pyramid(bench_data *d)
+{
+    // Start from an empty pyramid so every rep builds all the levels
+    drop_pyramid(d->a);
+    pyramid *p = image_pyramid(d->a);
+    int i;
+    for(i = 0; i < p->n; ++i) laplacian_level(p, i);
+    drop_pyramid(d->a);
+}
+static void bench_nn_resize(bench_data *d) { free_image(nn_resize(d->a, d->a.w/2, d->a.h/2)); }
+static void bench_bilinear_resize(bench_data *d) { free_image(bilinear_resize(d->a, d->a.w*5/4, d->a.h*5/4)); }
+static image lanczos2_resize(image im, int w, int h) { return lanczos_resize(im, w, h, 2); }
+static image lanczos3_resize(image im, int w, int h) { return lanczos_resize(im, w, h, 3); }
+static void bench_bicubic_resize(bench_data *d) { free_image(bicubic_resize(d->a, d->a.w*5/4, d->a.h*5/4)); }
+static void bench_lanczos2_resize(bench_data *d) { free_image(lanczos2_resize(d->a, d->a.w*5/4, d->a.h*5/4)); }
+static void bench_lanczos3_resize(bench_data *d) { free_image(lanczos3_resize(d->a, d->a.w*5/4, d->a.h*5/4)); }
+static void bench_area_resize(bench_data *d) { free_image(area_resize(d->a, d->a.w*3/20, d->a.h*3/20)); }
+static void bench_half(bench_data *d) { free_image(half_image(d->a)); }
+
+// Quality of an upscaler: PSNR of a half size copy scaled back up against
+// the original, in dB. Higher keeps more of the detail the copy still has.
+static double upscale_psnr(image im, image (*resize)(image, int, int))
+{
+    image half = half_image(im);
+    image up = resize(half, im.w, im.h);
+    double se = 0;
+    size_t i, n = (size_t)im.w*im.h*im.c;
+    for(i = 0; i < n; ++i){
+        double d = up.data[i] - im.data[i];
+        se += d*d;
+    }
+    free_image(half);
+    free_image(up);
+    return se > 0 ? 10*log10(n/se) : 0;
+}
+
+static double quality_bilinear(bench_data *d) { return upscale_psnr(d->a, bilinear_resize); }
+static double quality_bicubic(bench_data *d) { return upscale_psnr(d->a, bicubic_resize); }
+static double quality_lanczos2(bench_data *d) { return upscale_psnr(d->a, lanczos2_resize); }
+static double quality_lanczos3(bench_data *d) { return upscale_psnr(d->a, lanczos3_resize); }
+
+static void bench_hsv(bench_data *d)
+{
+    rgb_to_hsv(d->scratch);
+    hsv_to_rgb(d->scratch);
+}
+
+static void bench_harris(bench_data *d)
+{
+    int n = 0;
+    descriptor *c = harris_corner_detector(d->a, 2, 50, 3, &n);
+    free_descriptors(c, n);
+}
+
+static void bench_match(bench_data *d)
+{
+    int n = 0;
+    free(match_descriptors(d->da, d->na, d->db, d->nb, &n));
+}
+
+static void bench_ransac(bench_data *d)
+{
+    srand(10);
+    free_matrix(RANSAC(d->m, d->nm, 2, 2000, d->nm + 1));
+}
+
+static void bench_combine(bench_data *d) { free_image(combine_images(d->a, d->b, d->H)); }
+static void bench_flow(bench_data *d) { free_image(optical_flow_images(d->a, d->b, 15, 8)); }
+static void bench_forward(bench_data *d) { forward_model(d->net, d->X); }
+static void bench_backward(bench_data *d) { backward_model(d->net, d->dL); }
+
+typedef struct{
+    const char *name;
+    bench_fn *fn;
+    int rgb;        // needs 3 channels
+    int features;   // needs corners, matches and H
+    double (*quality)(bench_data *d);   // PSNR reported next to the time
+} bench_case;
+
+static bench_case cases[] = {
+    {"convolve_gauss2", bench_convolve, 0, 0},
+    {"convolve_gauss2_u8", bench_convolve_u8, 0, 0},
+    {"convolve_3x3", bench_3x3, 0, 0},
+    {"convolve_3x3_sum", bench_gradient, 0, 0},
+    {"sobel", bench_sobel, 0, 0},
+    {"colorize_sobel", bench_colorize, 1, 0},
+    {"convolve_disk4", bench_disk4, 0, 0},
+    {"convolve_disk7", bench_disk7, 0, 0},
+    {"convolve_box31", bench_box31, 0, 0},
+    {"smooth_image", bench_smooth, 0, 0},
+    {"smooth_image_s8", bench_smooth8, 0, 0},
+    {"laplacian_pyramid", bench_pyramid, 0, 0},
+    {"nn_resize_half", bench_nn_resize, 0, 0},
+    {"bilinear_resize_5_4", bench_bilinear_resize, 0, 0, quality_bilinear},
+    {"bicubic_resize_5_4", bench_bicubic_resize, 0, 0, quality_bicubic},
+    {"lanczos2_resize_5_4", bench_lanczos2_resize, 0, 0, quality_lanczos2},
+    {"lanczos3_resize_5_4", bench_lanczos3_resize, 0, 0, quality_lanczos3},
+    {"area_resize_3_20", bench_area_resize, 0, 0},
+    {"half_image", bench_half, 0, 0},
+    {"rgb_hsv_roundtrip", bench_hsv, 1, 0},
+    {"harris", bench_harris, 0, 0},
+    {"match_descriptors", bench_match, 0, 1},
+    {"ransac", bench_ransac, 0, 1},
+    {"combine_images", bench_combine, 0, 1},
+    {"optical_flow", bench_flow, 0, 0},
+};
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(double *)a, y = *(double *)b;
+    return (x > y) - (x < y);
+}
+
+// Time fn after warmup untimed calls.
+static bench_result time_kernel(const char *name, bench_fn *fn, bench_data *d, int w, int h, int c, int warmup, int reps)
+{
+    int i;
+    double *t = calloc(reps, sizeof(double));
+    for(i = 0; i < warmup; ++i) fn(d);
+    for(i = 0; i < reps; ++i){
+        double start = now_ms();
+        fn(d);
+        t[i] = now_ms() - start;
+    }
+    qsort(t, reps, sizeof(double), compare_double);
+    bench_result r;
+    r.kernel = name;
+    r.w = w;
+    r.h = h;
+    r.c = c;
+    r.reps = reps;
+    r.min = t[0];
+    r.median = (reps % 2) ? t[reps/2] : (t[reps/2 - 1] + t[reps/2]) / 2;
+    r.p95 = t[(int)(0.95*(reps - 1) + .5)];
+    r.mps = (w && h) ? w*(double)h/(r.median*1e3) : 0;
+    r.psnr = 0;
+    free(t);
+    return r;
+}
+
+static void print_result(bench_result r)
+{
+    printf("%-22s %5dx%-5d %2d %10.3f %10.3f %10.1f", r.kernel, r.w, r.h, r.c, r.median, r.p95, r.mps);
+    if(r.psnr) printf(" %8.2f", r.psnr);
+    printf("\n");
+    fflush(stdout);
+}
+
+// Parse a size: N for N x N, WxH, or 4k / 8k.
+static int parse_size(const char *s, int *w, int *h)
+{
+    if(0 == strcmp(s, "4k") || 0 == strcmp(s, "4K")){ *w = 3840; *h = 2160; return 1; }
+    if(0 == strcmp(s, "8k") || 0 == strcmp(s, "8K")){ *w = 7680; *h = 4320; return 1; }
+    if(2 == sscanf(s, "%dx%d", w, h)) return *w > 0 && *h > 0;
+    if(1 == sscanf(s, "%d", w)){ *h = *w; return *w > 0; }
+    return 0;
+}
+
+static int parse_list(char *list, char **items, int max)
+{
+    int n = 0;
+    char *copy = strdup(list);
+    char *tok = strtok(copy, ",");
+    while(tok && n < max){
+        items[n++] = strdup(tok);
+        tok = strtok(0, ",");
+    }
+    free(copy);
+    return n;
+}
+
+static void keep_first(descriptor *d, int *n)
+{
+    int i;
+    for(i = MAX_CORNERS; i < *n; ++i) free(d[i].data);
+    if(*n > MAX_CORNERS) *n = MAX_CORNERS;
+}
+
+// Fill a w x h image with mirrored copies of src, so there are no seams.
+static image make_tiled(image src, int w, int h)
+{
+    image t = make_image(w, h, src.c);
+    int x, y, k;
+    for(k = 0; k < t.c; ++k){
+        for(y = 0; y < h; ++y){
+            int sy = y % (2*src.h);
+            if(sy >= src.h) sy = 2*src.h - 1 - sy;
+            for(x = 0; x < w; ++x){
+                int sx = x % (2*src.w);
+                if(sx >= src.w) sx = 2*src.w - 1 - sx;
+                t.data[x + w*(y + h*k)] = src.data[sx + src.w*(sy + src.h*k)];
+            }
+        }
+    }
+    return t;
+}
+
+// Flat disk of radius r, a lens blur. It doesn't separate, so it times the
+// full 2d convolution, direct at radius 4 and through the FFT at radius 7.
+static image make_disk(int r)
+{
+    image f = make_image(2*r + 1, 2*r + 1, 1);
+    int x, y;
+    for(y = -r; y <= r; ++y){
+        for(x = -r; x <= r; ++x){
+            if(x*x + y*y <= r*r) set_pixel(f, x + r, y + r, 0, 1);
+        }
+    }
+    l1_normalize(f);
+    return f;
+}
+
+static bench_data make_bench_data(image ra, image rb, int w, int h, int c, int features)
+{
+    bench_data d = {0};
+    d.a = make_tiled(ra, w, h);
+    d.b = make_tiled(rb, w, h);
+    if(c == 1){
+        image ga = rgb_to_grayscale(d.a), gb = rgb_to_grayscale(d.b);
+        free_image(d.a);
+        free_image(d.b);
+        d.a = ga;
+        d.b = gb;
+    }
+    d.scratch = copy_image(d.a);
+    d.gauss = make_gaussian_filter(2);
+    d.emboss = make_emboss_filter();
+    d.gx = make_gx_filter();
+    d.disk4 = make_disk(4);
+    d.disk7 = make_disk(7);
+    d.box31 = make_box_filter(31);
+    d.a8 = pack_image(d.a, STORE_U8);
+    if(features){
+        d.da = harris_corner_detector(d.a, 2, 50, 3, &d.na);
+        d.db = harris_corner_detector(d.b, 2, 50, 3, &d.nb);
+        keep_first(d.da, &d.na);
+        keep_first(d.db, &d.nb);
+        d.m = match_descriptors(d.da, d.na, d.db, d.nb, &d.nm);
+        if(d.nm >= 4){
+            srand(10);
+            d.H = RANSAC(d.m, d.nm, 2, 2000, 50);
+        } else {
+            d.H = make_translation_homography(w/2, 0);
+        }
+    }
+    return d;
+}
+
+static void free_bench_data(bench_data d)
+{
+    free_image(d.a);
+    free_image(d.b);
+    free_image(d.scratch);
+    free_image(d.gauss);
+    free_image(d.emboss);
+    free_image(d.gx);
+    free_image(d.disk4);
+    free_image(d.disk7);
+    free_image(d.box31);
+    free_packed_image(d.a8);
+    if(d.da) free_descriptors(d.da, d.na);
+    if(d.db) free_descriptors(d.db, d.nb);
+    free(d.m);
+    if(d.H.data) free_matrix(d.H);
+}
+
+static void write_json(const char *fname, bench_result *r, int n)
+{
+    FILE *fp = fopen(fname, "w");
+    if(!fp){
+        fprintf(stderr, "Couldn't write %s\n", fname);
+        return;
+    }
+    const char *simd[] = {"none", "sse4", "avx2"};
+    fprintf(fp, "{\"simd\": \"%s\", \"threads\": %d, \"compiler\": \"%s\", \"results\": [\n",
+            simd[simd_level()], get_num_threads(), __VERSION__);
+    int i;
+    for(i = 0; i < n; ++i){
+        fprintf(fp, "{\"kernel\": \"%s\", \"w\": %d, \"h\": %d, \"c\": %d, \"reps\": %d, "
+                "\"median_ms\": %.4f, \"p95_ms\": %.4f, \"min_ms\": %.4f, \"mps\": %.3f, \"psnr_db\": %.3f}%s\n",
+                r[i].kernel, r[i].w, r[i].h, r[i].c, r[i].reps, r[i].median, r[i].p95, r[i].min, r[i].mps,
+                r[i].psnr, i + 1 < n ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+    fclose(fp);
+}
+
+// Print the speedup of each result over the same kernel and size in a file
+// written by an earlier run.
+static void compare_json(const char *fname, bench_result *r, int n)
+{
+    FILE *fp = fopen(fname, "r");
+    if(!fp){
+        fprintf(stderr, "Couldn't open %s\n", fname);
+        return;
+    }
+    char line[1024];
+    char kernel[128];
+    int w, h, c, reps, i;
+    double median;
+    printf("\n%-22s %11s %2s %10s %10s %8s\n", "kernel", "size", "c", "old ms", "new ms", "speedup");
+    while(fgets(line, sizeof(line), fp)){
+        if(6 != sscanf(line, "{\"kernel\": \"%127[^\"]\", \"w\": %d, \"h\": %d, \"c\": %d, \"reps\": %d, \"median_ms\": %lf",
+                    kernel, &w, &h, &c, &reps, &median)) continue;
+        for(i = 0; i < n; ++i){
+            if(0 == strcmp(r[i].kernel, kernel) && r[i].w == w && r[i].h == h && r[i].c == c){
+                printf("%-22s %5dx%-5d %2d %10.3f %10.3f %7.2fx\n", kernel, w, h, c, median, r[i].median, median/r[i].median);
+            }
+        }
+    }
+    fclose(fp);
+}
+
+// Run the kernel benchmark suite.
+// Options: -sizes 256,1024,4k,8k  -channels 1,3  -reps 5  -warmup 1
+//          -kernel <substring>  -out bench.json  -compare old.json  -quick
+void run_bench(int argc, char **argv)
+{
+    int quick = find_arg(argc, argv, "-quick");
+    char *sizes = find_char_arg(argc, argv, "-sizes", quick ? "256,1024" : "256,1024,4k,8k");
+    char *channels = find_char_arg(argc, argv, "-channels", "3");
+    int reps = find_int_arg(argc, argv, "-reps", quick ? 3 : 5);
+    int warmup = find_int_arg(argc, argv, "-warmup", 1);
+    char *only = find_char_arg(argc, argv, "-kernel", 0);
+    char *out = find_char_arg(argc, argv, "-out", "bench.json");
+    char *compare = find_char_arg(argc, argv, "-compare", 0);
+    reps = MAX(reps, 1);
+
+    char *size_list[MAX_SIZES], *chan_list[MAX_SIZES];
+    int ns = parse_list(sizes, size_list, MAX_SIZES);
+    int nc = parse_list(channels, chan_list, MAX_SIZES);
+    bench_result *results = calloc(MAX_RESULTS, sizeof(bench_result));
+    int nr = 0;
+    int ncases = sizeof(cases)/sizeof(cases[0]);
+    int i, j, k;
+
+    image ra = load_image("data/Rainier1.png");
+    image rb = load_image("data/Rainier2.png");
+    printf("%-22s %11s %2s %10s %10s %10s %8s\n", "kernel", "size", "c", "median ms", "p95 ms", "MP/s", "PSNR dB");
+    for(i = 0; i < ns; ++i){
+        int w, h;
+        if(!parse_size(size_list[i], &w, &h)){
+            fprintf(stderr, "Bad size %s\n", size_list[i]);
+            continue;
+        }
+        for(j = 0; j < nc; ++j){
+            int c = atoi(chan_list[j]);
+            if(c != 1 && c != 3){
+                fprintf(stderr, "Only 1 or 3 channels are supported, skipping %d\n", c);
+                continue;
+            }
+            int features = 0;
+            for(k = 0; k < ncases; ++k){
+                if(only && !strstr(cases[k].name, only)) continue;
+                features |= cases[k].features;
+            }
+            bench_data d = make_bench_data(ra, rb, w, h, c, features);
+            for(k = 0; k < ncases && nr < MAX_RESULTS; ++k){
+                if(only && !strstr(cases[k].name, only)) continue;
+                if(cases[k].rgb && c != 3) continue;
+                if(cases[k].features && d.nm < 4) continue;
+                results[nr] = time_kernel(cases[k].name, cases[k].fn, &d, w, h, c, warmup, reps);
+                if(cases[k].quality) results[nr].psnr = cases[k].quality(&d);
+                print_result(results[nr++]);
+            }
+            free_bench_data(d);
+        }
+    }
+
+    // The classifier doesn't depend on image size: a 3072-64-10 model on a
+    // batch of 128, like CIFAR
+    int classifier = !only || strstr("classifier_forward", only) || strstr("classifier_backward", only);
+    if(classifier && nr + 2 > MAX_RESULTS){
+        fprintf(stderr, "Out of result slots, skipping the classifier\n");
+    } else if(classifier){
+        bench_data d = {0};
+        layer l[2] = {make_layer(3072, 64, LRELU), make_layer(64, 10, SOFTMAX)};
+        // forward_layer replaces the placeholder input without freeing it,
+        // afterwards in is the caller's X or the layer below's out
+        for(i = 0; i < 2; ++i) free_matrix(l[i].in);
+        d.net.layers = l;
+        d.net.n = 2;
+        srand(10);
+        d.X = random_matrix(128, 3072, 1);
+        d.dL = random_matrix(128, 10, 1);
+        bench_forward(&d);
+        // Softmax rows sum to 1. The homework stubs of forward_layer and
+        // backward_layer only hand back zeros, timing them would time
+        // make_matrix
+        matrix y = l[1].out;
+        double sum = 0;
+        for(j = 0; j < y.cols; ++j) sum += y.data[0][j];
+        if(fabs(sum - 1) > 1e-3){
+            fflush(stdout);
+            fprintf(stderr, "Classifier layers aren't implemented, skipping classifier_forward and classifier_backward\n");
+        } else {
+            results[nr] = time_kernel("classifier_forward", bench_forward, &d, 0, 0, 0, warmup, reps);
+            print_result(results[nr++]);
+            results[nr] = time_kernel("classifier_backward", bench_backward, &d, 0, 0, 0, warmup, reps);
+            print_result(results[nr++]);
+        }
+        free_matrix(d.X);
+        free_matrix(d.dL);
+        for(i = 0; i < 2; ++i){
+            free_matrix(l[i].w);
+            free_matrix(l[i].v);
+            free_matrix(l[i].dw);
+            free_matrix(l[i].out);
+        }
+    }
+
+    write_json(out, results, nr);
+    if(compare) compare_json(compare, results, nr);
+    for(i = 0; i < ns; ++i) free(size_list[i]);
+    for(i = 0; i < nc; ++i) free(chan_list[i]);
+    free_image(ra);
+    free_image(rb);
+    free(results);
+}
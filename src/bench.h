@@ -0,0 +1,8 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Time the main kernels at several image sizes and write the results as
+// JSON, see bench.c for the options.
+void run_bench(int argc, char **argv);
+
+#endif
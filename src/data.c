@@ -4,9 +4,11 @@
 #include <limits.h>
 #include "image.h"
 #include "list.h"
+#include "profile.h"
 
 data random_batch(data d, int n)
 {
+    PROFILE_FUNC();
     matrix X = {0};
     matrix y = {0};
     X.shallow = y.shallow = 1;
@@ -45,6 +47,7 @@ list *get_lines(char *filename)
 
 data load_classification_data(char *images, char *label_file, int bias)
 {
+    PROFILE_FUNC();
     list *image_list = get_lines(images);
     list *label_list = get_lines(label_file);
     int k = label_list->size;
@@ -53,20 +56,28 @@ data load_classification_data(char *images, char *label_file, int bias)
     int n = image_list->size;
     node *nd = image_list->front;
     int cols = 0;
-    int i;
+    int i, r, c;
     int count = 0;
+    float *row = 0;
     matrix X;
     matrix y = make_matrix(n, k);
     while(nd){
         char *path = (char *)nd->val;
-        image im = load_image(path);
+        // Keep the decoded image as bytes and widen one row at a time
+        packed_image im = load_image_packed(path, STORE_U8);
         if (!cols) {
             cols = im.w*im.h*im.c;
             X = make_matrix(n, cols + (bias != 0));
+            row = calloc(im.w, sizeof(float));
         }
-        for (i = 0; i < cols; ++i){
-            X.data[count][i] = im.data[i];
+        for (c = 0; c < im.c; ++c){
+            for (r = 0; r < im.h; ++r){
+                double *dst = X.data[count] + (c*im.h + r)*im.w;
+                load_packed_row(im, r, c, row);
+                for (i = 0; i < im.w; ++i) dst[i] = row[i];
+            }
         }
+        free_packed_image(im);
         if(bias) X.data[count][cols] = 1;
 
         for (i = 0; i < k; ++i){
@@ -77,6 +88,7 @@ data load_classification_data(char *images, char *label_file, int bias)
         ++count;
         nd = nd->next;
     }
+    free(row);
     free_list(image_list);
     data d;
     d.X = X;
@@ -118,6 +130,7 @@ char *fgetl(FILE *fp)
 
 void free_data(data d)
 {
+    PROFILE_FUNC();
     free_matrix(d.X);
     free_matrix(d.y);
 }
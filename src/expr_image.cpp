@@ -0,0 +1,44 @@
+#include "image.h"
+#include "image_expr.h"
+#include "profile.h"
+
+// C entry points for the fused element-wise operations in image_expr.h.
+
+using namespace expr;
+
+extern "C" {
+
+    // Add two images into a destination.
+    // image a, b: images to add, same size.
+    // image out: destination of the same size, may be a or b.
+    void add_image_into(image a, image b, image out)
+    {
+        PROFILE_FUNC();
+        PROFILE_BYTES(2*IMAGE_BYTES(out), IMAGE_BYTES(out));
+        eval_into(out, ex(a) + ex(b));
+    }
+
+    // Subtract two images into a destination.
+    // image a, b: computes a - b, same size.
+    // image out: destination of the same size, may be a or b.
+    void sub_image_into(image a, image b, image out)
+    {
+        PROFILE_FUNC();
+        PROFILE_BYTES(2*IMAGE_BYTES(out), IMAGE_BYTES(out));
+        eval_into(out, ex(a) - ex(b));
+    }
+
+    // Build a hybrid image from low frequencies of one image and the high
+    // frequencies of another, clamped to [0, 1], in a single pass.
+    // image low: low frequencies of the first image.
+    // image high: the second image.
+    // image high_low: low frequencies of the second image.
+    // image out: destination, may be any of the inputs.
+    void hybrid_image_into(image low, image high, image high_low, image out)
+    {
+        PROFILE_FUNC();
+        PROFILE_BYTES(3*IMAGE_BYTES(out), IMAGE_BYTES(out));
+        eval_into(out, clamp(ex(low) + (ex(high) - ex(high_low))));
+    }
+
+}
@@ -0,0 +1,498 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+#include "image.h"
+#include "parallel.h"
+#include "profile.h"
+
+// Frequency domain filtering. Transforms are radix 2 over power of two
+// sizes, real rows go through a half length complex transform. A spectrum
+// of an n x m block holds m rows of n/2 + 1 bins, the other half follows
+// from Hermitian symmetry. Complex values are interleaved re, im floats.
+//
+// Large images are convolved by overlap-add: the clamped input is cut into
+// blocks that are transformed, multiplied with the kernel spectrum and
+// transformed back, and the results of neighboring blocks are summed where
+// they overlap. Kernel spectra are cached, so filtering several images or
+// channels with one filter transforms it once.
+
+#define MAX_LOG2 16
+#define MIN_BLOCK 128
+#define SPECTRUM_CACHE 8
+
+static float *twiddle_table[MAX_LOG2 + 1];
+static pthread_mutex_t twiddle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int log2i(int n)
+{
+    int l = 0;
+    while((1 << l) < n) ++l;
+    return l;
+}
+
+static int next_pow2(int n)
+{
+    return 1 << log2i(n);
+}
+
+// cos and -sin of 2 pi k / n for k < n/2, built once per size.
+static const float *twiddles(int n)
+{
+    int l = log2i(n);
+    assert(l <= MAX_LOG2);
+    float *t = __atomic_load_n(&twiddle_table[l], __ATOMIC_ACQUIRE);
+    if(t) return t;
+    pthread_mutex_lock(&twiddle_lock);
+    t = twiddle_table[l];
+    if(!t){
+        t = malloc((n/2 + 1)*2*sizeof(float));
+        int k;
+        for(k = 0; k <= n/2; ++k){
+            double a = 2*M_PI*k/n;
+            t[2*k] = cos(a);
+            t[2*k+1] = -sin(a);
+        }
+        __atomic_store_n(&twiddle_table[l], t, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&twiddle_lock);
+    return t;
+}
+
+// In place complex transform of n interleaved values, unnormalized.
+static void fft(float *a, int n, int inverse)
+{
+    int i, j, k, len;
+    for(i = 1, j = 0; i < n; ++i){
+        int bit = n >> 1;
+        for(; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if(i < j){
+            float tr = a[2*i], ti = a[2*i+1];
+            a[2*i] = a[2*j]; a[2*i+1] = a[2*j+1];
+            a[2*j] = tr; a[2*j+1] = ti;
+        }
+    }
+    const float *tw = twiddles(n);
+    float sign = inverse ? -1 : 1;
+    for(len = 2; len <= n; len <<= 1){
+        int half = len/2, step = n/len;
+        for(i = 0; i < n; i += len){
+            float *u = a + 2*i;
+            float *v = u + 2*half;
+            for(k = 0; k < half; ++k){
+                float wr = tw[2*k*step], wi = sign*tw[2*k*step+1];
+                float tr = v[2*k]*wr - v[2*k+1]*wi;
+                float ti = v[2*k]*wi + v[2*k+1]*wr;
+                v[2*k] = u[2*k] - tr;
+                v[2*k+1] = u[2*k+1] - ti;
+                u[2*k] += tr;
+                u[2*k+1] += ti;
+            }
+        }
+    }
+}
+
+// Transform n real values into bins 0..n/2. out holds n + 2 floats and may
+// be in. Even and odd samples are packed into one n/2 point complex
+// transform, then split apart.
+static void rfft(const float *in, float *out, int n)
+{
+    int m = n/2, k;
+    if(out != in) memcpy(out, in, n*sizeof(float));
+    fft(out, m, 0);
+    const float *tw = twiddles(n);
+    float r0 = out[0], i0 = out[1];
+    out[0] = r0 + i0; out[1] = 0;
+    out[2*m] = r0 - i0; out[2*m+1] = 0;
+    for(k = 1; k <= m/2; ++k){
+        float *zk = out + 2*k, *zm = out + 2*(m - k);
+        float er = .5f*(zk[0] + zm[0]), ei = .5f*(zk[1] - zm[1]);
+        float odr = .5f*(zk[1] + zm[1]), odi = .5f*(zm[0] - zk[0]);
+        float wr = tw[2*k], wi = tw[2*k+1];
+        float tr = wr*odr - wi*odi, ti = wr*odi + wi*odr;
+        zk[0] = er + tr; zk[1] = ei + ti;
+        zm[0] = er - tr; zm[1] = -(ei - ti);
+    }
+}
+
+// Inverse of rfft, unnormalized: the n outputs come out scaled by n/2. in
+// holds n + 2 floats and is overwritten, out may be in.
+static void irfft(float *in, float *out, int n)
+{
+    int m = n/2, k;
+    const float *tw = twiddles(n);
+    float a = in[0], b = in[2*m];
+    in[0] = .5f*(a + b); in[1] = .5f*(a - b);
+    for(k = 1; k <= m/2; ++k){
+        float *xk = in + 2*k, *xm = in + 2*(m - k);
+        float er = .5f*(xk[0] + xm[0]), ei = .5f*(xk[1] - xm[1]);
+        float dr = .5f*(xk[0] - xm[0]), di = .5f*(xk[1] + xm[1]);
+        float wr = tw[2*k], wi = -tw[2*k+1];
+        float odr = dr*wr - di*wi, odi = dr*wi + di*wr;
+        xk[0] = er - odi; xk[1] = ei + odr;
+        xm[0] = er + odi; xm[1] = odr - ei;
+    }
+    fft(in, m, 1);
+    if(out != in) memcpy(out, in, n*sizeof(float));
+}
+
+// Complex transform down the columns of m rows of bins values each. The
+// butterflies combine whole rows with one twiddle, so the inner loops run
+// along contiguous memory.
+static void fft_columns(float *a, int bins, int m, int inverse)
+{
+    int i, j, k, len, b;
+    size_t row = 2*(size_t)bins;
+    for(i = 1, j = 0; i < m; ++i){
+        int bit = m >> 1;
+        for(; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if(i < j){
+            float *p = a + i*row, *q = a + j*row;
+            for(b = 0; b < 2*bins; ++b){
+                float t = p[b];
+                p[b] = q[b];
+                q[b] = t;
+            }
+        }
+    }
+    const float *tw = twiddles(m);
+    float sign = inverse ? -1 : 1;
+    for(len = 2; len <= m; len <<= 1){
+        int half = len/2, step = m/len;
+        for(i = 0; i < m; i += len){
+            for(k = 0; k < half; ++k){
+                float wr = tw[2*k*step], wi = sign*tw[2*k*step+1];
+                float *u = a + (i + k)*row;
+                float *v = a + (i + k + half)*row;
+                for(b = 0; b < bins; ++b){
+                    float tr = v[2*b]*wr - v[2*b+1]*wi;
+                    float ti = v[2*b]*wi + v[2*b+1]*wr;
+                    v[2*b] = u[2*b] - tr;
+                    v[2*b+1] = u[2*b+1] - ti;
+                    u[2*b] += tr;
+                    u[2*b+1] += ti;
+                }
+            }
+        }
+    }
+}
+
+// 2d transform of an n x m block. rows real rows of n floats are read from
+// src with a stride of stride floats, the rest are zero. spec gets m rows of
+// n/2 + 1 bins.
+static void rfft2(const float *src, int stride, int rows, int n, int m, float *spec)
+{
+    int bins = n/2 + 1, y;
+    for(y = 0; y < m; ++y){
+        float *s = spec + 2*bins*y;
+        if(y < rows) rfft(src + y*stride, s, n);
+        else memset(s, 0, 2*bins*sizeof(float));
+    }
+    fft_columns(spec, bins, m, 0);
+}
+
+// Inverse of rfft2 in place, unnormalized: outputs are scaled by n/2 * m.
+// Only the first rows rows are brought back, row y ends up in the first n
+// floats of spec row y.
+static void irfft2(float *spec, int rows, int n, int m)
+{
+    int bins = n/2 + 1, y;
+    fft_columns(spec, bins, m, 1);
+    for(y = 0; y < rows; ++y) irfft(spec + 2*bins*y, spec + 2*bins*y, n);
+}
+
+// Cached spectra of flipped filter channels, already divided by the scale
+// irfft2 leaves on its outputs. Entries are matched on the taps themselves,
+// so a filter edited in place or freed and reallocated is never confused
+// with an older one.
+typedef struct{
+    int fw, fh, n;
+    float *taps;
+    float *spec;
+    unsigned long used;
+} cached_spectrum;
+
+static cached_spectrum spectrum_cache[SPECTRUM_CACHE];
+static unsigned long cache_clock;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Spectrum of one filter channel for n x n blocks, copied out of the cache
+// or computed and added to it.
+// float *f: fw x fh taps.
+// float *dst: gets n * (n/2 + 1) complex bins.
+static void kernel_spectrum(const float *f, int fw, int fh, int n, float *dst)
+{
+    size_t bins = (size_t)n*(n/2 + 1);
+    size_t taps = (size_t)fw*fh;
+    int i, x, y;
+    pthread_mutex_lock(&cache_lock);
+    for(i = 0; i < SPECTRUM_CACHE; ++i){
+        cached_spectrum *e = spectrum_cache + i;
+        if(e->spec && e->n == n && e->fw == fw && e->fh == fh && 0 == memcmp(e->taps, f, taps*sizeof(float))){
+            e->used = ++cache_clock;
+            memcpy(dst, e->spec, 2*bins*sizeof(float));
+            pthread_mutex_unlock(&cache_lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    float *block = calloc((size_t)n*n, sizeof(float));
+    float scale = 1.f/((n/2)*(float)n);
+    for(y = 0; y < fh; ++y){
+        for(x = 0; x < fw; ++x){
+            block[y*n + x] = scale*f[(fh - 1 - y)*fw + (fw - 1 - x)];
+        }
+    }
+    rfft2(block, n, fh, n, n, dst);
+    free(block);
+
+    pthread_mutex_lock(&cache_lock);
+    cached_spectrum *e = spectrum_cache;
+    for(i = 1; i < SPECTRUM_CACHE; ++i){
+        if(spectrum_cache[i].used < e->used) e = spectrum_cache + i;
+    }
+    free(e->taps);
+    free(e->spec);
+    e->fw = fw;
+    e->fh = fh;
+    e->n = n;
+    e->taps = malloc(taps*sizeof(float));
+    memcpy(e->taps, f, taps*sizeof(float));
+    e->spec = malloc(2*bins*sizeof(float));
+    memcpy(e->spec, dst, 2*bins*sizeof(float));
+    e->used = ++cache_clock;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+typedef struct{
+    image_view im;
+    image filter;
+    int preserve;
+    image_view out;
+    int n, block;
+    int bx, by;
+    int phase;
+    float *kspec;
+} fft_job;
+
+// Convolve one block of the clamped input and add it into out.
+// The clamped input J covers (w + fw - 1) x (h + fh - 1), J(x, y) is the
+// input at (x - rx, y - ry) clamped to the view. The full linear convolution
+// of J with the flipped filter, shifted back by (fw - 1, fh - 1), is the
+// correlation convolve_view computes.
+static void fft_block(fft_job *j, int x0, int y0, float *in, float *spec, float *sum)
+{
+    image_view im = j->im, out = j->out;
+    int fw = j->filter.w, fh = j->filter.h;
+    int rx = fw/2, ry = fh/2;
+    int n = j->n, bins = n/2 + 1;
+    int bw = MIN(j->block, im.w + fw - 1 - x0);
+    int bh = MIN(j->block, im.h + fh - 1 - y0);
+    size_t plane = (size_t)n*bins;
+    int c, x, y;
+    for(c = 0; c < im.c; ++c){
+        for(y = 0; y < bh; ++y){
+            int sy = MAX(0, MIN(im.h - 1, y0 + y - ry));
+            const float *row = im.data + c*im.cs + sy*im.ys;
+            float *dst = in + y*(n + 2);
+            for(x = 0; x < bw; ++x){
+                int sx = MAX(0, MIN(im.w - 1, x0 + x - rx));
+                dst[x] = row[sx*im.xs];
+            }
+            memset(dst + bw, 0, (n - bw)*sizeof(float));
+        }
+        rfft2(in, n + 2, bh, n, n, spec);
+        const float *k = j->kspec + (j->filter.c == 1 ? 0 : 2*c*plane);
+        // Without preserve the products of all channels are summed, so the
+        // sum takes one inverse transform
+        float *res = spec;
+        size_t i;
+        if(!j->preserve){
+            res = sum;
+            if(c == 0) memset(sum, 0, 2*plane*sizeof(float));
+        }
+        for(i = 0; i < plane; ++i){
+            float re = spec[2*i]*k[2*i] - spec[2*i+1]*k[2*i+1];
+            float im_ = spec[2*i]*k[2*i+1] + spec[2*i+1]*k[2*i];
+            if(j->preserve){
+                res[2*i] = re;
+                res[2*i+1] = im_;
+            } else {
+                res[2*i] += re;
+                res[2*i+1] += im_;
+            }
+        }
+        if(!j->preserve && c < im.c - 1) continue;
+
+        // Rows and columns of the result that land inside out
+        int oy0 = MAX(0, y0 - (fh - 1)), oy1 = MIN(im.h, y0 + bh);
+        int ox0 = MAX(0, x0 - (fw - 1)), ox1 = MIN(im.w, x0 + bw);
+        irfft2(res, oy1 + fh - 1 - y0, n, n);
+        float *dst = out.data + (j->preserve ? c*out.cs : 0);
+        for(y = oy0; y < oy1; ++y){
+            const float *r = res + 2*bins*(y + fh - 1 - y0) + (fw - 1 - x0);
+            float *d = dst + y*out.ys;
+            for(x = ox0; x < ox1; ++x) d[x*out.xs] += r[x];
+        }
+    }
+}
+
+// Run the block rows of one phase. Block rows of the same parity never
+// write the same output rows, so each phase runs in parallel.
+static void fft_block_rows(void *ctx, int start, int end)
+{
+    fft_job *j = ctx;
+    int n = j->n;
+    size_t plane = (size_t)n*(n/2 + 1);
+    float *in = malloc((size_t)n*(n + 2)*sizeof(float));
+    float *spec = malloc(2*plane*sizeof(float));
+    float *sum = j->preserve ? 0 : malloc(2*plane*sizeof(float));
+    int r, b;
+    for(r = start; r < end; ++r){
+        int y0 = (2*r + j->phase)*j->block;
+        for(b = 0; b < j->bx; ++b) fft_block(j, b*j->block, y0, in, spec, sum);
+    }
+    free(in);
+    free(spec);
+    free(sum);
+}
+
+// Convolve a view with a filter through the frequency domain. Same result as
+// convolve_view, up to float rounding, for any filter size.
+// image_view im: view to filter.
+// image filter: filter with 1 channel or im.c channels.
+// int preserve: 1 keeps channels separate, 0 sums them into one channel.
+// image_view out: im.w x im.h view with im.c channels if preserve, else 1.
+//                 Must not overlap im.
+void convolve_fft_view(image_view im, image filter, int preserve, image_view out)
+{
+    PROFILE_FUNC();
+    assert(im.c == filter.c || filter.c == 1);
+    assert(preserve == 0 || preserve == 1);
+    assert(out.w == im.w && out.h == im.h && out.c == (preserve ? im.c : 1));
+    PROFILE_BYTES(IMAGE_BYTES(im), IMAGE_BYTES(out));
+    int fw = filter.w, fh = filter.h;
+    int jw = im.w + fw - 1, jh = im.h + fh - 1;
+    int k = MAX(fw, fh);
+    // Blocks a few times the filter size waste little on the overlap; small
+    // images go in one block.
+    int n = MAX(MIN_BLOCK, next_pow2(4*k));
+    n = MIN(n, next_pow2(MAX(jw, jh) + k - 1));
+    fft_job j = {im, filter, preserve, out, n, n - k + 1};
+    j.bx = (jw + j.block - 1)/j.block;
+    j.by = (jh + j.block - 1)/j.block;
+
+    size_t plane = (size_t)n*(n/2 + 1);
+    int c, y, x;
+    j.kspec = malloc(2*plane*filter.c*sizeof(float));
+    for(c = 0; c < filter.c; ++c){
+        kernel_spectrum(filter.data + c*fw*fh, fw, fh, n, j.kspec + 2*c*plane);
+    }
+    for(c = 0; c < out.c; ++c){
+        for(y = 0; y < out.h; ++y){
+            for(x = 0; x < out.w; ++x) *view_ptr(out, x, y, c) = 0;
+        }
+    }
+    for(j.phase = 0; j.phase < 2; ++j.phase){
+        parallel_for((j.by - j.phase + 1)/2, 1, fft_block_rows, &j);
+    }
+    free(j.kspec);
+}
+
+image convolve_fft(image im, image filter, int preserve)
+{
+    PROFILE_FUNC();
+    image out = make_image(im.w, im.h, preserve ? im.c : 1);
+    convolve_fft_view(view_image(im), filter, preserve, view_image(out));
+    return out;
+}
+
+// Forward transform of each channel, zero padded up to powers of two.
+// image im: image to transform.
+// returns: its spectrum, free with free_spectrum.
+spectrum fft_image(image im)
+{
+    PROFILE_FUNC();
+    spectrum s;
+    s.w = im.w;
+    s.h = im.h;
+    s.c = im.c;
+    s.n = next_pow2(MAX(im.w, 2));
+    s.m = next_pow2(im.h);
+    size_t plane = (size_t)s.m*(s.n/2 + 1);
+    s.data = calloc(2*plane*im.c, sizeof(float));
+    float *in = calloc((size_t)im.h*(s.n + 2), sizeof(float));
+    int c, y;
+    for(c = 0; c < im.c; ++c){
+        for(y = 0; y < im.h; ++y){
+            memcpy(in + y*(s.n + 2), im.data + im.w*(y + im.h*c), im.w*sizeof(float));
+        }
+        rfft2(in, s.n + 2, im.h, s.n, s.m, s.data + 2*c*plane);
+    }
+    free(in);
+    PROFILE_BYTES(IMAGE_BYTES(im), 2*plane*im.c*sizeof(float));
+    return s;
+}
+
+// Inverse transform back to the image that was transformed.
+// spectrum s: spectrum from fft_image, possibly modified.
+// returns: s.w x s.h x s.c image.
+image ifft_image(spectrum s)
+{
+    PROFILE_FUNC();
+    image im = make_image(s.w, s.h, s.c);
+    size_t plane = (size_t)s.m*(s.n/2 + 1);
+    float *spec = malloc(2*plane*sizeof(float));
+    float scale = 1.f/((s.n/2)*(float)s.m);
+    int c, x, y;
+    for(c = 0; c < s.c; ++c){
+        memcpy(spec, s.data + 2*c*plane, 2*plane*sizeof(float));
+        irfft2(spec, s.h, s.n, s.m);
+        for(y = 0; y < s.h; ++y){
+            float *row = spec + 2*(s.n/2 + 1)*y;
+            float *dst = im.data + im.w*(y + im.h*c);
+            for(x = 0; x < s.w; ++x) dst[x] = scale*row[x];
+        }
+    }
+    free(spec);
+    return im;
+}
+
+// Log magnitude of a spectrum for display, log(1 + |X|), with the zero
+// frequency moved to the center.
+// spectrum s: spectrum to show.
+// returns: s.n x s.m x s.c image.
+image spectrum_magnitude(spectrum s)
+{
+    PROFILE_FUNC();
+    image im = make_image(s.n, s.m, s.c);
+    int bins = s.n/2 + 1;
+    int c, x, y;
+    for(c = 0; c < s.c; ++c){
+        const float *p = s.data + 2*c*(size_t)s.m*bins;
+        for(y = 0; y < s.m; ++y){
+            for(x = 0; x < s.n; ++x){
+                // The missing half mirrors through the origin
+                int u = x, v = y;
+                if(u >= bins){
+                    u = s.n - u;
+                    v = (s.m - v) % s.m;
+                }
+                const float *z = p + 2*(bins*v + u);
+                float mag = log1pf(sqrtf(z[0]*z[0] + z[1]*z[1]));
+                int dx = (x + s.n/2) % s.n, dy = (y + s.m/2) % s.m;
+                im.data[dx + im.w*(dy + im.h*c)] = mag;
+            }
+        }
+    }
+    return im;
+}
+
+void free_spectrum(spectrum s)
+{
+    free(s.data);
+}
@@ -3,6 +3,12 @@
 #include <assert.h>
 #include <math.h>
 #include "image.h"
+#include "simd.h"
+#include "parallel.h"
+#include "profile.h"
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
 
 #define ONE_SIXTH   (1.0 / 6.0)
 #define TWO_SIXTH   (2.0 / 6.0)
@@ -46,18 +52,18 @@ void set_pixel(image im, int x, int y, int c, float v)
 
 image copy_image(image im)
 {
+    PROFILE_FUNC();
     image copy = make_image(im.w, im.h, im.c);
     memcpy(copy.data, im.data, im.w * im.h * im.c * sizeof(float));
 
     return copy;
 }
 
-image rgb_to_grayscale(image im)
+static void grayscale_rows(void *ctx, int start, int end)
 {
-    assert(im.c == 3);
-    image gray = make_image(im.w, im.h, 1);
-
-    for (int row = 0; row < im.h; row++) {
+    image *io = ctx;
+    image im = io[0], gray = io[1];
+    for (int row = start; row < end; row++) {
         for (int col = 0; col < im.w; col++) {
             float gR = 0.299 * get_pixel(im, col, row, 0);
             float gG = 0.587 * get_pixel(im, col, row, 1);
@@ -65,12 +71,21 @@ image rgb_to_grayscale(image im)
             set_pixel(gray, col, row, 0, gR + gG + gB);
         }
     }
+}
 
+image rgb_to_grayscale(image im)
+{
+    PROFILE_FUNC();
+    assert(im.c == 3);
+    image gray = make_image(im.w, im.h, 1);
+    image io[2] = {im, gray};
+    parallel_for(im.h, 16, grayscale_rows, io);
     return gray;
 }
 
 void shift_image(image im, int c, float v)
 {
+    PROFILE_FUNC();
     for (int row = 0; row < im.h; row++) {
         for (int col = 0; col < im.w; col++) {
             float shifted = v + get_pixel(im, col, row, c);
@@ -79,8 +94,20 @@ void shift_image(image im, int c, float v)
     }
 }
 
+void scale_image(image im, int c, float v)
+{
+    PROFILE_FUNC();
+    for (int row = 0; row < im.h; row++) {
+        for (int col = 0; col < im.w; col++) {
+            float scaled = v * get_pixel(im, col, row, c);
+            set_pixel(im, col, row, c, scaled);
+        }
+    }
+}
+
 void clamp_image(image im)
 {
+    PROFILE_FUNC();
     for (int c = 0; c < im.c; c++) {
         for (int row = 0; row < im.h; row++) {
             for (int col = 0; col < im.w; col++) {
@@ -107,16 +134,192 @@ float three_way_min(float a, float b, float c)
     return (a < b) ? ( (a < c) ? a : c) : ( (b < c) ? b : c) ;
 }
 
+// Batch color kernels on planar channel rows. They are branch-free versions
+// of the per-pixel code in rgb_to_hsv_view/hsv_to_rgb_view: the hexagon
+// sector is chosen with masks, and hsv -> rgb uses the closed form
+// x = v - c * clamp(min(k, 4 - k), 0, 1), k = (n + 6h) mod 6 with
+// n = 5, 3, 1 for r, g, b, which traces the same piecewise linear sectors.
+typedef void color_kernel(float *, float *, float *, int);
+
+static void rgb_to_hsv_scalar(float *r, float *g, float *b, int n)
+{
+    for (int i = 0; i < n; i++) {
+        float v = three_way_max(r[i], g[i], b[i]);
+        float c = v - three_way_min(r[i], g[i], b[i]);
+        int is_r = v == r[i];
+        int is_g = !is_r && v == g[i];
+        float num = is_r ? g[i] - b[i] : (is_g ? b[i] - r[i] : r[i] - g[i]);
+        float off = is_r ? 0 : (is_g ? 2 : 4);
+        float h = c == 0 ? 0 : off + num / c;
+        float hue = h / 6 + (h < 0 ? 1 : 0);
+        r[i] = c == 0 ? 0 : hue;
+        g[i] = v == 0 ? 0 : c / v;
+        b[i] = v;
+    }
+}
+
+static float hexagon_channel(float n, float h6, float v, float c)
+{
+    float k = n + h6;
+    k = k - 6 * floorf(k / 6);
+    float t = MIN(k, 4 - k);
+    t = MIN(MAX(t, 0), 1);
+    return v - c * t;
+}
+
+static void hsv_to_rgb_scalar(float *h, float *s, float *v, int n)
+{
+    for (int i = 0; i < n; i++) {
+        float c = s[i] * v[i];
+        float h6 = 6 * h[i];
+        float val = v[i];
+        h[i] = hexagon_channel(5, h6, val, c);
+        s[i] = hexagon_channel(3, h6, val, c);
+        v[i] = hexagon_channel(1, h6, val, c);
+    }
+}
+
+#ifdef SIMD_X86
+// VEC is __m128 or __m256, P the matching intrinsic prefix, L the lane count
+// and EQ/LT the lane-wise comparisons.
+#define RGB_TO_HSV_KERNEL(NAME, TARGET, VEC, P, L, EQ, LT)                      \
+__attribute__((target(TARGET)))                                                 \
+static void NAME(float *r, float *g, float *b, int n)                           \
+{                                                                               \
+    const VEC zero = P##_setzero_ps(), one = P##_set1_ps(1);                    \
+    const VEC two = P##_set1_ps(2), four = P##_set1_ps(4);                      \
+    const VEC six = P##_set1_ps(6);                                             \
+    int i = 0;                                                                  \
+    for (; i + L <= n; i += L) {                                                \
+        VEC vr = P##_loadu_ps(r + i);                                           \
+        VEC vg = P##_loadu_ps(g + i);                                           \
+        VEC vb = P##_loadu_ps(b + i);                                           \
+        VEC v = P##_max_ps(vr, P##_max_ps(vg, vb));                             \
+        VEC c = P##_sub_ps(v, P##_min_ps(vr, P##_min_ps(vg, vb)));              \
+        VEC is_r = EQ(v, vr);                                                   \
+        VEC is_g = P##_andnot_ps(is_r, EQ(v, vg));                              \
+        VEC num = P##_sub_ps(vr, vg);                                           \
+        VEC off = four;                                                         \
+        num = P##_blendv_ps(num, P##_sub_ps(vb, vr), is_g);                     \
+        off = P##_blendv_ps(off, two, is_g);                                    \
+        num = P##_blendv_ps(num, P##_sub_ps(vg, vb), is_r);                     \
+        off = P##_blendv_ps(off, zero, is_r);                                   \
+        VEC h = P##_add_ps(off, P##_div_ps(num, c));                            \
+        VEC hue = P##_div_ps(h, six);                                           \
+        hue = P##_add_ps(hue, P##_and_ps(LT(h, zero), one));                    \
+        hue = P##_andnot_ps(EQ(c, zero), hue);                                  \
+        VEC sat = P##_andnot_ps(EQ(v, zero), P##_div_ps(c, v));                 \
+        P##_storeu_ps(r + i, hue);                                              \
+        P##_storeu_ps(g + i, sat);                                              \
+        P##_storeu_ps(b + i, v);                                                \
+    }                                                                           \
+    rgb_to_hsv_scalar(r + i, g + i, b + i, n - i);                              \
+}
+
+#define HSV_TO_RGB_KERNEL(NAME, TARGET, VEC, P, L)                              \
+__attribute__((target(TARGET)))                                                 \
+static void NAME(float *h, float *s, float *v, int n)                           \
+{                                                                               \
+    const VEC zero = P##_setzero_ps(), one = P##_set1_ps(1);                    \
+    const VEC four = P##_set1_ps(4), six = P##_set1_ps(6);                      \
+    const float sector[3] = {5, 3, 1};                                          \
+    int i = 0;                                                                  \
+    for (; i + L <= n; i += L) {                                                \
+        VEC vv = P##_loadu_ps(v + i);                                           \
+        VEC c = P##_mul_ps(P##_loadu_ps(s + i), vv);                            \
+        VEC h6 = P##_mul_ps(P##_loadu_ps(h + i), six);                          \
+        VEC out[3];                                                             \
+        for (int j = 0; j < 3; j++) {                                           \
+            VEC k = P##_add_ps(P##_set1_ps(sector[j]), h6);                     \
+            k = P##_sub_ps(k, P##_mul_ps(six,                                   \
+                    P##_floor_ps(P##_div_ps(k, six))));                         \
+            VEC t = P##_min_ps(k, P##_sub_ps(four, k));                         \
+            t = P##_min_ps(P##_max_ps(t, zero), one);                           \
+            out[j] = P##_sub_ps(vv, P##_mul_ps(c, t));                          \
+        }                                                                       \
+        P##_storeu_ps(h + i, out[0]);                                           \
+        P##_storeu_ps(s + i, out[1]);                                           \
+        P##_storeu_ps(v + i, out[2]);                                           \
+    }                                                                           \
+    hsv_to_rgb_scalar(h + i, s + i, v + i, n - i);                              \
+}
+
+#define CMPEQ256(a, b) _mm256_cmp_ps(a, b, _CMP_EQ_OQ)
+#define CMPLT256(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+
+RGB_TO_HSV_KERNEL(rgb_to_hsv_sse4, "sse4.1", __m128, _mm, 4, _mm_cmpeq_ps, _mm_cmplt_ps)
+RGB_TO_HSV_KERNEL(rgb_to_hsv_avx2, "avx2", __m256, _mm256, 8, CMPEQ256, CMPLT256)
+HSV_TO_RGB_KERNEL(hsv_to_rgb_sse4, "sse4.1", __m128, _mm, 4)
+HSV_TO_RGB_KERNEL(hsv_to_rgb_avx2, "avx2", __m256, _mm256, 8)
+#endif
+
+static color_kernel *rgb_to_hsv_kernel()
+{
+#ifdef SIMD_X86
+    if (simd_level() == SIMD_AVX2) return rgb_to_hsv_avx2;
+    if (simd_level() == SIMD_SSE4) return rgb_to_hsv_sse4;
+#endif
+    return rgb_to_hsv_scalar;
+}
+
+static color_kernel *hsv_to_rgb_kernel()
+{
+#ifdef SIMD_X86
+    if (simd_level() == SIMD_AVX2) return hsv_to_rgb_avx2;
+    if (simd_level() == SIMD_SSE4) return hsv_to_rgb_sse4;
+#endif
+    return hsv_to_rgb_scalar;
+}
+
+typedef struct{
+    image_view im;
+    color_kernel *fn;
+} color_job;
+
+static void color_rows(void *ctx, int start, int end)
+{
+    color_job *j = ctx;
+    image_view im = j->im;
+    if (im.ys == im.w) {
+        // Dense planes, one call covers the whole block of rows
+        float *p = im.data + start * im.w;
+        j->fn(p, p + im.cs, p + 2 * im.cs, (end - start) * im.w);
+        return;
+    }
+    for (int row = start; row < end; row++) {
+        float *p = im.data + row * im.ys;
+        j->fn(p, p + im.cs, p + 2 * im.cs, im.w);
+    }
+}
+
+// Run a batch color kernel over every row of a planar view.
+// returns: 1 if the view was planar and has been converted, 0 otherwise.
+static int planar_color_kernel(image_view im, color_kernel *fn)
+{
+    if (im.xs != 1) return 0;
+    color_job j = {im, fn};
+    parallel_for(im.h, 16, color_rows, &j);
+    return 1;
+}
+
 void rgb_to_hsv(image im)
 {
+    PROFILE_FUNC();
+    rgb_to_hsv_view(view_image(im));
+}
+
+static void rgb_to_hsv_rows(void *ctx, int start, int end)
+{
+    image_view im = *(image_view *)ctx;
     float hue, saturation, value;
     float r, g, b;
 
-    for (int row = 0; row < im.h; row++) {
+    for (int row = start; row < end; row++) {
         for (int col = 0; col < im.w; col++) {
-            r = get_pixel(im, col, row, 0);
-            g = get_pixel(im, col, row, 1);
-            b = get_pixel(im, col, row, 2);
+            float *p = im.data + col * im.xs + row * im.ys;
+            r = p[0];
+            g = p[im.cs];
+            b = p[2 * im.cs];
             
             // Value
             value = three_way_max(r, g, b);
@@ -143,23 +346,41 @@ void rgb_to_hsv(image im)
             }
 
             // Set to HSV
-            set_pixel(im, col, row, 0, hue);
-            set_pixel(im, col, row, 1, saturation);
-            set_pixel(im, col, row, 2, value);
+            p[0] = hue;
+            p[im.cs] = saturation;
+            p[2 * im.cs] = value;
         }
     }
 }
 
+// Convert a 3 channel view from RGB to HSV in place, in any layout.
+void rgb_to_hsv_view(image_view im)
+{
+    PROFILE_FUNC();
+    assert(im.c == 3);
+    PROFILE_BYTES(IMAGE_BYTES(im), IMAGE_BYTES(im));
+    if (planar_color_kernel(im, rgb_to_hsv_kernel())) return;
+    parallel_for(im.h, 16, rgb_to_hsv_rows, &im);
+}
+
 void hsv_to_rgb(image im)
 {
+    PROFILE_FUNC();
+    hsv_to_rgb_view(view_image(im));
+}
+
+static void hsv_to_rgb_rows(void *ctx, int start, int end)
+{
+    image_view im = *(image_view *)ctx;
     float hue, saturation, value;
     float r, g, b;
 
-    for (int row = 0; row < im.h; row++) {
+    for (int row = start; row < end; row++) {
         for (int col = 0; col < im.w; col++) {
-            hue = get_pixel(im, col, row, 0);
-            saturation = get_pixel(im, col, row, 1);
-            value = get_pixel(im, col, row, 2);
+            float *p = im.data + col * im.xs + row * im.ys;
+            hue = p[0];
+            saturation = p[im.cs];
+            value = p[2 * im.cs];
 
             float h, c, m;
             c = saturation * value;
@@ -207,10 +428,20 @@ void hsv_to_rgb(image im)
             }
 
             // set the pixel value
-            set_pixel(im, col, row, 0, r);
-            set_pixel(im, col, row, 1, g);
-            set_pixel(im, col, row, 2, b);
+            p[0] = r;
+            p[im.cs] = g;
+            p[2 * im.cs] = b;
         }
 
     }
-}
\ No newline at end of file
+}
+
+// Convert a 3 channel view from HSV to RGB in place, in any layout.
+void hsv_to_rgb_view(image_view im)
+{
+    PROFILE_FUNC();
+    assert(im.c == 3);
+    PROFILE_BYTES(IMAGE_BYTES(im), IMAGE_BYTES(im));
+    if (planar_color_kernel(im, hsv_to_rgb_kernel())) return;
+    parallel_for(im.h, 16, hsv_to_rgb_rows, &im);
+}
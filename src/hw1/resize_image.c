@@ -1,50 +1,305 @@
+#include <stdlib.h>
 #include <math.h>
+#include <assert.h>
 #include "image.h"
+#include "parallel.h"
+#include "profile.h"
+#include "simd.h"
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
 
-typedef float interpolateFn(image, float, float, int);
+// Resizing is separable: every output column reads the same source
+// columns with the same weights on every row, and every output row the
+// same source rows. The taps are worked out once per column and once per
+// row into a table, then a horizontal pass over whole source rows and a
+// vertical pass over whole output rows apply them to every channel.
 
-image resize(image im, int w, int h, interpolateFn fn) {
-    // Solve system of equations
-    float ax, ay, bx, by, xi, yi, val;
+// Taps of a 1d resampling from src samples to n.
+// int taps: number of taps of every output.
+// int *first: source index of each output's first tap. Taps can fall
+//             outside of the source, reads are clamped to its edges.
+// float *w: weights, tap major: w[k*n + i] is tap k of output i.
+typedef struct{
+    int src, n, taps;
+    int *first;
+    float *w;
+} resample_table;
 
-    image resized = make_image(w, h, im.c);
+// Source position of output i, the centers of the first and last pixels
+// of both lined up with the image edges.
+static void resample_map(int src, int n, float *a, float *b)
+{
+    *a = 1.0 * src / n;
+    *b = 0.5 * (*a - 1.0);
+}
+
+static resample_table make_table(int src, int n, int taps)
+{
+    resample_table t = {src, n, taps};
+    t.first = calloc(n, sizeof(int));
+    t.w = calloc((size_t)n * taps, sizeof(float));
+    return t;
+}
+
+static void free_table(resample_table t)
+{
+    free(t.first);
+    free(t.w);
+}
+
+static resample_table nn_table(int src, int n)
+{
+    resample_table t = make_table(src, n, 1);
+    float a, b;
+    resample_map(src, n, &a, &b);
+    for (int i = 0; i < n; i++) {
+        t.first[i] = roundf(a * i + b);
+        t.w[i] = 1;
+    }
+    return t;
+}
+
+static resample_table bilinear_table(int src, int n)
+{
+    resample_table t = make_table(src, n, 2);
+    float a, b;
+    resample_map(src, n, &a, &b);
+    for (int i = 0; i < n; i++) {
+        float x = a * i + b;
+        float left = floorf(x);
+        t.first[i] = left;
+        t.w[i] = 1 - (x - left);
+        t.w[n + i] = x - left;
+    }
+    return t;
+}
+
+// Each output averages the source pixels it covers, weighted by how much
+// of each it covers, pixel j covering [j, j + 1).
+static resample_table area_table(int src, int n)
+{
+    double a = (double)src / n;
+    int taps = 1;
+    for (int i = 0; i < n; i++) taps = MAX(taps, (int)ceil((i + 1) * a) - (int)floor(i * a));
+    resample_table t = make_table(src, n, taps);
+    for (int i = 0; i < n; i++) {
+        double lo = i * a, hi = (i + 1) * a;
+        t.first[i] = floor(lo);
+        for (int k = 0; k < taps; k++) {
+            int j = t.first[i] + k;
+            double cover = MIN(hi, j + 1) - MAX(lo, j);
+            t.w[k * n + i] = cover > 0 ? cover / a : 0;
+        }
+    }
+    return t;
+}
+
+// Keys' cubic convolution kernel with a = -0.5, support 2.
+static double cubic_kernel(double x, double radius)
+{
+    x = fabs(x);
+    if (x < 1) return (1.5 * x - 2.5) * x * x + 1;
+    if (x < 2) return ((-0.5 * x + 2.5) * x - 4) * x + 2;
+    return 0;
+}
+
+// Windowed sinc, sinc(x) sinc(x/radius) over |x| < radius.
+static double lanczos_kernel(double x, double radius)
+{
+    if (x == 0) return 1;
+    if (fabs(x) >= radius) return 0;
+    double px = M_PI * x;
+    return radius * sin(px) * sin(px / radius) / (px * px);
+}
+
+// Taps of a filter kernel with the given radius around each output's
+// source position. Shrinking stretches the kernel by the scale so it
+// still low-passes below the new sampling rate. Weights are normalized,
+// which keeps flat areas flat near the edges too.
+static resample_table filter_table(int src, int n, double (*kernel)(double, double), double radius)
+{
+    float a, b;
+    resample_map(src, n, &a, &b);
+    double scale = MAX(a, 1.0);
+    double support = radius * scale;
+    resample_table t = make_table(src, n, (int)ceil(2 * support));
+    for (int i = 0; i < n; i++) {
+        double x = a * i + b;
+        double sum = 0;
+        t.first[i] = (int)floor(x - support) + 1;
+        for (int k = 0; k < t.taps; k++) {
+            double wk = kernel((t.first[i] + k - x) / scale, radius);
+            t.w[k * n + i] = wk;
+            sum += wk;
+        }
+        for (int k = 0; k < t.taps; k++) t.w[k * n + i] /= sum;
+    }
+    return t;
+}
+
+// Resample one row. src is padded so every tap can be read unclamped.
+typedef void resample_kernel(const float *src, const int *first, const float *w, int stride,
+                             int n, int taps, float *dst);
+
+static void resample_row_scalar(const float *src, const int *first, const float *w, int stride,
+                                int n, int taps, float *dst)
+{
+    for (int i = 0; i < n; i++) {
+        const float *s = src + first[i];
+        float q = 0;
+        for (int k = 0; k < taps; k++) q += w[k * stride + i] * s[k];
+        dst[i] = q;
+    }
+}
+
+#ifdef SIMD_X86
+// Eight outputs at a time, each tap gathered from eight source positions.
+__attribute__((target("avx2")))
+static void resample_row_avx2(const float *src, const int *first, const float *w, int stride,
+                              int n, int taps, float *dst)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i idx = _mm256_loadu_si256((const __m256i *)(first + i));
+        __m256 q = _mm256_mul_ps(_mm256_loadu_ps(w + i), _mm256_i32gather_ps(src, idx, 4));
+        for (int k = 1; k < taps; k++) {
+            __m256 s = _mm256_i32gather_ps(src + k, idx, 4);
+            q = _mm256_add_ps(q, _mm256_mul_ps(_mm256_loadu_ps(w + k * stride + i), s));
+        }
+        _mm256_storeu_ps(dst + i, q);
+    }
+    resample_row_scalar(src, first + i, w + i, stride, n - i, taps, dst + i);
+}
+#endif
+
+static resample_kernel *resample_dispatch()
+{
+#ifdef SIMD_X86
+    if (simd_level() == SIMD_AVX2) return resample_row_avx2;
+#endif
+    return resample_row_scalar;
+}
+
+typedef struct{
+    image_view im, out;
+    resample_table *xt, *yt;
+    char *needed;
+    int pad;
+    image tmp;
+} resample_job;
 
-    // Solve for a
-    ax = 1.0 * im.w / w;
-    ay = 1.0 * im.h / h;
-;    
-    // Solve for b
-    // a(-0.5) + b = -0.5
-    // b = -0.5 + 0.5(a)
-    bx = 0.5 * (ax - 1.0);
-    by = 0.5 * (ay - 1.0);
-
-    // Iterate over new points
-    for (int row = 0; row < h; row++) {
-        for (int col = 0; col < w; col++) {
-            xi = ax * col + bx;
-            yi = ay * row + by;
-            for (int i = 0; i < im.c; i++) {
-                val = fn(im, xi, yi, i);
-                set_pixel(resized, col, row, i, val);
+// Horizontal pass over source rows [start, end) into tmp, skipping rows
+// the vertical pass gives no weight.
+static void resample_rows(void *ctx, int start, int end)
+{
+    resample_job *j = ctx;
+    image_view im = j->im;
+    resample_table *t = j->xt;
+    int pad = j->pad;
+    resample_kernel *kernel = resample_dispatch();
+    float *row = malloc((im.w + 2 * pad) * sizeof(float));
+    float *r = row + pad;
+    for (int y = start; y < end; y++) {
+        if (!j->needed[y]) continue;
+        for (int c = 0; c < im.c; c++) {
+            const float *s = view_ptr(im, 0, y, c);
+            for (int x = 0; x < im.w; x++) r[x] = s[x * im.xs];
+            for (int x = 1; x <= pad; x++) {
+                r[-x] = r[0];
+                r[im.w - 1 + x] = r[im.w - 1];
             }
+            float *d = j->tmp.data + ((size_t)c * im.h + y) * t->n;
+            kernel(r, t->first, t->w, t->n, t->n, t->taps, d);
         }
     }
+    free(row);
+}
 
-    return resized;
+// Vertical pass for output rows [start, end).
+static void resample_cols(void *ctx, int start, int end)
+{
+    resample_job *j = ctx;
+    image_view out = j->out;
+    image tmp = j->tmp;
+    resample_table *t = j->yt;
+    int w = out.w;
+    float *buf = malloc(w * sizeof(float));
+    for (int y = start; y < end; y++) {
+        for (int c = 0; c < out.c; c++) {
+            float *d = out.xs == 1 ? view_ptr(out, 0, y, c) : buf;
+            for (int k = 0; k < t->taps; k++) {
+                int sy = MIN(MAX(t->first[y] + k, 0), tmp.h - 1);
+                const float *s = tmp.data + ((size_t)c * tmp.h + sy) * w;
+                float wk = t->w[k * t->n + y];
+                if (k == 0) {
+                    for (int x = 0; x < w; x++) d[x] = wk * s[x];
+                } else {
+                    for (int x = 0; x < w; x++) d[x] += wk * s[x];
+                }
+            }
+            if (d == buf) {
+                float *o = view_ptr(out, 0, y, c);
+                for (int x = 0; x < w; x++) o[x * out.xs] = buf[x];
+            }
+        }
+    }
+    free(buf);
+}
+
+// Resample a view into another with a column table xt and a row table yt.
+static void resample_view(image_view im, image_view out, resample_table xt, resample_table yt)
+{
+    assert(im.c == out.c);
+    assert(xt.src == im.w && xt.n == out.w && yt.src == im.h && yt.n == out.h);
+    PROFILE_BYTES(IMAGE_BYTES(im), IMAGE_BYTES(out));
+    resample_job j = {im, out, &xt, &yt};
+    // Pad source rows by how far taps reach past either end
+    for (int i = 0; i < xt.n; i++) {
+        j.pad = MAX(j.pad, -xt.first[i]);
+        j.pad = MAX(j.pad, xt.first[i] + xt.taps - im.w);
+    }
+    j.needed = calloc(im.h, 1);
+    for (int y = 0; y < yt.n; y++) {
+        for (int k = 0; k < yt.taps; k++) {
+            if (yt.w[k * yt.n + y] != 0) j.needed[MIN(MAX(yt.first[y] + k, 0), im.h - 1)] = 1;
+        }
+    }
+    j.tmp = make_image(out.w, im.h, im.c);
+    parallel_for(im.h, 8, resample_rows, &j);
+    parallel_for(out.h, 8, resample_cols, &j);
+    free_image(j.tmp);
+    free(j.needed);
+}
+
+float nn_interpolate_view(image_view im, float x, float y, int c)
+{
+    return get_view_pixel(im, roundf(x), roundf(y), c);
 }
 
 float nn_interpolate(image im, float x, float y, int c)
 {
-    return get_pixel(im, roundf(x), roundf(y), c);
+    return nn_interpolate_view(view_image(im), x, y, c);
+}
+
+void nn_resize_view(image_view im, image_view out)
+{
+    PROFILE_FUNC();
+    resample_table xt = nn_table(im.w, out.w), yt = nn_table(im.h, out.h);
+    resample_view(im, out, xt, yt);
+    free_table(xt);
+    free_table(yt);
 }
 
 image nn_resize(image im, int w, int h)
 {
-    return resize(im, w, h, nn_interpolate);
+    PROFILE_FUNC();
+    image resized = make_image(w, h, im.c);
+    nn_resize_view(view_image(im), view_image(resized));
+    return resized;
 }
 
-float bilinear_interpolate(image im, float x, float y, int c)
+float bilinear_interpolate_view(image_view im, float x, float y, int c)
 {
     // float top, bottom, left, right;
     float top, bottom, left, right;
@@ -62,10 +317,12 @@ float bilinear_interpolate(image im, float x, float y, int c)
     // .                       .
     // bl......................br
 
+    // The far neighbors are always one pixel on, so whole coordinates get
+    // all of their weight from the near ones
     top = floorf(y);
-    bottom = ceilf(y);
+    bottom = top + 1;
     left = floorf(x);
-    right = ceilf(x);
+    right = left + 1;
 
     d1 = x - left;
     d2 = right - x;
@@ -73,13 +330,157 @@ float bilinear_interpolate(image im, float x, float y, int c)
     d4 = bottom - y;
 
     // Calculate q1 and q2 component for channel c
-    q1 = d4 * get_pixel(im, left, top, c) + d3 * get_pixel(im, left, bottom, c);
-    q2 = d4 * get_pixel(im, right, top, c) + d3 * get_pixel(im, right, bottom, c);
+    if (left >= 0 && top >= 0 && right < im.w && bottom < im.h) {
+        // All four neighbors inside, read them without clamping
+        float *tl = view_ptr(im, left, top, c);
+        float *bl = tl + (int)(bottom - top) * im.ys;
+        int dx = (int)(right - left) * im.xs;
+        q1 = d4 * tl[0] + d3 * bl[0];
+        q2 = d4 * tl[dx] + d3 * bl[dx];
+    } else {
+        q1 = d4 * get_view_pixel(im, left, top, c) + d3 * get_view_pixel(im, left, bottom, c);
+        q2 = d4 * get_view_pixel(im, right, top, c) + d3 * get_view_pixel(im, right, bottom, c);
+    }
 
     return d2 * q1 + d1 * q2;
 }
 
+float bilinear_interpolate(image im, float x, float y, int c)
+{
+    return bilinear_interpolate_view(view_image(im), x, y, c);
+}
+
+void bilinear_resize_view(image_view im, image_view out)
+{
+    PROFILE_FUNC();
+    resample_table xt = bilinear_table(im.w, out.w), yt = bilinear_table(im.h, out.h);
+    resample_view(im, out, xt, yt);
+    free_table(xt);
+    free_table(yt);
+}
+
 image bilinear_resize(image im, int w, int h)
 {
-    return resize(im, w, h, bilinear_interpolate);
-}
\ No newline at end of file
+    PROFILE_FUNC();
+    image resized = make_image(w, h, im.c);
+    bilinear_resize_view(view_image(im), view_image(resized));
+    return resized;
+}
+
+// Resize a view with Keys' bicubic kernel, sharper than bilinear with
+// little ringing.
+// image_view out: result, same number of channels, any size.
+void bicubic_resize_view(image_view im, image_view out)
+{
+    PROFILE_FUNC();
+    resample_table xt = filter_table(im.w, out.w, cubic_kernel, 2);
+    resample_table yt = filter_table(im.h, out.h, cubic_kernel, 2);
+    resample_view(im, out, xt, yt);
+    free_table(xt);
+    free_table(yt);
+}
+
+image bicubic_resize(image im, int w, int h)
+{
+    PROFILE_FUNC();
+    image resized = make_image(w, h, im.c);
+    bicubic_resize_view(view_image(im), view_image(resized));
+    return resized;
+}
+
+// Resize a view with a Lanczos kernel. Larger a keeps more detail at the
+// cost of more ringing near edges and more taps.
+// image_view out: result, same number of channels, any size.
+// int a: lobes of the kernel, usually 2 or 3.
+void lanczos_resize_view(image_view im, image_view out, int a)
+{
+    PROFILE_FUNC();
+    assert(a > 0);
+    resample_table xt = filter_table(im.w, out.w, lanczos_kernel, a);
+    resample_table yt = filter_table(im.h, out.h, lanczos_kernel, a);
+    resample_view(im, out, xt, yt);
+    free_table(xt);
+    free_table(yt);
+}
+
+image lanczos_resize(image im, int w, int h, int a)
+{
+    PROFILE_FUNC();
+    image resized = make_image(w, h, im.c);
+    lanczos_resize_view(view_image(im), view_image(resized), a);
+    return resized;
+}
+
+// Shrink a view by averaging the source area under each output pixel
+// exactly, fractional coverage included, so large reductions don't alias.
+// image_view im: view to shrink.
+// image_view out: result, same number of channels, any size.
+void area_resize_view(image_view im, image_view out)
+{
+    PROFILE_FUNC();
+    if (im.w == 2 * out.w && im.h == 2 * out.h) {
+        half_view(im, out);
+        return;
+    }
+    resample_table xt = area_table(im.w, out.w), yt = area_table(im.h, out.h);
+    resample_view(im, out, xt, yt);
+    free_table(xt);
+    free_table(yt);
+}
+
+image area_resize(image im, int w, int h)
+{
+    PROFILE_FUNC();
+    image resized = make_image(w, h, im.c);
+    area_resize_view(view_image(im), view_image(resized));
+    return resized;
+}
+
+typedef struct{
+    image_view im, out;
+} half_job;
+
+static void half_rows(void *ctx, int start, int end)
+{
+    half_job *j = ctx;
+    image_view im = j->im, out = j->out;
+    int n = im.w / 2;
+    for (int y = start; y < end; y++) {
+        for (int c = 0; c < im.c; c++) {
+            const float *r0 = view_ptr(im, 0, 2 * y, c);
+            const float *r1 = view_ptr(im, 0, MIN(2 * y + 1, im.h - 1), c);
+            float *d = view_ptr(out, 0, y, c);
+            if (im.xs == 1 && out.xs == 1) {
+                for (int x = 0; x < n; x++) d[x] = .25f * ((r0[2 * x] + r0[2 * x + 1]) + (r1[2 * x] + r1[2 * x + 1]));
+            } else {
+                for (int x = 0; x < n; x++) {
+                    int i = 2 * x * im.xs;
+                    d[x * out.xs] = .25f * ((r0[i] + r0[i + im.xs]) + (r1[i] + r1[i + im.xs]));
+                }
+            }
+            // An odd last column averages with itself
+            if (im.w & 1) d[n * out.xs] = .5f * (r0[2 * n * im.xs] + r1[2 * n * im.xs]);
+        }
+    }
+}
+
+// Shrink a view to half its size, averaging 2x2 blocks. Odd sizes round
+// up, their last row or column averaging with itself. One pass over the
+// source, so chains of halvings stay bound by memory bandwidth.
+// image_view out: (im.w + 1)/2 x (im.h + 1)/2 view, same channels.
+void half_view(image_view im, image_view out)
+{
+    PROFILE_FUNC();
+    assert(im.c == out.c && out.w == (im.w + 1) / 2 && out.h == (im.h + 1) / 2);
+    PROFILE_BYTES(IMAGE_BYTES(im), IMAGE_BYTES(out));
+    half_job j = {im, out};
+    parallel_for(out.h, 8, half_rows, &j);
+}
+
+image half_image(image im)
+{
+    PROFILE_FUNC();
+    image half = make_image((im.w + 1) / 2, (im.h + 1) / 2, im.c);
+    half_view(view_image(im), view_image(half));
+    return half;
+}
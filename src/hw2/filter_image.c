@@ -3,9 +3,20 @@
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <pthread.h>
 #include "image.h"
+#include "parallel.h"
+#include "profile.h"
+#include "simd.h"
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
 #define TWOPI 6.2831853
 #define K_DIM 3
+// Filters with at least this many taps that don't separate go through the
+// FFT. Timed with `uwimg bench` and random kernels: the two break even
+// around 11x11 to 13x13, a 15x15 disk is about twice as fast through the FFT.
+#define FFT_MIN_TAPS 169
 
 // Kernel values
 static float HIGHPASS_KERNEL[] = {
@@ -47,28 +58,20 @@ image make_filter(float* values, int dim) {
     return filter;
 }
 
+// Scale every channel of an image so it sums to 1.
 void l1_normalize(image im)
 {
-    float sum;
-    float val;
+    PROFILE_FUNC();
+    pixel_stats s[im.c];
+    channel_stats(view_image(im), s);
     for (int c = 0; c < im.c; c++) {
-        sum = 0.0;
-        for (int row = 0; row < im.h; row++) {
-            for (int col = 0; col < im.w; col++) {
-                sum += get_pixel(im, col, row, c);
-            }
-        }
-
-        for (int row = 0; row < im.h; row++) {
-            for (int col = 0; col < im.w; col++) {
-                val = (1.0 / sum) * get_pixel(im, col, row, c);
-                set_pixel(im, col, row, c, val);
-            }
-        }
+        float *d = im.data + (size_t)c * im.w * im.h;
+        float scale = 1.0 / s[c].sum;
+        for (int i = 0; i < im.w * im.h; i++) d[i] *= scale;
     }
 }
 
-image make_box_filter(int w)
+static image build_box_filter(int w)
 {
     image filter = make_image(w, w, 1);
     // Fill with ones
@@ -82,82 +85,438 @@ image make_box_filter(int w)
     return filter;
 }
 
+image make_box_filter(int w)
+{
+    PROFILE_FUNC();
+    return copy_kernel(KERNEL_BOX, w);
+}
+
 image convolve_image(image im, image filter, int preserve)
 {
+    PROFILE_FUNC();
     // Check that filter has 1 or the same number
     // of channels as im
     assert(im.c == filter.c || filter.c == 1);
     assert(preserve == 0 || preserve == 1);
-    float q;
-    image result;
 
     // Make image depending on preserve
-    if (preserve) {
-        result = make_image(im.w, im.h, im.c);
-    } else {
-        result = make_image(im.w, im.h, 1);
+    image result = make_image(im.w, im.h, preserve ? im.c : 1);
+    convolve_view(view_image(im), filter, preserve, view_image(result));
+
+    return result;
+}
+
+// Filter one pixel with clamped reads, used near the edges of an image.
+static float convolve_pixel_clamped(image_view im, float *src, float *f, int fw, int fh, int col, int row)
+{
+    float q = 0.0;
+    for (int fy = 0; fy < fh; fy++) {
+        int y = MIN(MAX(row - fh / 2 + fy, 0), im.h - 1);
+        float *srow = src + y * im.ys;
+        for (int fx = 0; fx < fw; fx++) {
+            int x = MIN(MAX(col - fw / 2 + fx, 0), im.w - 1);
+            q += f[fy * fw + fx] * srow[x * im.xs];
+        }
     }
+    return q;
+}
 
-    if (filter.c == im.c) {
-        for (int c = 0; c < im.c; c++) {
-            for (int row = 0; row < im.h; row++) {
-                for (int col = 0; col < im.w; col++) {
-                    q = 0.0;
-                    for (int fy = 0; fy < filter.h; fy++) {
-                        for (int fx = 0; fx < filter.w; fx++) {
-                            int x = col - ( (filter.w / 2) - fx );
-                            int y = row - ( (filter.h / 2) - fy );
-                            float f_val = get_pixel(filter, fx, fy, c);
-                            float i_val = get_pixel(im, x, y, c);
-                            q += f_val * i_val;
+typedef struct{
+    image_view im;
+    image filter;
+    int preserve;
+    image_view out;
+} convolve_job;
+
+// Filter rows [start, end) of every channel. Each block of rows gets its own
+// accumulator so blocks can run on different threads.
+static void convolve_rows(void *ctx, int start, int end)
+{
+    convolve_job *j = ctx;
+    image_view im = j->im;
+    image filter = j->filter;
+    image_view out = j->out;
+    int preserve = j->preserve;
+    int rx = filter.w / 2;
+    int ry = filter.h / 2;
+
+    // Pixels in [x0, x1) x [y0, y1) never read past the edges, so they can
+    // skip clamping and run tap by tap over whole row spans.
+    int x0 = MIN(rx, im.w);
+    int x1 = MAX(im.w - (filter.w - 1 - rx), x0);
+    int y0 = MIN(ry, im.h);
+    int y1 = MAX(im.h - (filter.h - 1 - ry), y0);
+    float *acc = calloc(im.w, sizeof(float));
+
+    for (int c = 0; c < im.c; c++) {
+        float *f = filter.data + (filter.c == 1 ? 0 : c * filter.w * filter.h);
+        float *src = im.data + c * im.cs;
+        float *dst = out.data + (preserve ? c * out.cs : 0);
+        // Without preserve every channel after the first sums into channel 0
+        int accumulate = !preserve && c > 0;
+
+        for (int row = start; row < end; row++) {
+            int interior = (row >= y0 && row < y1);
+            for (int col = 0; col < im.w; col++) {
+                if (interior && col == x0) col = x1;
+                if (col >= im.w) break;
+                acc[col] = convolve_pixel_clamped(im, src, f, filter.w, filter.h, col, row);
+            }
+            if (interior && x1 > x0) {
+                for (int col = x0; col < x1; col++) acc[col] = 0;
+                for (int fy = 0; fy < filter.h; fy++) {
+                    float *srow = src + (row - ry + fy) * im.ys;
+                    for (int fx = 0; fx < filter.w; fx++) {
+                        float fv = f[fy * filter.w + fx];
+                        float *s = srow + (fx - rx) * im.xs;
+                        if (im.xs == 1) {
+                            for (int col = x0; col < x1; col++) acc[col] += fv * s[col];
+                        } else {
+                            for (int col = x0; col < x1; col++) acc[col] += fv * s[col * im.xs];
                         }
                     }
-                    set_pixel(result, col, row, c, q);
                 }
             }
+            float *drow = dst + row * out.ys;
+            for (int col = 0; col < im.w; col++) {
+                float *d = drow + col * out.xs;
+                *d = accumulate ? *d + acc[col] : acc[col];
+            }
         }
-    } else if (filter.c == 1 && im.c > 1) {
-        // Apply the filter to each channel
-        for (int c = 0; c < im.c; c++) {
-            for (int row = 0; row < im.h; row++) {
-                for (int col = 0; col < im.w; col++) {
-                    q = 0.0;
-                    for (int fy = 0; fy < filter.h; fy++) {
-                        for (int fx = 0; fx < filter.w; fx++) {
-                            int x = col - ( (filter.w / 2) - fx );
-                            int y = row - ( (filter.h / 2) - fy );
-                            float f_val = get_pixel(filter, fx, fy, 0);
-                            float i_val = get_pixel(im, x, y, c);
-                            q += f_val * i_val;
-                        }
-                    }
-                    if (preserve) {
-                        set_pixel(result, col, row, c, q);
-                    } else {
-                        float curr_sum = get_pixel(result, col, row, 0);
-                        set_pixel(result, col, row, 0, curr_sum + q);
-                    }
-                }
+    }
+    free(acc);
+}
+
+// 3x3 filters, the gradients and the small stylistic kernels, get their own
+// engine. Rows are clamped by picking which source rows to read, so only
+// the first and last column of each row need clamped reads and everything
+// in between runs through one of the kernels below. r0, r1, r2 point at the
+// center column of the rows above, at and below the output row.
+typedef void convolve3_kernel(const float *r0, const float *r1, const float *r2, const float *f,
+                              float *dst, int n, int accumulate);
+
+static void convolve3_scalar(const float *r0, const float *r1, const float *r2, const float *f,
+                             float *dst, int n, int accumulate)
+{
+    for (int i = 0; i < n; i++) {
+        float q = f[0] * r0[i - 1] + f[1] * r0[i] + f[2] * r0[i + 1] +
+                  f[3] * r1[i - 1] + f[4] * r1[i] + f[5] * r1[i + 1] +
+                  f[6] * r2[i - 1] + f[7] * r2[i] + f[8] * r2[i + 1];
+        dst[i] = accumulate ? dst[i] + q : q;
+    }
+}
+
+#ifdef SIMD_X86
+// VEC is __m128 or __m256, P the matching intrinsic prefix and L the lane
+// count. The nine taps are broadcast once and stay in registers.
+#define CONVOLVE3_KERNEL(NAME, TARGET, VEC, P, L)                               \
+__attribute__((target(TARGET)))                                                 \
+static void NAME(const float *r0, const float *r1, const float *r2,             \
+                 const float *f, float *dst, int n, int accumulate)             \
+{                                                                               \
+    const VEC f0 = P##_set1_ps(f[0]), f1 = P##_set1_ps(f[1]);                   \
+    const VEC f2 = P##_set1_ps(f[2]), f3 = P##_set1_ps(f[3]);                   \
+    const VEC f4 = P##_set1_ps(f[4]), f5 = P##_set1_ps(f[5]);                   \
+    const VEC f6 = P##_set1_ps(f[6]), f7 = P##_set1_ps(f[7]);                   \
+    const VEC f8 = P##_set1_ps(f[8]);                                           \
+    int i = 0;                                                                  \
+    for (; i + L <= n; i += L) {                                                \
+        VEC a = P##_mul_ps(f0, P##_loadu_ps(r0 + i - 1));                       \
+        VEC b = P##_mul_ps(f3, P##_loadu_ps(r1 + i - 1));                       \
+        VEC c = P##_mul_ps(f6, P##_loadu_ps(r2 + i - 1));                       \
+        a = P##_add_ps(a, P##_mul_ps(f1, P##_loadu_ps(r0 + i)));                \
+        b = P##_add_ps(b, P##_mul_ps(f4, P##_loadu_ps(r1 + i)));                \
+        c = P##_add_ps(c, P##_mul_ps(f7, P##_loadu_ps(r2 + i)));                \
+        a = P##_add_ps(a, P##_mul_ps(f2, P##_loadu_ps(r0 + i + 1)));            \
+        b = P##_add_ps(b, P##_mul_ps(f5, P##_loadu_ps(r1 + i + 1)));            \
+        c = P##_add_ps(c, P##_mul_ps(f8, P##_loadu_ps(r2 + i + 1)));            \
+        VEC q = P##_add_ps(P##_add_ps(a, b), c);                                \
+        if (accumulate) q = P##_add_ps(q, P##_loadu_ps(dst + i));               \
+        P##_storeu_ps(dst + i, q);                                              \
+    }                                                                           \
+    convolve3_scalar(r0 + i, r1 + i, r2 + i, f, dst + i, n - i, accumulate);    \
+}
+
+CONVOLVE3_KERNEL(convolve3_sse2, "sse2", __m128, _mm, 4)
+CONVOLVE3_KERNEL(convolve3_avx2, "avx2", __m256, _mm256, 8)
+#endif
+
+static convolve3_kernel *convolve3_dispatch()
+{
+#ifdef SIMD_X86
+    if (simd_level() == SIMD_AVX2) return convolve3_avx2;
+    if (simd_level() == SIMD_SSE4) return convolve3_sse2;
+#endif
+    return convolve3_scalar;
+}
+
+// Filter rows [start, end) of every channel with a 3x3 filter. Rows of im
+// and out must be contiguous.
+static void convolve3_rows(void *ctx, int start, int end)
+{
+    convolve_job *j = ctx;
+    image_view im = j->im;
+    image_view out = j->out;
+    image filter = j->filter;
+    int preserve = j->preserve;
+    convolve3_kernel *kernel = convolve3_dispatch();
+
+    for (int c = 0; c < im.c; c++) {
+        float *f = filter.data + (filter.c == 1 ? 0 : c * 9);
+        float *src = im.data + c * im.cs;
+        float *dst = out.data + (preserve ? c * out.cs : 0);
+        int accumulate = !preserve && c > 0;
+        for (int row = start; row < end; row++) {
+            const float *r0 = src + MAX(row - 1, 0) * im.ys;
+            const float *r1 = src + row * im.ys;
+            const float *r2 = src + MIN(row + 1, im.h - 1) * im.ys;
+            float *d = dst + row * out.ys;
+            if (im.w > 2) kernel(r0 + 1, r1 + 1, r2 + 1, f, d + 1, im.w - 2, accumulate);
+            for (int col = 0; col < im.w; col += MAX(im.w - 1, 1)) {
+                float q = convolve_pixel_clamped(im, src, f, 3, 3, col, row);
+                d[col] = accumulate ? d[col] + q : q;
+            }
+        }
+    }
+}
+
+// Split a filter into a row and a column filter if every channel of it is
+// an outer product, i.e. has rank 1. The pivot is the largest tap: its row
+// and column must reproduce every other tap up to rounding.
+// image filter: filter to factor.
+// image *row, *col: set to a filter.w x 1 and a 1 x filter.h filter with
+//                   filter.c channels, only if the filter is separable.
+// returns: 1 if the filter was factored, 0 otherwise.
+int separate_filter(image filter, image *row, image *col)
+{
+    int fw = filter.w, fh = filter.h, n = fw * fh;
+    image r = make_image(fw, 1, filter.c);
+    image c = make_image(1, fh, filter.c);
+    for (int k = 0; k < filter.c; k++) {
+        float *f = filter.data + k * n;
+        int p = 0;
+        for (int i = 1; i < n; i++) if (fabsf(f[i]) > fabsf(f[p])) p = i;
+        int px = p % fw, py = p / fw;
+        float pivot = f[p];
+        float tol = 1e-5 * fabsf(pivot);
+        for (int x = 0; x < fw; x++) r.data[k * fw + x] = f[py * fw + x] / (pivot ? pivot : 1);
+        for (int y = 0; y < fh; y++) c.data[k * fh + y] = f[y * fw + px];
+        for (int i = 0; i < n; i++) {
+            if (fabsf(f[i] - r.data[k * fw + i % fw] * c.data[k * fh + i / fw]) > tol) {
+                free_image(r);
+                free_image(c);
+                return 0;
             }
         }
     }
+    *row = r;
+    *col = c;
+    return 1;
+}
 
-    return result;
+// Box filters, every tap of a channel the same, run as running sums: each
+// output adds the sample entering the window and subtracts the one leaving
+// it, a row pass then a column pass, so the cost doesn't depend on the
+// width of the box. Sums are kept in double so they don't drift along long
+// rows and columns.
+typedef struct{
+    image_view im;
+    int fw, fh;
+    const float *v;
+    int vc;
+    int preserve;
+    image_view sums;
+    image_view out;
+} box_job;
+
+// Fill v with the tap of each channel of filter if it's a box filter.
+// returns: 1 if every channel of filter is constant, 0 otherwise.
+static int box_taps(image filter, float *v)
+{
+    int n = filter.w * filter.h;
+    for (int c = 0; c < filter.c; c++) {
+        float *f = filter.data + c * n;
+        for (int i = 1; i < n; i++) {
+            if (f[i] != f[0]) return 0;
+        }
+        v[c] = f[0];
+    }
+    return 1;
+}
+
+// Window sums along rows [start, end) of every channel.
+static void box_rows(void *ctx, int start, int end)
+{
+    box_job *j = ctx;
+    image_view im = j->im;
+    int fw = j->fw, rx = fw / 2;
+    for (int c = 0; c < im.c; c++) {
+        for (int y = start; y < end; y++) {
+            const float *s = im.data + c * im.cs + y * im.ys;
+            float *d = j->sums.data + c * j->sums.cs + y * j->sums.ys;
+            double sum = 0;
+            for (int k = 0; k < fw; k++) sum += s[MIN(MAX(k - rx, 0), im.w - 1) * im.xs];
+            for (int x = 0; x < im.w; x++) {
+                d[x] = sum;
+                int in = MIN(x + 1 - rx + fw - 1, im.w - 1);
+                int out = MAX(x - rx, 0);
+                sum += s[in * im.xs] - s[out * im.xs];
+            }
+        }
+    }
+}
+
+// Window sums down the columns for output rows [start, end). Each block
+// of rows starts its own window so blocks can run on different threads.
+static void box_cols(void *ctx, int start, int end)
+{
+    box_job *j = ctx;
+    image_view im = j->im, out = j->out, sums = j->sums;
+    int fh = j->fh, ry = fh / 2;
+    double *acc = malloc(im.w * sizeof(double));
+    for (int c = 0; c < im.c; c++) {
+        const float *s = sums.data + c * sums.cs;
+        float v = j->v[j->vc == 1 ? 0 : c];
+        float *dst = out.data + (j->preserve ? c * out.cs : 0);
+        int accumulate = !j->preserve && c > 0;
+        for (int x = 0; x < im.w; x++) acc[x] = 0;
+        for (int k = 0; k < fh; k++) {
+            const float *r = s + MIN(MAX(start - ry + k, 0), im.h - 1) * sums.ys;
+            for (int x = 0; x < im.w; x++) acc[x] += r[x];
+        }
+        for (int y = start; y < end; y++) {
+            float *d = dst + y * out.ys;
+            for (int x = 0; x < im.w; x++) {
+                float q = v * acc[x];
+                d[x * out.xs] = accumulate ? d[x * out.xs] + q : q;
+            }
+            if (y + 1 == end) break;
+            const float *in = s + MIN(y + 1 - ry + fh - 1, im.h - 1) * sums.ys;
+            const float *old = s + MAX(y - ry, 0) * sums.ys;
+            for (int x = 0; x < im.w; x++) acc[x] += in[x] - old[x];
+        }
+    }
+    free(acc);
+}
+
+static void convolve_box(image_view im, image filter, const float *v, int preserve, image_view out)
+{
+    PROFILE_FUNC();
+    PROFILE_BYTES(IMAGE_BYTES(im), IMAGE_BYTES(out));
+    box_job j = {im, filter.w, filter.h, v, filter.c, preserve};
+    image sums = make_image(im.w, im.h, im.c);
+    j.sums = view_image(sums);
+    j.out = out;
+    parallel_for(im.h, 8, box_rows, &j);
+    parallel_for(im.h, MAX(64, filter.h), box_cols, &j);
+    free_image(sums);
+}
+
+// Convolve a view with a filter, writing into a caller supplied view.
+// Pixels outside of the view are clamped to its edges.
+// image_view im: view to filter.
+// image filter: filter with 1 channel or im.c channels.
+// int preserve: 1 keeps channels separate, 0 sums them into one channel.
+// image_view out: im.w x im.h view with im.c channels if preserve, else 1.
+//                 Must not overlap im.
+void convolve_view(image_view im, image filter, int preserve, image_view out)
+{
+    PROFILE_FUNC();
+    assert(im.c == filter.c || filter.c == 1);
+    assert(preserve == 0 || preserve == 1);
+    assert(out.w == im.w && out.h == im.h && out.c == (preserve ? im.c : 1));
+    if (filter.w == 3 && filter.h == 3 && im.xs == 1 && out.xs == 1) {
+        PROFILE_BYTES(IMAGE_BYTES(im), IMAGE_BYTES(out));
+        convolve_job j = {im, filter, preserve, out};
+        parallel_for(im.h, 16, convolve3_rows, &j);
+        return;
+    }
+    float v[filter.c];
+    if (filter.w * filter.h > 1 && box_taps(filter, v)) {
+        convolve_box(im, filter, v, preserve, out);
+        return;
+    }
+    // Rank 1 filters run as a row pass then a column pass, fw + fh taps a
+    // pixel instead of fw * fh. Clamping at the edges separates the same way.
+    image row, col;
+    if (filter.w > 1 && filter.h > 1 && filter.w * filter.h > 2 * (filter.w + filter.h) &&
+            separate_filter(filter, &row, &col)) {
+        image tmp = make_image(im.w, im.h, im.c);
+        convolve_view(im, row, 1, view_image(tmp));
+        convolve_view(view_image(tmp), col, preserve, out);
+        free_image(tmp);
+        free_image(row);
+        free_image(col);
+        return;
+    }
+    if (filter.w * filter.h >= FFT_MIN_TAPS) {
+        convolve_fft_view(im, filter, preserve, out);
+        return;
+    }
+    PROFILE_BYTES(IMAGE_BYTES(im), IMAGE_BYTES(out));
+    convolve_job j = {im, filter, preserve, out};
+    parallel_for(im.h, 8, convolve_rows, &j);
+}
+
+// Convolve rows [y0, y1) of a view on the calling thread. Only the rows
+// those outputs read are touched: y0 - filter.h/2 through
+// y1 - 1 + (filter.h - 1 - filter.h/2), clamped to the view, so im and out
+// can be strip_views of a larger image. Filters convolve_view would take
+// to the frequency domain are run tap by tap.
+void convolve_view_rows(image_view im, image filter, int preserve, image_view out, int y0, int y1)
+{
+    PROFILE_FUNC();
+    assert(im.c == filter.c || filter.c == 1);
+    assert(preserve == 0 || preserve == 1);
+    assert(out.w == im.w && out.h == im.h && out.c == (preserve ? im.c : 1));
+    assert(0 <= y0 && y0 <= y1 && y1 <= im.h);
+    if (y0 == y1) return;
+    int ry = filter.h / 2;
+    int r0 = MAX(y0 - ry, 0), r1 = MIN(y1 + filter.h - 1 - ry, im.h);
+    size_t held = (size_t)im.w * (r1 - r0) * im.c;
+    convolve_job j = {im, filter, preserve, out};
+    float v[filter.c];
+    image row, col;
+    if (filter.w == 3 && filter.h == 3 && im.xs == 1 && out.xs == 1) {
+        convolve3_rows(&j, y0, y1);
+    } else if (filter.w * filter.h > 1 && box_taps(filter, v)) {
+        box_job b = {im, filter.w, filter.h, v, filter.c, preserve};
+        float *sums = malloc(held * sizeof(float));
+        b.sums = strip_view(sums, im.w, im.h, im.c, r0, r1);
+        b.out = out;
+        box_rows(&b, r0, r1);
+        box_cols(&b, y0, y1);
+        free(sums);
+    } else if (filter.w > 1 && filter.h > 1 && filter.w * filter.h > 2 * (filter.w + filter.h) &&
+            separate_filter(filter, &row, &col)) {
+        float *buf = malloc(held * sizeof(float));
+        image_view tmp = strip_view(buf, im.w, im.h, im.c, r0, r1);
+        convolve_view_rows(im, row, 1, tmp, r0, r1);
+        convolve_view_rows(tmp, col, preserve, out, y0, y1);
+        free(buf);
+        free_image(row);
+        free_image(col);
+    } else {
+        convolve_rows(&j, y0, y1);
+    }
 }
 
 image make_highpass_filter()
 {
-    return make_filter(HIGHPASS_KERNEL, K_DIM);
+    PROFILE_FUNC();
+    return copy_kernel(KERNEL_HIGHPASS, 0);
 }
 
 image make_sharpen_filter()
 {
-    return make_filter(SHARPEN_KERNEL, K_DIM);
+    PROFILE_FUNC();
+    return copy_kernel(KERNEL_SHARPEN, 0);
 }
 
 image make_emboss_filter()
 {
-    return make_filter(EMBOSS_KERNEL, K_DIM);
+    PROFILE_FUNC();
+    return copy_kernel(KERNEL_EMBOSS, 0);
 }
 
 // Question 2.2.1: Which of these filters should we use preserve when we run our convolution and which ones should we not? Why?
@@ -175,7 +534,7 @@ image make_emboss_filter()
 //      by lower value pixels to exceed 1. And also the highpass filter projects the
 //      information of mutliple color channels into 1 channel.
 
-image make_gaussian_filter(float sigma)
+static image build_gaussian_filter(float sigma)
 {
     image filter;
     // Determine the size of filter
@@ -203,144 +562,544 @@ image make_gaussian_filter(float sigma)
     return filter;
 }
 
+// Creates a 1d Gaussian filter.
+// float sigma: standard deviation of Gaussian.
+// returns: single row image of the filter.
+static image build_1d_gaussian(float sigma)
+{
+    int size = roundf(6.0 * sigma);
+    size = (size % 2 == 0) ? size + 1 : size;
+    
+    image filter = make_image(size, 1, 1);
+    float v;
+    for (int i = 0; i < size; i++) {
+        // Adjust coordinates
+        int x = i - size / 2;
+        v = 1.0 / (sqrtf(TWOPI) * sigma);
+        v = v * expf(-1.0 * (x * x) / (2.0 * sigma * sigma));
+        set_pixel(filter, i, 0, 0, v);
+    }
+
+    l1_normalize(filter);
+    return filter;
+}
+
+// Kernels are built once per (type, parameter) and shared. The fixed 3x3
+// filters stay until exit. Gaussians and boxes, whose parameter callers
+// may sweep, are capped at KERNEL_CACHE entries and the least recently
+// used one is dropped when a new one comes in. Entries count their users,
+// one dropped while in use is freed by its last release_kernel.
+#define KERNEL_CACHE 16
+
+typedef struct kernel_entry {
+    kernel k;
+    int refs;
+    int dropped;
+    unsigned long used;
+    struct kernel_entry *next;
+} kernel_entry;
+
+static kernel_entry *kernels;
+static int n_kernels;
+static unsigned long kernel_clock;
+static pthread_mutex_t kernel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static image build_kernel(KERNEL type, float param)
+{
+    switch (type) {
+        case KERNEL_GAUSSIAN: return build_gaussian_filter(param);
+        case KERNEL_GAUSSIAN_1D: return build_1d_gaussian(param);
+        case KERNEL_BOX: return build_box_filter((int)param);
+        case KERNEL_HIGHPASS: return make_filter(HIGHPASS_KERNEL, K_DIM);
+        case KERNEL_SHARPEN: return make_filter(SHARPEN_KERNEL, K_DIM);
+        case KERNEL_EMBOSS: return make_filter(EMBOSS_KERNEL, K_DIM);
+        case KERNEL_GX: return make_filter(GX_KERNEL, K_DIM);
+        case KERNEL_GY: return make_filter(GY_KERNEL, K_DIM);
+    }
+    assert(0);
+    return make_image(0, 0, 0);
+}
+
+static int sweepable_kernel(KERNEL type)
+{
+    return type == KERNEL_GAUSSIAN || type == KERNEL_GAUSSIAN_1D || type == KERNEL_BOX;
+}
+
+static void free_kernel_entry(kernel_entry *e)
+{
+    free_image(e->k.filter);
+    free_image(e->k.row);
+    free_image(e->k.col);
+    free(e);
+}
+
+// Unlink the least recently used sweepable kernel. Call with kernel_lock held.
+static void drop_oldest_kernel()
+{
+    kernel_entry **p, **oldest = 0;
+    for (p = &kernels; *p; p = &(*p)->next) {
+        if (sweepable_kernel((*p)->k.type) && (!oldest || (*p)->used < (*oldest)->used)) oldest = p;
+    }
+    kernel_entry *e = *oldest;
+    *oldest = e->next;
+    n_kernels--;
+    if (e->refs) e->dropped = 1;
+    else free_kernel_entry(e);
+}
+
+// Get a shared, read only filter, building it on first use. The filters
+// are the ones the make_*_filter functions return copies of.
+// KERNEL type: which filter.
+// float param: sigma of Gaussians, width of boxes, ignored by the rest.
+// returns: kernel valid until passed to release_kernel, don't modify it.
+const kernel *get_kernel(KERNEL type, float param)
+{
+    if (!sweepable_kernel(type)) param = 0;
+    pthread_mutex_lock(&kernel_lock);
+    kernel_entry *e;
+    for (e = kernels; e; e = e->next) {
+        if (e->k.type == type && e->k.param == param) break;
+    }
+    if (!e) {
+        e = calloc(1, sizeof(kernel_entry));
+        kernel *k = &e->k;
+        k->type = type;
+        k->param = param;
+        k->filter = build_kernel(type, param);
+        image f = k->filter;
+        if (type == KERNEL_GAUSSIAN_1D) {
+            k->row = copy_image(f);
+            k->col = copy_image(f);
+            k->col.w = 1;
+            k->col.h = f.w;
+        } else if (f.w > 1 && f.h > 1) {
+            // Left 0 x 0 with no data if it doesn't separate
+            separate_filter(f, &k->row, &k->col);
+        }
+        e->next = kernels;
+        kernels = e;
+        if (sweepable_kernel(type) && ++n_kernels > KERNEL_CACHE) {
+            e->used = ++kernel_clock;
+            drop_oldest_kernel();
+        }
+    }
+    e->refs++;
+    e->used = ++kernel_clock;
+    pthread_mutex_unlock(&kernel_lock);
+    return &e->k;
+}
+
+// Give back a kernel from get_kernel.
+void release_kernel(const kernel *k)
+{
+    kernel_entry *e = (kernel_entry *)k;
+    pthread_mutex_lock(&kernel_lock);
+    int last = --e->refs == 0 && e->dropped;
+    pthread_mutex_unlock(&kernel_lock);
+    if (last) free_kernel_entry(e);
+}
+
+// Copy of a cached filter, see get_kernel.
+// returns: new image the caller owns.
+image copy_kernel(KERNEL type, float param)
+{
+    const kernel *k = get_kernel(type, param);
+    image f = copy_image(k->filter);
+    release_kernel(k);
+    return f;
+}
+
+image make_gaussian_filter(float sigma)
+{
+    PROFILE_FUNC();
+    return copy_kernel(KERNEL_GAUSSIAN, sigma);
+}
+
+// Recursive Gaussian of Young and van Vliet, "Recursive implementation of
+// the Gaussian filter" (1995). A causal and an anticausal third order pass
+// along each axis approximate the Gaussian at a fixed cost per pixel. Lines
+// are filtered IIR_LANES at a time, interleaved so the inner loops run
+// across lanes.
+#define IIR_LANES 8
+
+typedef struct {
+    float b, a1, a2, a3;
+    // Triggs and Sdika's matrix for the state at the right edge
+    float m[9];
+} iir_gauss;
+
+typedef struct {
+    image_view im;
+    image_view out;
+    iir_gauss g;
+    int vertical;
+} iir_job;
+
+static iir_gauss make_iir_gauss(float sigma)
+{
+    iir_gauss g;
+    double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+    double a1 = (2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q) / b0;
+    double a2 = -(1.4281 * q * q + 1.26661 * q * q * q) / b0;
+    double a3 = 0.422205 * q * q * q / b0;
+    double s = 1 / ((1 + a1 - a2 + a3) * (1 - a1 - a2 - a3) * (1 + a2 + (a1 - a3) * a3));
+    g.b = 1 - a1 - a2 - a3;
+    g.a1 = a1;
+    g.a2 = a2;
+    g.a3 = a3;
+    // Scaled by b so it maps forward pass offsets straight to outputs
+    s *= g.b;
+    g.m[0] = s * (1 - a3 * a1 - a3 * a3 - a2);
+    g.m[1] = s * (a3 + a1) * (a2 + a3 * a1);
+    g.m[2] = s * a3 * (a1 + a3 * a2);
+    g.m[3] = s * (a1 + a3 * a2);
+    g.m[4] = -s * (a2 - 1) * (a2 + a3 * a1);
+    g.m[5] = -s * a3 * (a3 * a1 + a3 * a3 + a2 - 1);
+    g.m[6] = s * (a3 * a1 + a2 + a1 * a1 - a2 * a2);
+    g.m[7] = s * (a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3 - a3 * a3 * a3 - a3 * a2 + a3);
+    g.m[8] = s * a3 * (a1 + a3 * a2);
+    return g;
+}
+
+// Filter IIR_LANES interleaved lines of n >= 3 samples in place. Outside
+// the line the samples repeat the edge ones, so both passes start from
+// their exact steady state.
+static void iir_lines(float *buf, int n, const iir_gauss *g)
+{
+    const int L = IIR_LANES;
+    float first[IIR_LANES], last[IIR_LANES], tail[3 * IIR_LANES];
+    float b = g->b, a1 = g->a1, a2 = g->a2, a3 = g->a3;
+    int l;
+    memcpy(first, buf, sizeof(first));
+    memcpy(last, buf + (n - 1) * L, sizeof(last));
+
+    for (int i = 0; i < n; i++) {
+        float *r = buf + i * L;
+        const float *r1 = i > 0 ? r - L : first;
+        const float *r2 = i > 1 ? r - 2 * L : first;
+        const float *r3 = i > 2 ? r - 3 * L : first;
+        for (l = 0; l < L; l++) r[l] = b * r[l] + a1 * r1[l] + a2 * r2[l] + a3 * r3[l];
+    }
+
+    // Outputs at n - 1, n and n + 1 from how far the forward pass is from
+    // the edge value at its end
+    const float *w0 = buf + (n - 1) * L, *w1 = w0 - L, *w2 = w0 - 2 * L;
+    for (int k = 0; k < 3; k++) {
+        const float *m = g->m + 3 * k;
+        for (l = 0; l < L; l++) {
+            tail[k * L + l] = last[l] + m[0] * (w0[l] - last[l]) + m[1] * (w1[l] - last[l]) + m[2] * (w2[l] - last[l]);
+        }
+    }
+    memcpy(buf + (n - 1) * L, tail, L * sizeof(float));
+
+    for (int i = n - 2; i >= 0; i--) {
+        float *r = buf + i * L;
+        const float *r1 = r + L;
+        const float *r2 = i + 2 < n ? r + 2 * L : tail + (i + 2 - (n - 1)) * L;
+        const float *r3 = i + 3 < n ? r + 3 * L : tail + (i + 3 - (n - 1)) * L;
+        for (l = 0; l < L; l++) r[l] = b * r[l] + a1 * r1[l] + a2 * r2[l] + a3 * r3[l];
+    }
+}
+
+// Smooth groups of IIR_LANES lines along x, or along y if vertical. Lines
+// are gathered into one buffer, padded to 3 samples and IIR_LANES lanes by
+// repeating the last one.
+static void iir_rows(void *ctx, int start, int end)
+{
+    iir_job *j = ctx;
+    image_view im = j->im, out = j->out;
+    int len = j->vertical ? im.h : im.w;
+    int lines = j->vertical ? im.w : im.h;
+    int groups = (lines + IIR_LANES - 1) / IIR_LANES;
+    int n = MAX(len, 3);
+    float *buf = malloc((size_t)n * IIR_LANES * sizeof(float));
+    int step = j->vertical ? im.ys : im.xs;
+    int ostep = j->vertical ? out.ys : out.xs;
+    int across = j->vertical ? im.xs : im.ys;
+    int oacross = j->vertical ? out.xs : out.ys;
+
+    for (int t = start; t < end; t++) {
+        int c = t / groups;
+        int first = (t % groups) * IIR_LANES;
+        int count = MIN(IIR_LANES, lines - first);
+        const float *src = im.data + c * im.cs + first * across;
+        float *dst = out.data + c * out.cs + first * oacross;
+        for (int i = 0; i < n; i++) {
+            const float *s = src + MIN(i, len - 1) * step;
+            float *b = buf + i * IIR_LANES;
+            int l;
+            for (l = 0; l < count; l++) b[l] = s[l * across];
+            for (; l < IIR_LANES; l++) b[l] = b[count - 1];
+        }
+        iir_lines(buf, n, &j->g);
+        for (int i = 0; i < len; i++) {
+            float *d = dst + i * ostep;
+            for (int l = 0; l < count; l++) d[l * oacross] = buf[i * IIR_LANES + l];
+        }
+    }
+    free(buf);
+}
+
+// Smooth a view with a recursive approximation of a Gaussian. The cost
+// per pixel doesn't depend on sigma. Pixels outside of the view are clamped
+// to its edges, as in convolve_view.
+// image_view im: view to smooth.
+// float sigma: std dev. of the Gaussian, at least 0.5.
+// image_view out: im.w x im.h x im.c view, may be im.
+void smooth_iir_view(image_view im, float sigma, image_view out)
+{
+    PROFILE_FUNC();
+    assert(out.w == im.w && out.h == im.h && out.c == im.c);
+    assert(sigma >= 0.5);
+    PROFILE_BYTES(IMAGE_BYTES(im), IMAGE_BYTES(out));
+    image tmp = make_image(im.w, im.h, im.c);
+    iir_job j = {im, view_image(tmp), make_iir_gauss(sigma), 0};
+    parallel_for(im.c * ((im.h + IIR_LANES - 1) / IIR_LANES), 1, iir_rows, &j);
+    j.im = view_image(tmp);
+    j.out = out;
+    j.vertical = 1;
+    parallel_for(im.c * ((im.w + IIR_LANES - 1) / IIR_LANES), 1, iir_rows, &j);
+    free_image(tmp);
+}
+
+image smooth_image_iir(image im, float sigma)
+{
+    PROFILE_FUNC();
+    image out = make_image(im.w, im.h, im.c);
+    smooth_iir_view(view_image(im), sigma, view_image(out));
+    return out;
+}
+
 image add_image(image a, image b)
 {
+    PROFILE_FUNC();
     // Check that images can actually be added
     assert(a.c == b.c && a.w == b.w && a.h == b.h);    
     image result = make_image(a.w, a.h, a.c);
-    float a_val;
-    float b_val;
-
-    for (int c = 0; c < a.c; c++) {
-        for (int row = 0; row < a.h; row++) {
-            for (int col = 0; col < a.w; col++) {
-                a_val = get_pixel(a, col, row, c);
-                b_val = get_pixel(b, col, row, c);
-                set_pixel(result, col, row, c, a_val + b_val);
-            }
-        }
-    }
-
+    add_image_into(a, b, result);
     return result;
 }
 
 image sub_image(image a, image b)
 {
+    PROFILE_FUNC();
     // Check that images can actually be added
     assert(a.c == b.c && a.w == b.w && a.h == b.h);    
     image result = make_image(a.w, a.h, a.c);
-    float a_val;
-    float b_val;
-
-    for (int c = 0; c < a.c; c++) {
-        for (int row = 0; row < a.h; row++) {
-            for (int col = 0; col < a.w; col++) {
-                a_val = get_pixel(a, col, row, c);
-                b_val = get_pixel(b, col, row, c);
-                set_pixel(result, col, row, c, a_val - b_val);
-            }
-        }
-    }
-
+    sub_image_into(a, b, result);
     return result;
 }
 
 image make_gx_filter()
 {
-    return make_filter(GX_KERNEL, K_DIM);
+    PROFILE_FUNC();
+    return copy_kernel(KERNEL_GX, 0);
 }
 
 image make_gy_filter()
 {
-    return make_filter(GY_KERNEL, K_DIM);
+    PROFILE_FUNC();
+    return copy_kernel(KERNEL_GY, 0);
 }
 
+// Stretch each channel of an image onto [0, 1] by its own min and max,
+// with the max taken as at least 0. Flat channels become 0.
 void feature_normalize(image im)
 {
-    float min = INFINITY;
-    float max = 0.0;
-    float val;
-
+    PROFILE_FUNC();
+    pixel_stats s[im.c];
+    channel_stats(view_image(im), s);
     for (int c = 0; c < im.c; c++) {
-        // Find the min and max of the image
-        for (int row = 0; row < im.h; row++) {
-            for (int col = 0; col < im.w; col++) {
-                val = get_pixel(im, col, row, c);
-                min = MIN(val, min);
-                max = MAX(val, max);
+        float *d = im.data + (size_t)c * im.w * im.h;
+        float min = s[c].min, max = MAX(s[c].max, 0);
+        float scale = max - min > 0 ? 1 / (max - min) : 0;
+        for (int i = 0; i < im.w * im.h; i++) d[i] = (d[i] - min) * scale;
+    }
+}
+
+typedef struct{
+    image_view im;
+    int flags;
+    image_view *out;
+} gradient_job;
+
+// atan2 to within 3e-6 radians, written without branches so a row of it
+// vectorizes. atan is a degree 11 odd minimax polynomial on [0, 1], the
+// octant and quadrant are fixed up after.
+static inline float fast_atan2(float y, float x)
+{
+    float ax = fabsf(x), ay = fabsf(y);
+    float hi = MAX(ax, ay), lo = MIN(ax, ay);
+    float a = hi > 0 ? lo / hi : 0;
+    float s = a * a;
+    float r = (((((-0.0117212f * s + 0.05265332f) * s - 0.11643287f) * s + 0.19354346f) * s
+                - 0.33262347f) * s + 0.99997726f) * a;
+    r = ay > ax ? 1.57079637f - r : r;
+    r = x < 0 ? 3.14159274f - r : r;
+    return copysignf(r, y);
+}
+
+// Sobel gradients of rows [start, end), summed over channels. The filters
+// separate: gx is the difference across columns of [1 2 1] column sums,
+// gy is [1 2 1] across columns of row differences. The column sums are
+// padded by one on each side, which clamps the edges the same way
+// convolve_view does.
+static void gradient_rows(void *ctx, int start, int end)
+{
+    gradient_job *j = ctx;
+    image_view im = j->im;
+    int w = im.w;
+    float *sum = malloc((w + 2) * sizeof(float));
+    float *diff = malloc((w + 2) * sizeof(float));
+    float *gx = malloc(w * sizeof(float));
+    float *gy = malloc(w * sizeof(float));
+    float *tmp = malloc(w * sizeof(float));
+    float *s = sum + 1, *d = diff + 1;
+
+    for (int row = start; row < end; row++) {
+        for (int x = 0; x < w; x++) s[x] = d[x] = 0;
+        for (int c = 0; c < im.c; c++) {
+            const float *r0 = im.data + c * im.cs + MAX(row - 1, 0) * im.ys;
+            const float *r1 = im.data + c * im.cs + row * im.ys;
+            const float *r2 = im.data + c * im.cs + MIN(row + 1, im.h - 1) * im.ys;
+            if (im.xs == 1) {
+                for (int x = 0; x < w; x++) {
+                    s[x] += r0[x] + 2 * r1[x] + r2[x];
+                    d[x] += r2[x] - r0[x];
+                }
+            } else {
+                for (int x = 0; x < w; x++) {
+                    int i = x * im.xs;
+                    s[x] += r0[i] + 2 * r1[i] + r2[i];
+                    d[x] += r2[i] - r0[i];
+                }
             }
         }
+        s[-1] = s[0];
+        s[w] = s[w - 1];
+        d[-1] = d[0];
+        d[w] = d[w - 1];
+        for (int x = 0; x < w; x++) {
+            gx[x] = s[x + 1] - s[x - 1];
+            gy[x] = d[x - 1] + 2 * d[x] + d[x + 1];
+        }
 
-        for (int row = 0; row < im.h; row++) {
-            for (int col = 0; col < im.w; col++) {
-                if (max - min > 0.0) {
-                    val = get_pixel(im, col, row, c);
-                    val = (val - min) / (max - min);
-                } else {
-                    val = 0.0;
-                }
-                set_pixel(im, col, row, c, val);
+        image_view *out = j->out;
+        for (int flag = GRADIENT_X; flag <= GRADIENT_XY; flag <<= 1) {
+            if (!(j->flags & flag)) continue;
+            image_view o = *out++;
+            float *dst = o.data + row * o.ys;
+            float *v = o.xs == 1 ? dst : tmp;
+            switch (flag) {
+                case GRADIENT_X: for (int x = 0; x < w; x++) v[x] = gx[x]; break;
+                case GRADIENT_Y: for (int x = 0; x < w; x++) v[x] = gy[x]; break;
+                case GRADIENT_MAG: for (int x = 0; x < w; x++) v[x] = sqrtf(gx[x] * gx[x] + gy[x] * gy[x]); break;
+                case GRADIENT_ANGLE: for (int x = 0; x < w; x++) v[x] = fast_atan2(gy[x], gx[x]); break;
+                case GRADIENT_XX: for (int x = 0; x < w; x++) v[x] = gx[x] * gx[x]; break;
+                case GRADIENT_YY: for (int x = 0; x < w; x++) v[x] = gy[x] * gy[x]; break;
+                case GRADIENT_XY: for (int x = 0; x < w; x++) v[x] = gx[x] * gy[x]; break;
             }
+            if (v != dst) for (int x = 0; x < w; x++) dst[x * o.xs] = v[x];
         }
     }
+    free(sum);
+    free(diff);
+    free(gx);
+    free(gy);
+    free(tmp);
+}
+
+// Sobel gradients of a view and any set of quantities derived from them,
+// in one sweep over the image. Channels are summed, like convolving with
+// make_gx_filter and make_gy_filter without preserve, and pixels outside
+// of the view are clamped.
+// image_view im: view to take gradients of.
+// int flags: GRADIENT values or'ed together.
+// image_view *out: one im.w x im.h single channel view for each flag set,
+//                  in the order the flags are declared.
+void gradient_view(image_view im, int flags, image_view *out)
+{
+    PROFILE_FUNC();
+    int n = 0;
+    for (int flag = GRADIENT_X; flag <= GRADIENT_XY; flag <<= 1) {
+        if (!(flags & flag)) continue;
+        assert(out[n].w == im.w && out[n].h == im.h && out[n].c == 1);
+        n++;
+    }
+    PROFILE_BYTES(IMAGE_BYTES(im), n * (size_t)im.w * im.h * sizeof(float));
+    gradient_job j = {im, flags, out};
+    parallel_for(im.h, 16, gradient_rows, &j);
+}
+
+// Sobel gradients of rows [y0, y1) on the calling thread, as gradient_view
+// computes them. Only rows y0 - 1 through y1 of im are read, clamped, so im
+// and out can be strip_views.
+void gradient_view_rows(image_view im, int flags, image_view *out, int y0, int y1)
+{
+    PROFILE_FUNC();
+    assert(0 <= y0 && y0 <= y1 && y1 <= im.h);
+    gradient_job j = {im, flags, out};
+    gradient_rows(&j, y0, y1);
+}
+
+// Sobel gradients of an image.
+// image im: image to take gradients of.
+// int flags: GRADIENT values or'ed together.
+// returns: image with one channel for each flag set, in declaration order.
+image gradient_image(image im, int flags)
+{
+    PROFILE_FUNC();
+    int n = 0;
+    image_view out[7];
+    for (int flag = GRADIENT_X; flag <= GRADIENT_XY; flag <<= 1) n += !!(flags & flag);
+    image g = make_image(im.w, im.h, n);
+    for (int k = 0; k < n; k++) out[k] = channel_view(view_image(g), k);
+    gradient_view(view_image(im), flags, out);
+    return g;
 }
 
 image *sobel_image(image im)
 {
-    // Prep
+    PROFILE_FUNC();
     image* result = calloc(2, sizeof(image));
     result[0] = make_image(im.w, im.h, 1); // magnitude
     result[1] = make_image(im.w, im.h, 1); // direction
-
-    image fx = make_gx_filter();
-    image fy = make_gy_filter();
-
-    image gx = convolve_image(im, fx, 0);
-    image gy = convolve_image(im, fy, 0);
-
-    float x, y;
-    for (int row = 0; row < im.h; row++) {
-        for (int col = 0; col < im.w; col++) {
-            x = get_pixel(gx, col, row, 0);
-            y = get_pixel(gy, col, row, 0);
-            set_pixel(result[0], col, row, 0, sqrtf(x * x + y * y));
-            set_pixel(result[1], col, row, 0, atan2f(y, x));
-        }
-    }
-
-    free_image(fx);
-    free_image(fy);
-    free_image(gx);
-    free_image(gy);
+    image_view out[2] = {view_image(result[0]), view_image(result[1])};
+    gradient_view(view_image(im), GRADIENT_MAG | GRADIENT_ANGLE, out);
     return result;
 }
 
-image colorize_sobel(image im)
+// Hue from the gradient angle, saturation and value from its magnitude,
+// then to rgb.
+static void sobel_colors(void *ctx, const image_view *in, image_view out)
 {
-    image result = make_image(im.w, im.h, im.c);
-    image filter = make_gaussian_filter(3.0);
-    im = convolve_image(im, filter, 1);
-    image* sobel = sobel_image(im);
-    float h, s;
-    
-    // Process as hsv
-    feature_normalize(sobel[0]);
-    feature_normalize(sobel[1]);
-    for (int row = 0; row < im.h; row++) {
-        for (int col = 0; col < im.w; col++) {
-            s = get_pixel(sobel[0], col, row, 0);
-            h = get_pixel(sobel[1], col, row, 0);
-            set_pixel(result, col, row, 0, h);
-            set_pixel(result, col, row, 1, s);
-            set_pixel(result, col, row, 2, s);
+    image_view g = in[0];
+    for (int row = 0; row < out.h; row++) {
+        for (int col = 0; col < out.w; col++) {
+            float s = view_at(g, col, row, 0);
+            *view_ptr(out, col, row, 0) = view_at(g, col, row, 1);
+            *view_ptr(out, col, row, 1) = s;
+            *view_ptr(out, col, row, 2) = s;
         }
     }
-    // Convert to rgb
-    hsv_to_rgb(result);
-
+    hsv_to_rgb_view(out);
+}
 
-    free_image(filter);
-    free_image(sobel[0]);
-    free_image(sobel[1]);
+// Runs as a pipeline: the blurred image only ever exists a strip at a
+// time, and normalizing, coloring and the conversion to rgb are one pass.
+image colorize_sobel(image im)
+{
+    PROFILE_FUNC();
+    pipeline *p = make_pipeline();
+    int in = pipe_input(p, view_image(im));
+    const kernel *g = get_kernel(KERNEL_GAUSSIAN, 3.0);
+    int blur = pipe_convolve(p, in, g->filter, 1);
+    release_kernel(g);
+    int sobel = pipe_gradient(p, blur, GRADIENT_MAG | GRADIENT_ANGLE);
+    int norm = pipe_normalize(p, sobel);
+    int rgb = pipe_map(p, &norm, 1, 3, sobel_colors, 0);
+    image result = run_pipeline(p, rgb);
+    free_pipeline(p);
     return result;
 }
@@ -5,15 +5,21 @@
 #include <assert.h>
 #include "image.h"
 #include "matrix.h"
+#include "parallel.h"
+#include "profile.h"
 #include <time.h>
 
 #define ALPHA 0.06
+// From here up the recursive Gaussian beats the separable one, whose cost
+// grows with the 6 sigma kernel. Below it the FIR is faster and closer.
+#define IIR_MIN_SIGMA 4
 
 // Frees an array of descriptors.
 // descriptor *d: the array.
 // int n: number of elements in array.
 void free_descriptors(descriptor *d, int n)
 {
+    PROFILE_FUNC();
     int i;
     for(i = 0; i < n; ++i){
         free(d[i].data);
@@ -38,11 +44,15 @@ descriptor describe_index(image im, int i)
     // If you want you can experiment with other descriptors
     // This subtracts the central value from neighbors
     // to compensate some for exposure/lighting changes.
+    int x = i%im.w;
+    int y = i/im.w;
+    // Windows fully inside the image skip get_pixel's clamping
+    int inside = x >= w/2 && y >= w/2 && x + w/2 < im.w && y + w/2 < im.h;
     for(c = 0; c < im.c; ++c){
         float cval = im.data[c*im.w*im.h + i];
         for(dx = -w/2; dx < (w+1)/2; ++dx){
             for(dy = -w/2; dy < (w+1)/2; ++dy){
-                float val = get_pixel(im, i%im.w+dx, i/im.w+dy, c);
+                float val = inside ? pixel_at(im, x+dx, y+dy, c) : get_pixel(im, x+dx, y+dy, c);
                 d.data[count++] = cval - val;
             }
         }
@@ -74,6 +84,7 @@ void mark_spot(image im, point p)
 // int n: number of descriptors to mark.
 void mark_corners(image im, descriptor *d, int n)
 {
+    PROFILE_FUNC();
     int i;
     for(i = 0; i < n; ++i){
         mark_spot(im, d[i].p);
@@ -85,21 +96,7 @@ void mark_corners(image im, descriptor *d, int n)
 // returns: single row image of the filter.
 image make_1d_gaussian(float sigma)
 {
-    int size = roundf(6.0 * sigma);
-    size = (size % 2 == 0) ? size + 1 : size;
-    
-    image filter = make_image(size, 1, 1);
-    float v;
-    for (int i = 0; i < size; i++) {
-        // Adjust coordinates
-        int x = i - size / 2;
-        v = 1.0 / (sqrtf(TWOPI) * sigma);
-        v = v * expf(-1.0 * (x * x) / (2.0 * sigma * sigma));
-        set_pixel(filter, i, 0, 0, v);
-    }
-
-    l1_normalize(filter);
-    return filter;
+    return copy_kernel(KERNEL_GAUSSIAN_1D, sigma);
 }
 
 // Smooths an image using separable Gaussian filter.
@@ -108,6 +105,8 @@ image make_1d_gaussian(float sigma)
 // returns: smoothed image.
 image smooth_image(image im, float sigma)
 {
+    PROFILE_FUNC();
+    if(sigma >= IIR_MIN_SIGMA) return smooth_image_iir(im, sigma);
     if(0){
         image g = make_gaussian_filter(sigma);
         image s = convolve_image(im, g, 1);
@@ -115,21 +114,12 @@ image smooth_image(image im, float sigma)
         return s;
     } else {
         // If you implement, disable the above if check.
-        image gx = make_1d_gaussian(sigma);
-        image gy = make_image(1, gx.w, 1);
-        // Flip N x 1 -> 1 x N
-        float v;
-        for (int i = 0; i < gy.h; i++) {
-            v = get_pixel(gx, i, 0, 0);
-            set_pixel(gy, 0, i, 0, v);
-        }
-
-        image sx = convolve_image(im, gx, 1);
-        image sy = convolve_image(sx, gy, 1);
-
-        free_image(gx);
-        free_image(gy);
+        // The cached kernel has the N x 1 and 1 x N filters ready
+        const kernel *g = get_kernel(KERNEL_GAUSSIAN_1D, sigma);
+        image sx = convolve_image(im, g->row, 1);
+        image sy = convolve_image(sx, g->col, 1);
         free_image(sx);
+        release_kernel(g);
 
         return sy;
     }
@@ -142,47 +132,39 @@ image smooth_image(image im, float sigma)
 //          third channel is IxIy.
 image structure_matrix(image im, float sigma)
 {
+    PROFILE_FUNC();
+    return structure_matrix_view(view_image(im), sigma);
+}
+
+// Calculate the structure matrix of a region of an image.
+// image_view im: the input region, pixels outside it are clamped.
+// float sigma: std dev. to use for weighted sum.
+// returns: structure matrix of the region, same layout as structure_matrix.
+image structure_matrix_view(image_view im, float sigma)
+{
+    PROFILE_FUNC();
     image S = make_image(im.w, im.h, 3);
-    float x, y;
-    
-    // Derivative
-    image fx = make_gx_filter();
-    image fy = make_gy_filter();
-    image ix = convolve_image(im, fx, 0);
-    image iy = convolve_image(im, fy, 0);
-    
-    // Calculate IxIx, IyIy, IxIy
-    for (int row = 0; row < im.h; row++) {
-        for (int col = 0; col < im.w; col++) {
-            x = get_pixel(ix, col, row, 0);
-            y = get_pixel(iy, col, row, 0);
 
-            set_pixel(S, col, row, 0, x * x);
-            set_pixel(S, col, row, 1, y * y);
-            set_pixel(S, col, row, 2, x * y);
-        }
-    }
+    // Calculate IxIx, IyIy, IxIy straight from the image
+    image_view products[3];
+    for (int c = 0; c < 3; c++) products[c] = channel_view(view_image(S), c);
+    gradient_view(im, GRADIENT_XX | GRADIENT_YY | GRADIENT_XY, products);
 
     // Weighted Sum of Nearby
-    S = smooth_image(S, sigma);
-
-    return S;
+    image smoothed = smooth_image(S, sigma);
+    free_image(S);
+    return smoothed;
 }
 
-// Estimate the cornerness of each pixel given a structure matrix S.
-// image S: structure matrix for an image.
-// returns: a response map of cornerness calculations.
-image cornerness_response(image S)
+static void cornerness_rows(void *ctx, int start, int end)
 {
-    image R = make_image(S.w, S.h, 1);
-    // TODO: fill in R, "cornerness" for each pixel using the structure matrix.
-    // We'll use formulation det(S) - alpha * trace(S)^2, alpha = .06.
-
+    image *io = ctx;
+    image S = io[0], R = io[1];
     // Each pixel has structure matrix
     // | a  b |  ->  | IxIx  IxIy |
     // | c  d |      | IxIy  IyIy |
     float det, trace, a, b, d;
-    for (int row = 0; row < S.h; row++) {
+    for (int row = start; row < end; row++) {
         for (int col = 0; col < S.w; col++) {
             // Determinant: ad - bc, here b == c, ad - bb
             a = get_pixel(S, col, row, 0); // wIxIx
@@ -197,27 +179,49 @@ image cornerness_response(image S)
             set_pixel(R, col, row, 0, det - ALPHA * trace * trace);
         }
     }
+}
 
+// Estimate the cornerness of each pixel given a structure matrix S.
+// image S: structure matrix for an image.
+// returns: a response map of cornerness calculations.
+image cornerness_response(image S)
+{
+    PROFILE_FUNC();
+    image R = make_image(S.w, S.h, 1);
+    // TODO: fill in R, "cornerness" for each pixel using the structure matrix.
+    // We'll use formulation det(S) - alpha * trace(S)^2, alpha = .06.
+    image io[2] = {S, R};
+    parallel_for(S.h, 16, cornerness_rows, io);
     return R;
 }
 
-// Perform non-max supression on an image of feature responses.
-// image im: 1-channel image of feature responses.
-// int w: distance to look for larger responses.
-// returns: image with only local-maxima responses within w pixels.
-image nms_image(image im, int w)
+typedef struct{
+    image im, r;
+    int w;
+} nms_job;
+
+static void nms_rows(void *ctx, int start, int end)
 {
-    assert(im.c == 1 && w >= 1);
-    image r = copy_image(im);
-    // TODO: perform NMS on the response map.
-    // for every pixel in the image:
-    //     for neighbors within w:
-    //         if neighbor response greater than pixel response:
-    //             set response to be very low (I use -999999 [why not 0??])
+    nms_job *j = ctx;
+    image im = j->im, r = j->r;
+    int w = j->w;
     float v, nbr;
-    for (int row = 0; row < im.h; row++) {
+    for (int row = start; row < end; row++) {
+        int inside_y = row >= w && row + w < im.h;
         for (int col = 0; col < im.w; col++) {
-            v = get_pixel(im, col, row, 0);
+            v = pixel_at(im, col, row, 0);
+            if (inside_y && col >= w && col + w < im.w) {
+                // Whole window inside the image, no clamping needed
+                float m = v;
+                for (int y = row - w; y <= row + w; y++) {
+                    float *nrow = im.data + y * im.w;
+                    for (int x = col - w; x <= col + w; x++) {
+                        m = MAX(m, nrow[x]);
+                    }
+                }
+                if (m > v) r.data[col + row * im.w] = -999999;
+                continue;
+            }
             for (int y = row - w; y <= row + w; y++) {
                 for (int x = col - w; x <= col + w; x++) {
                     // Check Neighbors
@@ -229,10 +233,39 @@ image nms_image(image im, int w)
             }
         }
     }
+}
+
+// Perform non-max supression on an image of feature responses.
+// image im: 1-channel image of feature responses.
+// int w: distance to look for larger responses.
+// returns: image with only local-maxima responses within w pixels.
+image nms_image(image im, int w)
+{
+    assert(im.c == 1 && w >= 1);
+    image r = copy_image(im);
+    // TODO: perform NMS on the response map.
+    // for every pixel in the image:
+    //     for neighbors within w:
+    //         if neighbor response greater than pixel response:
+    //             set response to be very low (I use -999999 [why not 0??])
+    nms_job j = {im, r, w};
+    parallel_for(im.h, 16, nms_rows, &j);
     
     return r;
 }
 
+typedef struct{
+    image im;
+    int *index;
+    descriptor *d;
+} describe_job;
+
+static void describe_range(void *ctx, int start, int end)
+{
+    describe_job *j = ctx;
+    for (int i = start; i < end; i++) j->d[i] = describe_index(j->im, j->index[i]);
+}
+
 // Perform harris corner detection and extract features from the corners.
 // image im: input image.
 // float sigma: std. dev for harris.
@@ -242,6 +275,7 @@ image nms_image(image im, int w)
 // returns: array of descriptors of the corners in the image.
 descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n)
 {
+    PROFILE_FUNC();
     // Calculate structure matrix
     image S = structure_matrix(im, sigma);
 
@@ -266,15 +300,17 @@ descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms,
     descriptor *d = calloc(count, sizeof(descriptor));
     //TODO: fill in array *d with descriptors of corners, use describe_index.
     int i = 0;
+    int *index = calloc(count, sizeof(int));
     for (int row = 0; row < Rnms.h; row++) {
         for (int col = 0; col < Rnms.w; col++) {
             if (get_pixel(Rnms, col, row, 0) > thresh) {
-                int index = col + (row * im.w);
-                *(d + i) = describe_index(Rnms, index);
-                i++;
+                index[i++] = col + (row * im.w);
             }
         }
     }
+    describe_job j = {Rnms, index, d};
+    parallel_for(i, 64, describe_range, &j);
+    free(index);
 
     free_image(S);
     free_image(R);
@@ -289,6 +325,7 @@ descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms,
 // int nms: distance to look for local-maxes in response map.
 void detect_and_draw_corners(image im, float sigma, float thresh, int nms)
 {
+    PROFILE_FUNC();
     int n = 0;
     descriptor *d = harris_corner_detector(im, sigma, thresh, nms, &n);
     mark_corners(im, d, n);
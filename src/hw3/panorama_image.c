@@ -5,6 +5,7 @@
 #include <assert.h>
 #include "image.h"
 #include "matrix.h"
+#include "profile.h"
 
 // Comparator for matches
 // const void *a, *b: pointers to the matches to compare.
@@ -34,21 +35,9 @@ point make_point(float x, float y)
 image both_images(image a, image b)
 {
     image both = make_image(a.w + b.w, a.h > b.h ? a.h : b.h, a.c > b.c ? a.c : b.c);
-    int i,j,k;
-    for(k = 0; k < a.c; ++k){
-        for(j = 0; j < a.h; ++j){
-            for(i = 0; i < a.w; ++i){
-                set_pixel(both, i, j, k, get_pixel(a, i, j, k));
-            }
-        }
-    }
-    for(k = 0; k < b.c; ++k){
-        for(j = 0; j < b.h; ++j){
-            for(i = 0; i < b.w; ++i){
-                set_pixel(both, i+a.w, j, k, get_pixel(b, i, j, k));
-            }
-        }
-    }
+    image_view canvas = view_image(both);
+    copy_view(crop_view(canvas, 0, 0, a.w, a.h), view_image(a));
+    copy_view(crop_view(canvas, a.w, 0, b.w, b.h), view_image(b));
     return both;
 }
 
@@ -94,6 +83,7 @@ image draw_inliers(image a, image b, matrix H, match *m, int n, float thresh)
 // int nms: window to perform nms on. Typical: 3
 image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms)
 {
+    PROFILE_FUNC();
     int an = 0;
     int bn = 0;
     int mn = 0;
@@ -134,6 +124,7 @@ float l1_distance(float *a, float *b, int n)
 //          one other descriptor in b.
 match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn)
 {
+    PROFILE_FUNC();
     int i,j;
 
     // We will have at most an matches.
@@ -236,6 +227,7 @@ float point_distance(point p, point q)
 //          so that the inliers are first in the array. For drawing.
 int model_inliers(matrix H, match *m, int n, float thresh)
 {
+    PROFILE_FUNC();
     int i;
     int count = 0;
     // TODO: count number of matches that are inliers
@@ -287,6 +279,7 @@ void randomize_matches(match *m, int n)
 // returns: matrix representing homography H that maps image a to image b.
 matrix compute_homography(match *matches, int n)
 {
+    PROFILE_FUNC();
     matrix M = make_matrix(n*2, 8);
     matrix b = make_matrix(n*2, 1);
 
@@ -373,31 +366,33 @@ matrix RANSAC(match *m, int n, float thresh, int k, int cutoff)
         free_matrix(h);
 
         if (inlierCount > best) {
+            free_matrix(Hb);
             Hb = compute_homography(m, inlierCount);
+            best = inlierCount;
             if (inlierCount > cutoff) {
                 return Hb;
             }
-            free_matrix(Hb);
-            best = inlierCount;
         }
     }
 
     return Hb;
 }
 
-// Stitches two images together using a projective transformation.
-// image a, b: images to stitch.
+// Finds the canvas that holds image a and image b warped into a's frame.
+// int aw, ah, bw, bh: sizes of images a and b.
 // matrix H: homography from image a coordinates to image b coordinates.
-// returns: combined image stitched together.
-image combine_images(image a, image b, matrix H)
+// int *dx, *dy: filled with the offset of the canvas from image a.
+// int *w, *h: filled with the size of the canvas.
+static void canvas_bounds(int aw, int ah, int bw, int bh, matrix H, int *dx, int *dy, int *w, int *h)
 {
     matrix Hinv = matrix_invert(H);
 
     // Project the corners of image b into image a coordinates.
     point c1 = project_point(Hinv, make_point(0,0));
-    point c2 = project_point(Hinv, make_point(b.w-1, 0));
-    point c3 = project_point(Hinv, make_point(0, b.h-1));
-    point c4 = project_point(Hinv, make_point(b.w-1, b.h-1));
+    point c2 = project_point(Hinv, make_point(bw-1, 0));
+    point c3 = project_point(Hinv, make_point(0, bh-1));
+    point c4 = project_point(Hinv, make_point(bw-1, bh-1));
+    free_matrix(Hinv);
 
     // Find top left and bottom right corners of image b warped into image a.
     point topleft, botright;
@@ -407,10 +402,21 @@ image combine_images(image a, image b, matrix H)
     topleft.y = MIN(c1.y, MIN(c2.y, MIN(c3.y, c4.y)));
 
     // Find how big our new image should be and the offsets from image a.
-    int dx = MIN(0, topleft.x);
-    int dy = MIN(0, topleft.y);
-    int w = MAX(a.w, botright.x) - dx;
-    int h = MAX(a.h, botright.y) - dy;
+    *dx = MIN(0, topleft.x);
+    *dy = MIN(0, topleft.y);
+    *w = MAX(aw, botright.x) - *dx;
+    *h = MAX(ah, botright.y) - *dy;
+}
+
+// Stitches two images together using a projective transformation.
+// image a, b: images to stitch.
+// matrix H: homography from image a coordinates to image b coordinates.
+// returns: combined image stitched together.
+image combine_images(image a, image b, matrix H)
+{
+    PROFILE_FUNC();
+    int dx, dy, w, h;
+    canvas_bounds(a.w, a.h, b.w, b.h, H, &dx, &dy, &w, &h);
 
     // Can disable this if you are making very big panoramas.
     // Usually this means there was an error in calculating H.
@@ -423,15 +429,7 @@ image combine_images(image a, image b, matrix H)
     image c = make_image(w, h, a.c);
     
     // Paste image a into the new image offset by dx and dy.
-    for(k = 0; k < a.c; k++){
-        for(j = 0; j < a.h; j++){
-            for(i = 0; i < a.w; i++){
-                // TODO: fill in.
-                float val = get_pixel(a, i, j, k);
-                set_pixel(c, i - dx, j - dy, k, val);
-            }
-        }
-    }
+    copy_view(crop_view(view_image(c), -dx, -dy, a.w, a.h), view_image(a));
 
     // TODO: Paste in image b as well.
     // You should loop over some points in the new image (which? all?)
@@ -457,6 +455,48 @@ image combine_images(image a, image b, matrix H)
     return c;
 }
 
+// Stitches two packed images together, like combine_images but building the
+// canvas a row at a time so only one float row is ever held per channel.
+// packed_image a, b: images to stitch, the canvas uses a's storage type.
+// matrix H: homography from image a coordinates to image b coordinates.
+// returns: combined packed image.
+packed_image combine_packed(packed_image a, packed_image b, matrix H)
+{
+    PROFILE_FUNC();
+    int dx, dy, w, h;
+    canvas_bounds(a.w, a.h, b.w, b.h, H, &dx, &dy, &w, &h);
+    int toobig = w > 7000 || h > 7000;
+    if(toobig){
+        fprintf(stderr, "output too big, stopping\n");
+        w = a.w;
+        h = a.h;
+        dx = dy = 0;
+    }
+
+    packed_image c = make_packed_image(w, h, a.c, a.type);
+    float *row = calloc(w*a.c, sizeof(float));
+    int i, j, k;
+    for(j = 0; j < h; j++){
+        memset(row, 0, w*a.c*sizeof(float));
+        // Paste image a's row offset by dx and dy
+        int ay = j + dy;
+        if(ay >= 0 && ay < a.h){
+            for(k = 0; k < a.c; k++) load_packed_row(a, ay, k, row + k*w - dx);
+        }
+        for(i = 0; i < w && !toobig; i++){
+            point p = project_point(H, make_point(i + dx, j + dy));
+            if((0 <= p.x && p.x < b.w) && (0 <= p.y && p.y < b.h)){
+                for(k = 0; k < a.c && k < b.c; k++){
+                    row[k*w + i] = bilinear_interpolate_packed(b, p.x, p.y, k);
+                }
+            }
+        }
+        for(k = 0; k < a.c; k++) store_packed_row(c, j, k, row + k*w);
+    }
+    free(row);
+    return c;
+}
+
 // Create a panoramam between two images.
 // image a, b: images to stitch together.
 // float sigma: gaussian for harris corner detector. Typical: 2
@@ -467,6 +507,7 @@ image combine_images(image a, image b, matrix H)
 // int cutoff: RANSAC inlier cutoff. Typical: 10-100
 image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff)
 {
+    PROFILE_FUNC();
     srand(10);
     int an = 0;
     int bn = 0;
@@ -505,6 +546,7 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms, float
 // returns: image projected onto cylinder, then flattened.
 image cylindrical_project(image im, float f)
 {
+    PROFILE_FUNC();
     //TODO: project image onto a cylinder
     image c = copy_image(im);
     return c;
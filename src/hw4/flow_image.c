@@ -5,6 +5,8 @@
 #include <assert.h>
 #include "image.h"
 #include "matrix.h"
+#include "parallel.h"
+#include "profile.h"
 
 // Draws a line on an image with color corresponding to the direction of line
 // image im: image to draw line on
@@ -41,15 +43,12 @@ void draw_line(image im, float x, float y, float dx, float dy)
     }
 }
 
-// Make an integral image or summed area table from an image
-// image im: image to process
-// returns: image I such that I[x,y] = sum{i<=x, j<=y}(im[i,j])
-image make_integral_image(image im)
+static void integral_channels(void *ctx, int start, int end)
 {
-    image integ = make_image(im.w, im.h, im.c);
-    // TODO: fill in the integral image
+    image *io = ctx;
+    image im = io[0], integ = io[1];
     float i, above, left, topleft, val;
-    for (int c = 0; c < integ.c; c++) {
+    for (int c = start; c < end; c++) {
         for (int y = 0; y < integ.h; y++) {
             for (int x = 0; x < integ.w; x++) {
                 i = get_pixel(im, x, y, c);
@@ -64,32 +63,44 @@ image make_integral_image(image im)
             }
         }
     }
+}
+
+// Make an integral image or summed area table from an image
+// image im: image to process
+// returns: image I such that I[x,y] = sum{i<=x, j<=y}(im[i,j])
+image make_integral_image(image im)
+{
+    PROFILE_FUNC();
+    image integ = make_image(im.w, im.h, im.c);
+    // TODO: fill in the integral image
+    // Rows depend on the rows above, so channels are the unit of work
+    image io[2] = {im, integ};
+    parallel_for(integ.c, 1, integral_channels, io);
 
     return integ;
 }
 
-// Apply a box filter to an image using an integral image for speed
-// image im: image to smooth
-// int s: window size for box filter
-// returns: smoothed image
-image box_filter_image(image im, int s)
+typedef struct{
+    image integ, S;
+    int s;
+} box_job;
+
+static void box_rows(void *ctx, int start, int end)
 {
-    int i,j,k;
-    image integ = make_integral_image(im);
-    image S = make_image(im.w, im.h, im.c);
-    // TODO: fill in S using the integral image.
+    box_job *j = ctx;
+    image integ = j->integ, S = j->S;
     float A, B, C, D;
     int top, bottom, left, right;
     float val, area;
-    int half = s / 2;
-    for (int c = 0; c < im.c; c++) {
-        for (int y = 0; y < im.h; y++) {
-            for (int x = 0; x < im.w; x++) {
+    int half = j->s / 2;
+    for (int c = 0; c < S.c; c++) {
+        for (int y = start; y < end; y++) {
+            for (int x = 0; x < S.w; x++) {
                 // Get x and y coordinates of corners
                 left = (x < half) ? 0 : x - half - 1;
-                right = (x + half > im.w) ? im.w - 1 : x + half;
+                right = (x + half > S.w) ? S.w - 1 : x + half;
                 top = (y < half) ? 0 : y - half - 1;
-                bottom = (y + half > im.h - 1) ? im.h - 1 : y + half;
+                bottom = (y + half > S.h - 1) ? S.h - 1 : y + half;
 
                 // Calculate area based on number of valid pixels
                 area = (bottom - top) * (right - left);
@@ -108,11 +119,47 @@ image box_filter_image(image im, int s)
             }
         }
     }
+}
+
+// Apply a box filter to an image using an integral image for speed
+// image im: image to smooth
+// int s: window size for box filter
+// returns: smoothed image
+image box_filter_image(image im, int s)
+{
+    PROFILE_FUNC();
+    image integ = make_integral_image(im);
+    image S = make_image(im.w, im.h, im.c);
+    // TODO: fill in S using the integral image.
+    box_job j = {integ, S, s};
+    parallel_for(im.h, 16, box_rows, &j);
 
     free_image(integ);
     return S;
 }
 
+static void time_structure_rows(void *ctx, int start, int end)
+{
+    image *io = ctx;
+    image im = io[0], prev = io[1], g = io[2], S = io[3];
+    float it, ix, iy;
+    for (int y = start; y < end; y++) {
+        for (int x = 0; x < im.w; x++) {
+            // Grab gradient values
+            it = pixel_at(im, x, y, 0) - pixel_at(prev, x, y, 0);
+            ix = pixel_at(g, x, y, 0);
+            iy = pixel_at(g, x, y, 1);
+
+            // Set values of structure matrix
+            S.data[x + S.w*(y + S.h*0)] = ix * ix;
+            S.data[x + S.w*(y + S.h*1)] = iy * iy;
+            S.data[x + S.w*(y + S.h*2)] = ix * iy;
+            S.data[x + S.w*(y + S.h*3)] = ix * it;
+            S.data[x + S.w*(y + S.h*4)] = iy * it;
+        }
+    }
+}
+
 // Calculate the time-structure matrix of an image pair.
 // image im: the input image.
 // image prev: the previous image in sequence.
@@ -121,6 +168,7 @@ image box_filter_image(image im, int s)
 //          3rd channel is IxIy, 4th channel is IxIt, 5th channel is IyIt.
 image time_structure_matrix(image im, image prev, int s)
 {
+    PROFILE_FUNC();
     int i;
     int converted = 0;
     if(im.c == 3){
@@ -130,58 +178,44 @@ image time_structure_matrix(image im, image prev, int s)
     }
 
     // TODO: calculate gradients, structure components, and smooth them
-    int x, y;
     // Calculate gradients
-    image gx_filter = make_gx_filter();
-    image gy_filter = make_gy_filter();
-    image gx = convolve_image(im, gx_filter, 0);
-    image gy = convolve_image(im, gy_filter, 0);
+    image g = gradient_image(im, GRADIENT_X | GRADIENT_Y);
 
     // Structure matrix 5 channels
     image S = make_image(im.w, im.h, 5);
 
-    float it, ix, iy;
-    for (y = 0; y < im.h; y++) {
-        for (x = 0; x < im.w; x++) {
-            // Grab gradient values
-            it = get_pixel(im, x, y, 0) - get_pixel(prev, x, y, 0);
-            ix = get_pixel(gx, x, y, 0);
-            iy = get_pixel(gy, x, y, 0);
-
-            // Set values of structure matrix
-            set_pixel(S, x, y, 0, ix * ix);
-            set_pixel(S, x, y, 1, iy * iy);
-            set_pixel(S, x, y, 2, ix * iy);
-            set_pixel(S, x, y, 3, ix * it);
-            set_pixel(S, x, y, 4, iy * it);
-        }
-    }
+    image io[4] = {im, prev, g, S};
+    parallel_for(im.h, 16, time_structure_rows, io);
 
     // Smooth
-    S = box_filter_image(S, s);
+    image smoothed = box_filter_image(S, s);
+    free_image(S);
 
     // Clean up
     if(converted){
         free_image(im); free_image(prev);
     }
-    free_image(gx_filter);
-    free_image(gy_filter);
-    free_image(gx);
-    free_image(gy);
-    return S;
+    free_image(g);
+    return smoothed;
 }
 
-// Calculate the velocity given a structure image
-// image S: time-structure image
-// int stride: only calculate subset of pixels for speed
-image velocity_image(image S, int stride)
+typedef struct{
+    image S, v;
+    int stride;
+} velocity_job;
+
+// Solve for the velocity on sampled rows [start, end), row n of the output
+// is sampled from S at y = (stride-1)/2 + n*stride.
+static void velocity_rows(void *ctx, int start, int end)
 {
-    image v = make_image(S.w/stride, S.h/stride, 3);
-    int i, j;
+    velocity_job *job = ctx;
+    image S = job->S, v = job->v;
+    int stride = job->stride;
+    int i, j, n;
     matrix M = make_matrix(2,2);
-    matrix V = make_matrix(2, 1);
     matrix t = make_matrix(2, 1);
-    for(j = (stride-1)/2; j < S.h; j += stride){
+    for(n = start; n < end; ++n){
+        j = (stride-1)/2 + n*stride;
         for(i = (stride-1)/2; i < S.w; i += stride){
             float Ixx = S.data[i + S.w*j + 0*S.w*S.h];
             float Iyy = S.data[i + S.w*j + 1*S.w*S.h];
@@ -218,15 +252,26 @@ image velocity_image(image S, int stride)
 
             /// Clean up
             free_matrix(MI);
+            free_matrix(V);
 
             set_pixel(v, i/stride, j/stride, 0, vx);
             set_pixel(v, i/stride, j/stride, 1, vy);
         }
     }
-    
-    free_matrix(V);
     free_matrix(t);
     free_matrix(M);
+}
+
+// Calculate the velocity given a structure image
+// image S: time-structure image
+// int stride: only calculate subset of pixels for speed
+image velocity_image(image S, int stride)
+{
+    PROFILE_FUNC();
+    image v = make_image(S.w/stride, S.h/stride, 3);
+    velocity_job job = {S, v, stride};
+    int rows = (S.h - (stride-1)/2 + stride - 1) / stride;
+    parallel_for(rows, 4, velocity_rows, &job);
     return v;
 }
 
@@ -236,6 +281,7 @@ image velocity_image(image S, int stride)
 // float scale: scalar to multiply velocity by for drawing
 void draw_flow(image im, image v, float scale)
 {
+    PROFILE_FUNC();
     int stride = im.w / v.w;
     int i,j;
     for (j = (stride-1)/2; j < im.h; j += stride) {
@@ -270,6 +316,7 @@ void constrain_image(image im, float v)
 // returns: velocity matrix
 image optical_flow_images(image im, image prev, int smooth, int stride)
 {
+    PROFILE_FUNC();
     image S = time_structure_matrix(im, prev, smooth);   
     image v = velocity_image(S, stride);
     constrain_image(v, 6);
@@ -285,6 +332,7 @@ image optical_flow_images(image im, image prev, int smooth, int stride)
 // int div: downsampling factor for images from webcam
 void optical_flow_webcam(int smooth, int stride, int div)
 {
+    PROFILE_FUNC();
 #ifdef OPENCV
     void * cap;
     cap = open_video_stream(0, 0, 1280, 720, 30);
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include "image.h"
 #include "matrix.h"
+#include "profile.h"
 
 // Run an activation function on each element in a matrix,
 // modifies the matrix in place
@@ -9,6 +10,7 @@
 // ACTIVATION a: function to run
 void activate_matrix(matrix m, ACTIVATION a)
 {
+    PROFILE_FUNC();
     int i, j;
     for(i = 0; i < m.rows; ++i){
         double sum = 0;
@@ -38,6 +40,7 @@ void activate_matrix(matrix m, ACTIVATION a)
 // matrix d: delta before activation gradient
 void gradient_matrix(matrix m, ACTIVATION a, matrix d)
 {
+    PROFILE_FUNC();
     int i, j;
     for(i = 0; i < m.rows; ++i){
         for(j = 0; j < m.cols; ++j){
@@ -53,6 +56,7 @@ void gradient_matrix(matrix m, ACTIVATION a, matrix d)
 // returns: matrix that is output of the layer
 matrix forward_layer(layer *l, matrix in)
 {
+    PROFILE_FUNC();
 
     l->in = in;  // Save the input for backpropagation
 
@@ -72,6 +76,7 @@ matrix forward_layer(layer *l, matrix in)
 // returns: matrix, partial derivative of loss w.r.t. input to layer
 matrix backward_layer(layer *l, matrix delta)
 {
+    PROFILE_FUNC();
     // 1.4.1
     // delta is dL/dy
     // TODO: modify it in place to be dL/d(xw)
@@ -98,6 +103,7 @@ matrix backward_layer(layer *l, matrix delta)
 // double decay: value for weight decay
 void update_layer(layer *l, double rate, double momentum, double decay)
 {
+    PROFILE_FUNC();
     // TODO:
     // Calculate Δw_t = dL/dw_t - λw_t + mΔw_{t-1}
     // save it to l->v
@@ -116,6 +122,7 @@ void update_layer(layer *l, double rate, double momentum, double decay)
 // ACTIVATION activation: the activation function to use
 layer make_layer(int input, int output, ACTIVATION activation)
 {
+    PROFILE_FUNC();
     layer l;
     l.in  = make_matrix(1,1);
     l.out = make_matrix(1,1);
@@ -45,6 +45,117 @@ typedef struct{
     float distance;
 } match;
 
+// A strided window onto the pixels of an image. A view does not own its
+// memory, so crops, tiles and canvas regions can be worked on in place.
+// int w, h, c: dimensions of the view.
+// int xs, ys, cs: distance in floats between neighbors along x, along y,
+//                 and between channels.
+// float *data: address of pixel (0,0) in channel 0.
+typedef struct{
+    int w, h, c;
+    int xs, ys, cs;
+    float *data;
+} image_view;
+
+// Memory layouts an image buffer can be viewed in.
+// LAYOUT_CHW: planar, one w x h plane per channel (the default).
+// LAYOUT_HWC: interleaved, the c values of each pixel are adjacent.
+typedef enum{LAYOUT_CHW, LAYOUT_HWC} LAYOUT;
+
+// How pixels outside of an image are filled in when it is padded.
+// BORDER_REPLICATE: repeat the edge pixel, same as get_pixel's clamping.
+// BORDER_ZERO: fill with zeros.
+// BORDER_REFLECT: mirror about the edge pixel, so -1 reads 1.
+typedef enum{BORDER_REPLICATE, BORDER_ZERO, BORDER_REFLECT} BORDER;
+
+// Element types for reduced precision pixel storage.
+// STORE_U8 maps [0,1] onto 0..255, STORE_F16 is IEEE half precision.
+typedef enum{STORE_F32, STORE_F16, STORE_U8} STORAGE;
+
+// Quantities gradient_view can compute from the Sobel gradients gx and gy,
+// or'ed together to ask for several at once.
+// GRADIENT_MAG: sqrt(gx^2 + gy^2).
+// GRADIENT_ANGLE: atan2(gy, gx).
+// GRADIENT_XX, GRADIENT_YY, GRADIENT_XY: the structure matrix products.
+typedef enum{
+    GRADIENT_X = 1, GRADIENT_Y = 2, GRADIENT_MAG = 4, GRADIENT_ANGLE = 8,
+    GRADIENT_XX = 16, GRADIENT_YY = 32, GRADIENT_XY = 64
+} GRADIENT;
+
+// An image kept in STORAGE sized elements, planar like image.
+typedef struct{
+    int w, h, c;
+    STORAGE type;
+    void *data;
+} packed_image;
+
+// Spectrum of an image zero padded to n x m, both powers of two. Each
+// channel holds m rows of n/2 + 1 complex bins as re, im pairs, the rest
+// follow from symmetry.
+// int w, h, c: size of the image that was transformed.
+typedef struct{
+    int w, h, c;
+    int n, m;
+    float *data;
+} spectrum;
+
+// Statistics of the pixels of a view, see channel_stats and view_stats.
+// double var: population variance.
+typedef struct{
+    size_t n;
+    float min, max;
+    double sum, mean, var;
+} pixel_stats;
+
+// Filters get_kernel keeps one shared copy of.
+typedef enum{
+    KERNEL_GAUSSIAN, KERNEL_GAUSSIAN_1D, KERNEL_BOX, KERNEL_HIGHPASS,
+    KERNEL_SHARPEN, KERNEL_EMBOSS, KERNEL_GX, KERNEL_GY
+} KERNEL;
+
+// A cached filter, see get_kernel.
+// image row, col: w x 1 and 1 x h factors of filter if it separates, 0 x 0
+//                 with no data otherwise. A 1d Gaussian's are itself and its transpose.
+typedef struct{
+    KERNEL type;
+    float param;
+    image filter;
+    image row, col;
+} kernel;
+
+// Gaussian and Laplacian pyramid of an image, see image_pyramid. Levels
+// are built on demand; use pyramid_level and laplacian_level rather than
+// reading the arrays, unbuilt levels have no data.
+// int n: number of levels, the last is 1 pixel on its short side.
+typedef struct{
+    int n;
+    image *gauss;
+    image *lap;
+} pyramid;
+
+// Callbacks that move an image a row at a time. A row is c runs of w
+// floats, one run per channel.
+// row_source returns 0 when it has no more rows.
+typedef int (*row_source)(void *ctx, float *row);
+typedef void (*row_sink)(void *ctx, const float *row);
+
+// Binary PGM or PPM file being read or written a row at a time.
+// int maxval: largest sample value, more than 255 means 2 byte samples.
+typedef struct{
+    FILE *fp;
+    int w, h, c;
+    int maxval;
+    unsigned char *buf;
+} pnm_stream;
+
+// Graph of filtering stages run together, see make_pipeline. Stages are
+// named by the ints the pipe_ functions return.
+typedef struct pipeline pipeline;
+
+// Point-wise stage of a pipeline. Called on blocks of rows: every view in
+// in, one per input stage, and out cover the same pixels.
+typedef void (*map_fn)(void *ctx, const image_view *in, image_view out);
+
 // Basic operations
 float get_pixel(image im, int x, int y, int c);
 void set_pixel(image im, int x, int y, int c, float v);
@@ -53,6 +164,8 @@ image rgb_to_grayscale(image im);
 image grayscale_to_rgb(image im, float r, float g, float b);
 void rgb_to_hsv(image im);
 void hsv_to_rgb(image im);
+void rgb_to_hsv_view(image_view im);
+void hsv_to_rgb_view(image_view im);
 void shift_image(image im, int c, float v);
 void scale_image(image im, int c, float v);
 void clamp_image(image im);
@@ -61,6 +174,64 @@ int same_image(image a, image b, float eps);
 image sub_image(image a, image b);
 image add_image(image a, image b);
 
+// Fused element-wise arithmetic (see image_expr.h), out may alias an input
+void add_image_into(image a, image b, image out);
+void sub_image_into(image a, image b, image out);
+void hybrid_image_into(image low, image high, image high_low, image out);
+
+// Views
+image_view view_image(image im);
+image_view crop_view(image_view v, int x, int y, int w, int h);
+image_view channel_view(image_view v, int c);
+image_view strip_view(float *data, int w, int h, int c, int y0, int y1);
+float get_view_pixel(image_view v, int x, int y, int c);
+void set_view_pixel(image_view v, int x, int y, int c, float val);
+void copy_view(image_view dst, image_view src);
+image view_to_image(image_view v);
+image_view layout_view(image im, LAYOUT layout);
+LAYOUT view_layout(image_view v);
+image convert_layout(image im, LAYOUT from, LAYOUT to);
+
+// Packed storage
+packed_image make_packed_image(int w, int h, int c, STORAGE type);
+void free_packed_image(packed_image im);
+packed_image pack_image(image im, STORAGE type);
+image unpack_image(packed_image p);
+void load_packed_row(packed_image im, int y, int c, float *dst);
+void store_packed_row(packed_image im, int y, int c, const float *src);
+float get_packed_pixel(packed_image im, int x, int y, int c);
+packed_image load_image_packed(char *filename, STORAGE type);
+void save_packed_image(packed_image p, const char *name);
+void save_packed_png(packed_image p, const char *name);
+packed_image convolve_packed(packed_image im, image filter, int preserve);
+float bilinear_interpolate_packed(packed_image im, float x, float y, int c);
+packed_image nn_resize_packed(packed_image im, int w, int h);
+packed_image bilinear_resize_packed(packed_image im, int w, int h);
+void rgb_to_hsv_packed(packed_image im);
+void hsv_to_rgb_packed(packed_image im);
+
+// Padded images
+image make_padded_image(image_view src, int pad, BORDER border);
+image_view padded_interior(image padded, int pad);
+void fill_border(image padded, int pad, BORDER border);
+
+// Unchecked access for inner loops. Coordinates must be inside the image or
+// view, or inside the border of a padded interior view.
+static inline float *view_ptr(image_view v, int x, int y, int c)
+{
+    return v.data + x*v.xs + y*v.ys + c*v.cs;
+}
+
+static inline float view_at(image_view v, int x, int y, int c)
+{
+    return v.data[x*v.xs + y*v.ys + c*v.cs];
+}
+
+static inline float pixel_at(image im, int x, int y, int c)
+{
+    return im.data[x + im.w*(y + im.h*c)];
+}
+
 // Loading and saving
 image make_image(int w, int h, int c);
 image load_image(char *filename);
@@ -68,6 +239,9 @@ void save_image(image im, const char *name);
 void save_image_binary(image im, const char *fname);
 image load_image_binary(const char *fname);
 void save_png(image im, const char *name);
+image load_image_hwc(char *filename);
+void save_image_view(image_view v, const char *name);
+void save_png_view(image_view v, const char *name);
 void free_image(image im);
 
 // Resizing
@@ -75,9 +249,23 @@ float nn_interpolate(image im, float x, float y, int c);
 image nn_resize(image im, int w, int h);
 float bilinear_interpolate(image im, float x, float y, int c);
 image bilinear_resize(image im, int w, int h);
+float nn_interpolate_view(image_view im, float x, float y, int c);
+float bilinear_interpolate_view(image_view im, float x, float y, int c);
+void nn_resize_view(image_view im, image_view out);
+void bilinear_resize_view(image_view im, image_view out);
+image area_resize(image im, int w, int h);
+void area_resize_view(image_view im, image_view out);
+image bicubic_resize(image im, int w, int h);
+void bicubic_resize_view(image_view im, image_view out);
+image lanczos_resize(image im, int w, int h, int a);
+void lanczos_resize_view(image_view im, image_view out, int a);
+image half_image(image im);
+void half_view(image_view im, image_view out);
 
 // Filtering
 image convolve_image(image im, image filter, int preserve);
+void convolve_view(image_view im, image filter, int preserve, image_view out);
+void convolve_view_rows(image_view im, image filter, int preserve, image_view out, int y0, int y1);
 image make_box_filter(int w);
 image make_highpass_filter();
 image make_sharpen_filter();
@@ -89,14 +277,65 @@ void feature_normalize(image im);
 void l1_normalize(image im);
 void threshold_image(image im, float thresh);
 image *sobel_image(image im);
+image gradient_image(image im, int flags);
+void gradient_view(image_view im, int flags, image_view *out);
+void gradient_view_rows(image_view im, int flags, image_view *out, int y0, int y1);
 image colorize_sobel(image im);
 image smooth_image(image im, float sigma);
+image smooth_image_iir(image im, float sigma);
+void smooth_iir_view(image_view im, float sigma, image_view out);
+int separate_filter(image filter, image *row, image *col);
+const kernel *get_kernel(KERNEL type, float param);
+void release_kernel(const kernel *k);
+image copy_kernel(KERNEL type, float param);
+
+// Frequency domain
+image convolve_fft(image im, image filter, int preserve);
+void convolve_fft_view(image_view im, image filter, int preserve, image_view out);
+spectrum fft_image(image im);
+image ifft_image(spectrum s);
+image spectrum_magnitude(spectrum s);
+void free_spectrum(spectrum s);
+
+// Statistics
+void channel_stats(image_view im, pixel_stats *out);
+pixel_stats view_stats(image_view im);
+void view_histogram(image_view im, int bins, float lo, float hi, size_t *counts);
+
+// Pyramids
+image reduce_image(image im);
+image expand_image(image im, int w, int h);
+pyramid *image_pyramid(image im);
+image pyramid_level(pyramid *p, int level);
+image laplacian_level(pyramid *p, int level);
+image collapse_pyramid(pyramid *p);
+void drop_pyramid(image im);
+
+// Pipelines
+pipeline *make_pipeline();
+int pipe_input(pipeline *p, image_view im);
+int pipe_convolve(pipeline *p, int in, image filter, int preserve);
+int pipe_gradient(pipeline *p, int in, int flags);
+int pipe_normalize(pipeline *p, int in);
+int pipe_map(pipeline *p, const int *in, int n, int c, map_fn fn, void *ctx);
+image run_pipeline(pipeline *p, int out);
+void free_pipeline(pipeline *p);
+
+// Streaming
+int convolve_stream(int w, int h, int c, image filter, int preserve,
+                    row_source src, void *src_ctx, row_sink sink, void *sink_ctx);
+pnm_stream open_pnm(const char *fname);
+pnm_stream create_pnm(const char *fname, int w, int h, int c);
+int read_pnm_row(void *stream, float *row);
+void write_pnm_row(void *stream, const float *row);
+void close_pnm(pnm_stream s);
 
 // Harris and Stitching
 point make_point(float x, float y);
 point project_point(matrix H, point p);
 matrix compute_homography(match *matches, int n);
 image structure_matrix(image im, float sigma);
+image structure_matrix_view(image_view im, float sigma);
 image cornerness_response(image S);
 void free_descriptors(descriptor *d, int n);
 image cylindrical_project(image im, float f);
@@ -105,6 +344,7 @@ image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms
 void detect_and_draw_corners(image im, float sigma, float thresh, int nms);
 int model_inliers(matrix H, match *m, int n, float thresh);
 image combine_images(image a, image b, matrix H);
+packed_image combine_packed(packed_image a, packed_image b, matrix H);
 match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn);
 descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n);
 image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff);
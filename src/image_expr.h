@@ -0,0 +1,152 @@
+#ifndef IMAGE_EXPR_H
+#define IMAGE_EXPR_H
+#ifdef __cplusplus
+
+#include <assert.h>
+#include "image.h"
+
+// Lazy element-wise arithmetic on images. An expression like
+//
+//     expr::eval_into(out, expr::clamp(expr::ex(low) + expr::ex(high) - expr::ex(blur)));
+//
+// builds a small tree of nodes on the stack and computes nothing until
+// eval_into walks every pixel once, so a chain of n operations reads each
+// input and writes the output a single time instead of n times. Nodes only
+// hold pointers and floats, so they are cheap to copy and need no cleanup.
+// The output may be one of the inputs since every pixel only depends on the
+// same pixel of its inputs.
+
+namespace expr {
+
+// Base class tagging expression nodes. E is the concrete node type.
+template <class E> struct node {
+    const E &self() const { return static_cast<const E &>(*this); }
+};
+
+// Leaf reading the pixels of an image.
+struct ref : node<ref> {
+    const float *data;
+    int w, h, c, n;
+    explicit ref(image im) : data(im.data), w(im.w), h(im.h), c(im.c), n(im.w*im.h) {}
+    float at(int k, int i) const { return data[k*n + i]; }
+    void check(int ow, int oh, int oc) const { assert(w == ow && h == oh && c == oc); (void)ow; (void)oh; (void)oc; }
+};
+
+// Leaf holding a constant.
+struct scalar : node<scalar> {
+    float v;
+    explicit scalar(float v) : v(v) {}
+    float at(int, int) const { return v; }
+    void check(int, int, int) const {}
+};
+
+struct op_add { static float apply(float a, float b) { return a + b; } };
+struct op_sub { static float apply(float a, float b) { return a - b; } };
+struct op_mul { static float apply(float a, float b) { return a * b; } };
+struct op_div { static float apply(float a, float b) { return a / b; } };
+struct op_min { static float apply(float a, float b) { return a < b ? a : b; } };
+struct op_max { static float apply(float a, float b) { return a > b ? a : b; } };
+
+// Applies Op to two sub-expressions.
+template <class Op, class L, class R> struct binary : node<binary<Op, L, R> > {
+    L l;
+    R r;
+    binary(const L &l, const R &r) : l(l), r(r) {}
+    float at(int k, int i) const { return Op::apply(l.at(k, i), r.at(k, i)); }
+    void check(int w, int h, int c) const { l.check(w, h, c); r.check(w, h, c); }
+};
+
+// Clamps a sub-expression to [lo, hi].
+template <class E> struct clamped : node<clamped<E> > {
+    E e;
+    float lo, hi;
+    clamped(const E &e, float lo, float hi) : e(e), lo(lo), hi(hi) {}
+    float at(int k, int i) const
+    {
+        float v = e.at(k, i);
+        v = v > hi ? hi : v;
+        return v < lo ? lo : v;
+    }
+    void check(int w, int h, int c) const { e.check(w, h, c); }
+};
+
+// a*x + b on a single channel, other channels pass through. This is how
+// shift_image and scale_image look inside an expression.
+template <class E> struct channel_affine : node<channel_affine<E> > {
+    E e;
+    int c;
+    float a, b;
+    channel_affine(const E &e, int c, float a, float b) : e(e), c(c), a(a), b(b) {}
+    float at(int k, int i) const
+    {
+        float v = e.at(k, i);
+        return (k == c) ? a*v + b : v;
+    }
+    void check(int w, int h, int cc) const { e.check(w, h, cc); }
+};
+
+inline ref ex(image im) { return ref(im); }
+
+#define EXPR_BINARY(OPER, OP)                                                     \
+    template <class L, class R>                                                   \
+    binary<OP, L, R> OPER(const node<L> &l, const node<R> &r)                     \
+    { return binary<OP, L, R>(l.self(), r.self()); }                              \
+    template <class L>                                                            \
+    binary<OP, L, scalar> OPER(const node<L> &l, float r)                         \
+    { return binary<OP, L, scalar>(l.self(), scalar(r)); }                        \
+    template <class R>                                                            \
+    binary<OP, scalar, R> OPER(float l, const node<R> &r)                         \
+    { return binary<OP, scalar, R>(scalar(l), r.self()); }
+
+EXPR_BINARY(operator+, op_add)
+EXPR_BINARY(operator-, op_sub)
+EXPR_BINARY(operator*, op_mul)
+EXPR_BINARY(operator/, op_div)
+EXPR_BINARY(min, op_min)
+EXPR_BINARY(max, op_max)
+
+#undef EXPR_BINARY
+
+template <class E> clamped<E> clamp(const node<E> &e, float lo = 0, float hi = 1)
+{
+    return clamped<E>(e.self(), lo, hi);
+}
+
+template <class E> channel_affine<E> shift(const node<E> &e, int c, float v)
+{
+    return channel_affine<E>(e.self(), c, 1, v);
+}
+
+template <class E> channel_affine<E> scale(const node<E> &e, int c, float v)
+{
+    return channel_affine<E>(e.self(), c, v, 0);
+}
+
+// Evaluate an expression into an existing image in one pass. The inner loop
+// is a plain walk over one channel plane so the compiler can vectorize the
+// whole fused expression.
+// image out: destination, must match the size of every image in e.
+// e: expression to evaluate.
+template <class E> void eval_into(image out, const node<E> &e)
+{
+    const E &x = e.self();
+    x.check(out.w, out.h, out.c);
+    int n = out.w*out.h;
+    for(int k = 0; k < out.c; ++k){
+        float *d = out.data + (size_t)k*n;
+        for(int i = 0; i < n; ++i) d[i] = x.at(k, i);
+    }
+}
+
+// Evaluate an expression into a new image of the given size.
+template <class E> image eval(int w, int h, int c, const node<E> &e)
+{
+    image out = make_image(w, h, c);
+    eval_into(out, e);
+    return out;
+}
+
+} // namespace expr
+
+#endif
+#endif
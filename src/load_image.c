@@ -3,6 +3,8 @@
 #include <stdlib.h>
 
 #include "image.h"
+#include "pool.h"
+#include "profile.h"
 
 image make_empty_image(int w, int h, int c)
 {
@@ -17,7 +19,8 @@ image make_empty_image(int w, int h, int c)
 image make_image(int w, int h, int c)
 {
     image out = make_empty_image(w,h,c);
-    out.data = calloc(h*w*c, sizeof(float));
+    out.data = pool_alloc((size_t)h*w*c*sizeof(float));
+    PROFILE_ALLOC(IMAGE_BYTES(out));
     return out;
 }
 
@@ -26,14 +29,24 @@ image make_image(int w, int h, int c)
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-void save_image_stb(image im, const char *name, int png)
+void save_view_stb(image_view im, const char *name, int png)
 {
     char buff[256];
     unsigned char *data = calloc(im.w*im.h*im.c, sizeof(char));
-    int i,k;
-    for(k = 0; k < im.c; ++k){
-        for(i = 0; i < im.w*im.h; ++i){
-            data[i*im.c+k] = (unsigned char) roundf((255*im.data[i + k*im.w*im.h]));
+    int i,j,k;
+    if(view_layout(im) == LAYOUT_HWC && im.xs == im.c && im.ys == im.w*im.c){
+        // Already interleaved, no transpose needed
+        for(i = 0; i < im.w*im.h*im.c; ++i){
+            data[i] = (unsigned char) roundf((255*im.data[i]));
+        }
+    } else {
+        for(k = 0; k < im.c; ++k){
+            for(j = 0; j < im.h; ++j){
+                for(i = 0; i < im.w; ++i){
+                    float v = im.data[i*im.xs + j*im.ys + k*im.cs];
+                    data[(i + j*im.w)*im.c+k] = (unsigned char) roundf((255*v));
+                }
+            }
         }
     }
     int success = 0;
@@ -48,16 +61,35 @@ void save_image_stb(image im, const char *name, int png)
     if(!success) fprintf(stderr, "Failed to write image %s\n", buff);
 }
 
+void save_image_stb(image im, const char *name, int png)
+{
+    save_view_stb(view_image(im), name, png);
+}
+
 void save_png(image im, const char *name)
 {
+    PROFILE_FUNC();
     save_image_stb(im, name, 1);
 }
 
 void save_image(image im, const char *name)
 {
+    PROFILE_FUNC();
     save_image_stb(im, name, 0);
 }
 
+void save_png_view(image_view v, const char *name)
+{
+    PROFILE_FUNC();
+    save_view_stb(v, name, 1);
+}
+
+void save_image_view(image_view v, const char *name)
+{
+    PROFILE_FUNC();
+    save_view_stb(v, name, 0);
+}
+
 // 
 // Load an image using stb
 // channels = [0..4]
@@ -92,12 +124,47 @@ image load_image_stb(char *filename, int channels)
 
 image load_image(char *filename)
 {
+    PROFILE_FUNC();
     image out = load_image_stb(filename, 0);
     return out;
 }
 
+//
+// Load an image using stb without transposing it to planar order.
+// returns: buffer in LAYOUT_HWC, view it with layout_view(im, LAYOUT_HWC).
+//          Alpha channels are dropped like in load_image.
+//
+image load_image_hwc(char *filename)
+{
+    PROFILE_FUNC();
+    int w, h, c;
+    unsigned char *data = stbi_load(filename, &w, &h, &c, 0);
+    if (!data) {
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
+            filename, stbi_failure_reason());
+        exit(0);
+    }
+    int i, k;
+    int oc = (c == 4) ? 3 : c;
+    image im = make_image(w, h, oc);
+    if(oc == c){
+        for(i = 0; i < w*h*c; ++i){
+            im.data[i] = (float)data[i]/255.;
+        }
+    } else {
+        for(i = 0; i < w*h; ++i){
+            for(k = 0; k < oc; ++k){
+                im.data[i*oc + k] = (float)data[i*c + k]/255.;
+            }
+        }
+    }
+    free(data);
+    return im;
+}
+
 void save_image_binary(image im, const char *fname)
 {
+    PROFILE_FUNC();
     FILE *fp = fopen(fname, "wb");
     fwrite(&im.w, sizeof(int), 1, fp);
     fwrite(&im.h, sizeof(int), 1, fp);
@@ -108,6 +175,7 @@ void save_image_binary(image im, const char *fname)
 
 image load_image_binary(const char *fname)
 {
+    PROFILE_FUNC();
     int w = 0;
     int h = 0;
     int c = 0;
@@ -122,6 +190,7 @@ image load_image_binary(const char *fname)
 
 void free_image(image im)
 {
-    free(im.data);
+    drop_pyramid(im);
+    pool_free(im.data);
 }
 
@@ -3,11 +3,30 @@
 #include "image.h"
 #include "test.h"
 #include "args.h"
+#include "bench.h"
 
 int main(int argc, char **argv)
 {
-    if(argc < 3){
+    if(argc >= 2 && 0 == strcmp(argv[1], "bench")){
+        run_bench(argc, argv);
+    } else if(argc >= 4 && 0 == strcmp(argv[1], "blur")){
+        // Gaussian blur of a PGM/PPM of any height in bounded memory
+        float sigma = find_float_arg(argc, argv, "-sigma", 2);
+        pnm_stream in = open_pnm(argv[2]);
+        if(!in.fp) return 1;
+        pnm_stream out = create_pnm(argv[3], in.w, in.h, in.c);
+        image f = make_gaussian_filter(sigma);
+        int ok = out.fp && convolve_stream(in.w, in.h, in.c, f, 1, read_pnm_row, &in, write_pnm_row, &out);
+        if(!ok) fprintf(stderr, "Failed to blur %s\n", argv[2]);
+        free_image(f);
+        close_pnm(in);
+        close_pnm(out);
+        return !ok;
+    } else if(argc < 3){
         printf("usage: %s test <hw0 | hw1...>\n", argv[0]);  
+        printf("       %s bench [-quick] [-sizes 256,1024,4k,8k] [-channels 1,3] [-reps n] [-warmup n]\n"
+               "             [-kernel name] [-out bench.json] [-compare old.json]\n", argv[0]);
+        printf("       %s blur <in.pgm|ppm> <out.pgm|ppm> [-sigma s]\n", argv[0]);
     } else if (0 == strcmp(argv[1], "test")){
         if (0 == strcmp(argv[2], "hw0")) test_hw0();
         if (0 == strcmp(argv[2], "hw1")) test_hw1();
@@ -1,4 +1,5 @@
 #include "matrix.h"
+#include "profile.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,6 +8,7 @@
 
 matrix make_identity_homography()
 {
+    PROFILE_FUNC();
     matrix H = make_matrix(3,3);   
     H.data[0][0] = 1;
     H.data[1][1] = 1;
@@ -16,6 +18,7 @@ matrix make_identity_homography()
 
 matrix make_translation_homography(float dx, float dy)
 {
+    PROFILE_FUNC();
     matrix H = make_identity_homography();
     H.data[0][2] = dx;
     H.data[1][2] = dy;
@@ -40,11 +43,13 @@ matrix make_matrix(int rows, int cols)
     m.data = calloc(m.rows, sizeof(double *));
     int i;
     for(i = 0; i < m.rows; ++i) m.data[i] = calloc(m.cols, sizeof(double));
+    PROFILE_ALLOC((size_t)rows*cols*sizeof(double));
     return m;
 }
 
 matrix copy_matrix(matrix m)
 {
+    PROFILE_FUNC();
     int i,j;
     matrix c = make_matrix(m.rows, m.cols);
     for(i = 0; i < m.rows; ++i){
@@ -82,6 +87,7 @@ matrix make_identity(int rows, int cols)
 
 matrix matrix_mult_matrix(matrix a, matrix b)
 {
+    PROFILE_FUNC();
     assert(a.cols == b.rows);
     int i, j, k;
     matrix p = make_matrix(a.rows, b.cols);
@@ -97,6 +103,7 @@ matrix matrix_mult_matrix(matrix a, matrix b)
 
 matrix matrix_elmult_matrix(matrix a, matrix b)
 {
+    PROFILE_FUNC();
     assert(a.cols == b.cols);
     assert(a.rows == b.rows);
     int i, j;
@@ -125,6 +132,7 @@ matrix matrix_sub_matrix(matrix a, matrix b)
 
 matrix axpy_matrix(double a, matrix x, matrix y)
 {
+    PROFILE_FUNC();
     assert(x.cols == y.cols);
     assert(x.rows == y.rows);
     int i, j;
@@ -139,6 +147,7 @@ matrix axpy_matrix(double a, matrix x, matrix y)
 
 matrix transpose_matrix(matrix m)
 {
+    PROFILE_FUNC();
     matrix t;
     t.rows = m.cols;
     t.cols = m.rows;
@@ -221,6 +230,7 @@ double *LUP_solve(matrix L, matrix U, int *p, double *b)
 
 matrix matrix_invert(matrix m)
 {
+    PROFILE_FUNC();
     //print_matrix(m);
     matrix none = {0};
     if(m.rows != m.cols){
@@ -330,6 +340,7 @@ int* in_place_LUP(matrix m)
 
 matrix random_matrix(int rows, int cols, double s)
 {
+    PROFILE_FUNC();
     matrix m = make_matrix(rows, cols);
     int i, j;
     for(i = 0; i < rows; ++i){
@@ -342,6 +353,7 @@ matrix random_matrix(int rows, int cols, double s)
 
 double mag_matrix(matrix m)
 {
+    PROFILE_FUNC();
     int i, j;
     double sum = 0;
     for(i = 0; i < m.rows; ++i){
@@ -354,12 +366,14 @@ double mag_matrix(matrix m)
 
 double *sle_solve(matrix A, double *b)
 {
+    PROFILE_FUNC();
     int *p = in_place_LUP(A);
     return LUP_solve(A, A, p, b);
 }
 
 matrix solve_system(matrix M, matrix b)
 {
+    PROFILE_FUNC();
     matrix none = {0};
     matrix Mt = transpose_matrix(M);
     matrix MtM = matrix_mult_matrix(Mt, M);
@@ -385,6 +399,7 @@ void test_matrix()
 
 matrix load_matrix(const char *fname)
 {
+    PROFILE_FUNC();
     int rows = 0;
     int cols = 0;
     FILE *fp = fopen(fname, "rb");
@@ -401,6 +416,7 @@ matrix load_matrix(const char *fname)
 
 void save_matrix(matrix m, const char *fname)
 {
+    PROFILE_FUNC();
     FILE *fp = fopen(fname, "wb");
     fwrite(&m.rows, sizeof(int), 1, fp);
     fwrite(&m.cols, sizeof(int), 1, fp);
@@ -0,0 +1,750 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <math.h>
+#include "image.h"
+#include "pool.h"
+#include "simd.h"
+#include "stb_image.h"
+#include "stb_image_write.h"
+#include "profile.h"
+#include "parallel.h"
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+// Rows of packed images are widened to floats in strips of this many rows,
+// so kernels run on bounded f32 scratch whatever the image height.
+#define STRIP_ROWS 64
+
+static size_t storage_size(STORAGE type)
+{
+    if(type == STORE_U8) return 1;
+    if(type == STORE_F16) return 2;
+    return 4;
+}
+
+// IEEE 754 half <-> single conversion, round to nearest even.
+static float half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    if(exp == 0x1f){
+        bits = sign | 0x7f800000 | (mant << 13);
+    } else if(exp){
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    } else if(mant){
+        // Subnormal half, normalize it
+        exp = 113;
+        while(!(mant & 0x400)){
+            mant <<= 1;
+            --exp;
+        }
+        bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    } else {
+        bits = sign;
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static uint16_t float_to_half(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    int32_t exp = ((bits >> 23) & 0xff) - 112;
+    uint32_t mant = bits & 0x7fffff;
+    if(((bits >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mant ? 0x200 : 0);
+    if(exp >= 0x1f) return sign | 0x7c00;
+    if(exp <= 0){
+        // Subnormal or zero half
+        if(exp < -10) return sign;
+        mant |= 0x800000;
+        int shift = 14 - exp;
+        uint32_t half = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t mid = 1u << (shift - 1);
+        if(rem > mid || (rem == mid && (half & 1))) ++half;
+        return sign | half;
+    }
+    uint32_t half = ((uint32_t)exp << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1fff;
+    if(rem > 0x1000 || (rem == 0x1000 && (half & 1))) ++half;
+    return sign | half;
+}
+
+#ifdef SIMD_X86
+__attribute__((target("avx,f16c")))
+static int half_row_to_float_f16c(const uint16_t *s, float *d, int n)
+{
+    int i = 0;
+    for(; i + 8 <= n; i += 8){
+        __m128i h = _mm_loadu_si128((const __m128i *)(s + i));
+        _mm256_storeu_ps(d + i, _mm256_cvtph_ps(h));
+    }
+    return i;
+}
+
+__attribute__((target("avx,f16c")))
+static int float_row_to_half_f16c(const float *s, uint16_t *d, int n)
+{
+    int i = 0;
+    for(; i + 8 <= n; i += 8){
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(s + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i *)(d + i), h);
+    }
+    return i;
+}
+#endif
+
+static int use_f16c()
+{
+#ifdef SIMD_X86
+    static int has = -1;
+    if(has < 0) has = simd_level() >= SIMD_AVX2 && __builtin_cpu_supports("f16c");
+    return has;
+#else
+    return 0;
+#endif
+}
+
+static void *packed_row(packed_image im, int y, int c)
+{
+    return (char *)im.data + ((size_t)c*im.h + y)*im.w*storage_size(im.type);
+}
+
+// Widen one row of one channel of a packed image to floats.
+// packed_image im: source image.
+// int y, c: row and channel to read.
+// float *dst: im.w floats to fill.
+void load_packed_row(packed_image im, int y, int c, float *dst)
+{
+    int i = 0;
+    void *src = packed_row(im, y, c);
+    if(im.type == STORE_F32){
+        memcpy(dst, src, im.w*sizeof(float));
+    } else if(im.type == STORE_U8){
+        unsigned char *s = src;
+        for(i = 0; i < im.w; ++i) dst[i] = s[i]/255.f;
+    } else {
+        uint16_t *s = src;
+#ifdef SIMD_X86
+        if(use_f16c()) i = half_row_to_float_f16c(s, dst, im.w);
+#endif
+        for(; i < im.w; ++i) dst[i] = half_to_float(s[i]);
+    }
+}
+
+// Narrow one row of floats into a row of a packed image. U8 storage
+// clamps to [0,1] and rounds to the nearest of 256 levels.
+void store_packed_row(packed_image im, int y, int c, const float *src)
+{
+    int i = 0;
+    void *dst = packed_row(im, y, c);
+    if(im.type == STORE_F32){
+        memcpy(dst, src, im.w*sizeof(float));
+    } else if(im.type == STORE_U8){
+        unsigned char *d = dst;
+        for(i = 0; i < im.w; ++i){
+            float v = MIN(MAX(src[i], 0), 1);
+            d[i] = (unsigned char)(255*v + .5f);
+        }
+    } else {
+        uint16_t *d = dst;
+#ifdef SIMD_X86
+        if(use_f16c()) i = float_row_to_half_f16c(src, d, im.w);
+#endif
+        for(; i < im.w; ++i) d[i] = float_to_half(src[i]);
+    }
+}
+
+// Read a single pixel of a packed image as a float, clamping coordinates.
+float get_packed_pixel(packed_image im, int x, int y, int c)
+{
+    assert(0 <= c && c < im.c);
+    x = MIN(MAX(x, 0), im.w - 1);
+    y = MIN(MAX(y, 0), im.h - 1);
+    size_t i = x + ((size_t)c*im.h + y)*im.w;
+    if(im.type == STORE_U8) return ((unsigned char *)im.data)[i]/255.f;
+    if(im.type == STORE_F16) return half_to_float(((uint16_t *)im.data)[i]);
+    return ((float *)im.data)[i];
+}
+
+packed_image make_packed_image(int w, int h, int c, STORAGE type)
+{
+    PROFILE_FUNC();
+    packed_image im;
+    im.w = w;
+    im.h = h;
+    im.c = c;
+    im.type = type;
+    im.data = pool_alloc((size_t)w*h*c*storage_size(type));
+    return im;
+}
+
+void free_packed_image(packed_image im)
+{
+    PROFILE_FUNC();
+    pool_free(im.data);
+}
+
+// Convert an image to packed storage.
+packed_image pack_image(image im, STORAGE type)
+{
+    PROFILE_FUNC();
+    packed_image p = make_packed_image(im.w, im.h, im.c, type);
+    int j, k;
+    for(k = 0; k < im.c; ++k){
+        for(j = 0; j < im.h; ++j){
+            store_packed_row(p, j, k, im.data + (k*im.h + j)*im.w);
+        }
+    }
+    return p;
+}
+
+// Convert packed storage back to a float image.
+image unpack_image(packed_image p)
+{
+    PROFILE_FUNC();
+    image im = make_image(p.w, p.h, p.c);
+    int j, k;
+    for(k = 0; k < p.c; ++k){
+        for(j = 0; j < p.h; ++j){
+            load_packed_row(p, j, k, im.data + (k*p.h + j)*p.w);
+        }
+    }
+    return im;
+}
+
+// Load an image straight into packed storage. 8 bit files loaded as
+// STORE_U8 are copied without ever being widened to floats.
+packed_image load_image_packed(char *filename, STORAGE type)
+{
+    PROFILE_FUNC();
+    if(type != STORE_U8){
+        image im = load_image(filename);
+        packed_image p = pack_image(im, type);
+        free_image(im);
+        return p;
+    }
+    int w, h, c;
+    unsigned char *data = stbi_load(filename, &w, &h, &c, 0);
+    if (!data) {
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
+            filename, stbi_failure_reason());
+        exit(0);
+    }
+    // Alpha channels are dropped like in load_image
+    int oc = (c == 4) ? 3 : c;
+    packed_image p = make_packed_image(w, h, oc, STORE_U8);
+    unsigned char *d = p.data;
+    int i, k;
+    for(k = 0; k < oc; ++k){
+        for(i = 0; i < w*h; ++i){
+            d[k*w*h + i] = data[i*c + k];
+        }
+    }
+    free(data);
+    return p;
+}
+
+static void save_packed_stb(packed_image p, const char *name, int png)
+{
+    char buff[256];
+    unsigned char *data = calloc(p.w*p.h*p.c, sizeof(char));
+    float *row = calloc(p.w, sizeof(float));
+    int i, j, k;
+    for(k = 0; k < p.c; ++k){
+        for(j = 0; j < p.h; ++j){
+            unsigned char *d = data + j*p.w*p.c + k;
+            if(p.type == STORE_U8){
+                unsigned char *s = packed_row(p, j, k);
+                for(i = 0; i < p.w; ++i) d[i*p.c] = s[i];
+            } else {
+                load_packed_row(p, j, k, row);
+                for(i = 0; i < p.w; ++i) d[i*p.c] = (unsigned char) roundf(255*row[i]);
+            }
+        }
+    }
+    int success = 0;
+    if(png){
+        sprintf(buff, "%s.png", name);
+        success = stbi_write_png(buff, p.w, p.h, p.c, data, p.w*p.c);
+    } else {
+        sprintf(buff, "%s.jpg", name);
+        success = stbi_write_jpg(buff, p.w, p.h, p.c, data, 100);
+    }
+    free(row);
+    free(data);
+    if(!success) fprintf(stderr, "Failed to write image %s\n", buff);
+}
+
+void save_packed_image(packed_image p, const char *name)
+{
+    PROFILE_FUNC();
+    save_packed_stb(p, name, 0);
+}
+
+void save_packed_png(packed_image p, const char *name)
+{
+    PROFILE_FUNC();
+    save_packed_stb(p, name, 1);
+}
+
+// Widen rows [y0, y1) of every channel into a float strip, clamping rows
+// outside the image to its edges.
+// image strip: im.w x (y1 - y0) x im.c scratch image.
+static void load_packed_strip(packed_image im, int y0, int y1, image strip)
+{
+    int j, k;
+    for(k = 0; k < im.c; ++k){
+        for(j = y0; j < y1; ++j){
+            int y = MIN(MAX(j, 0), im.h - 1);
+            load_packed_row(im, y, k, strip.data + (k*strip.h + j - y0)*strip.w);
+        }
+    }
+}
+
+// Fixed point convolution of 8 bit images. Taps are rounded to int16
+// q = round(f 2^s) and pixels p in 0..255 are multiplied and summed in
+// int32, so an output level is round(sum q p / 2^s) where the float path
+// gives round(sum f p). The sums differ by at most 255 sum |f - q 2^-s|,
+// which is no more than 255 n 2^-(s+1) for n taps and 0 for taps that are
+// small integers. s is the largest that keeps taps in int16 and sums in
+// int32, and the integer path is only taken when the bound is under half
+// a level, which keeps every output within 1 level of the float result.
+//
+// Rank 1 filters run a row pass into int16 values with t fraction bits,
+// then a column pass. Rounding those adds 2^-(t+1) to the error of each
+// row value, which the bound in fixed_separable accounts for.
+
+// Non-separable filters this big go through the FFT on the float path.
+#define FIXED_MAX_TAPS 169
+
+typedef struct{
+    packed_image im, out;
+    int preserve;
+    int fw, fh;
+    int separable;
+    int shift, row_shift;
+    int32_t *taps, *row_taps;
+} fixed_job;
+
+// acc[x] = sum over pairs p of lo(q[p]) src[2p][x] + hi(q[p]) src[2p+1][x]
+// for x in [0, w), where q packs two int16 taps and w is a multiple of 16.
+typedef void fixed_kernel(const int16_t **src, const int32_t *q, int n, int32_t *acc, int w);
+
+static void fixed_scalar(const int16_t **src, const int32_t *q, int n, int32_t *acc, int w)
+{
+    int x, p;
+    for(x = 0; x < w; ++x) acc[x] = 0;
+    for(p = 0; p < n; ++p){
+        int16_t lo = (int16_t)(q[p] & 0xffff), hi = (int16_t)(q[p] >> 16);
+        const int16_t *a = src[2*p], *b = src[2*p + 1];
+        for(x = 0; x < w; ++x) acc[x] += lo*a[x] + hi*b[x];
+    }
+}
+
+#ifdef SIMD_X86
+// Interleaving the two rows of a pair lines up both products of an output
+// next to each other, so pmaddwd gives each output its pair summed in 32
+// bits, 4 outputs per 128 bits of int16 where f32 gets 4 products.
+__attribute__((target("sse2")))
+static void fixed_sse2(const int16_t **src, const int32_t *q, int n, int32_t *acc, int w)
+{
+    int x, p;
+    for(x = 0; x < w; x += 8){
+        __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+        for(p = 0; p < n; ++p){
+            __m128i c = _mm_set1_epi32(q[p]);
+            __m128i a = _mm_loadu_si128((const __m128i *)(src[2*p] + x));
+            __m128i b = _mm_loadu_si128((const __m128i *)(src[2*p + 1] + x));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), c));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), c));
+        }
+        _mm_storeu_si128((__m128i *)(acc + x), lo);
+        _mm_storeu_si128((__m128i *)(acc + x + 4), hi);
+    }
+}
+
+// Same with 256 bit vectors. Unpacking works within 128 bit lanes, so lo
+// holds outputs 0-3 and 8-11 and hi 4-7 and 12-15 until they are stored.
+__attribute__((target("avx2")))
+static void fixed_avx2(const int16_t **src, const int32_t *q, int n, int32_t *acc, int w)
+{
+    int x, p;
+    for(x = 0; x < w; x += 16){
+        __m256i lo = _mm256_setzero_si256(), hi = _mm256_setzero_si256();
+        for(p = 0; p < n; ++p){
+            __m256i c = _mm256_set1_epi32(q[p]);
+            __m256i a = _mm256_loadu_si256((const __m256i *)(src[2*p] + x));
+            __m256i b = _mm256_loadu_si256((const __m256i *)(src[2*p + 1] + x));
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), c));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), c));
+        }
+        _mm256_storeu_si256((__m256i *)(acc + x), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(acc + x + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+}
+#endif
+
+static fixed_kernel *fixed_dispatch()
+{
+#ifdef SIMD_X86
+    if(simd_level() == SIMD_AVX2) return fixed_avx2;
+    if(simd_level() == SIMD_SSE4) return fixed_sse2;
+#endif
+    return fixed_scalar;
+}
+
+static int32_t tap_pair(int16_t lo, int16_t hi)
+{
+    return (int32_t)((uint16_t)lo | (uint32_t)(uint16_t)hi << 16);
+}
+
+// Widen a row of a u8 image to n int16s, repeating the edge pixels r times
+// on the left and as far as needed on the right.
+static void widen_row(const unsigned char *s, int w, int r, int16_t *d, int n)
+{
+    int i;
+    for(i = 0; i < r; ++i) d[i] = s[0];
+    for(i = 0; i < w; ++i) d[r + i] = s[i];
+    for(i = r + w; i < n; ++i) d[i] = s[w - 1];
+}
+
+static int ring_slot(int y, int n)
+{
+    return ((y % n) + n) % n;
+}
+
+// Output rows [start, end) of a fixed point convolution. Source rows are
+// widened, and row filtered for separable filters, into a ring per channel
+// that the next fh output rows read from.
+static void fixed_rows(void *ctx, int start, int end)
+{
+    fixed_job *j = ctx;
+    packed_image im = j->im;
+    int fw = j->fw + (j->fw & 1), fh = j->fh;
+    int ry = fh/2;
+    int wr = (im.w + 15) & ~15;
+    int pw = wr + fw + 16;
+    int rs = j->separable ? wr : pw;
+    int oc = j->preserve ? im.c : 1;
+    int group = j->preserve ? 1 : im.c;
+    // Pairs of taps for one output channel
+    int pairs = group*(j->separable ? (fh + 1)/2 : fh*fw/2);
+    int16_t *ring = malloc((size_t)im.c*fh*rs*sizeof(int16_t));
+    int16_t *wide = malloc(pw*sizeof(int16_t));
+    int32_t *acc = malloc(wr*sizeof(int32_t));
+    const int16_t **src = malloc(2*MAX(pairs, fw/2)*sizeof(int16_t *));
+    fixed_kernel *kernel = fixed_dispatch();
+    int next = start - ry;
+    int y, k, o, g, fy, x, p;
+    for(y = start; y < end; ++y){
+        // Fill in the rows this output row reads that aren't in the ring yet
+        for(; next < y - ry + fh; ++next){
+            int sy = MIN(MAX(next, 0), im.h - 1);
+            for(k = 0; k < im.c; ++k){
+                int16_t *r = ring + ((size_t)k*fh + ring_slot(next, fh))*rs;
+                if(!j->separable){
+                    widen_row(packed_row(im, sy, k), im.w, j->fw/2, r, pw);
+                    continue;
+                }
+                widen_row(packed_row(im, sy, k), im.w, j->fw/2, wide, pw);
+                for(p = 0; p < fw/2; ++p){
+                    src[2*p] = wide + 2*p;
+                    src[2*p + 1] = wide + 2*p + 1;
+                }
+                kernel(src, j->row_taps + k*fw/2, fw/2, acc, wr);
+                int32_t half = j->row_shift ? 1 << (j->row_shift - 1) : 0;
+                for(x = 0; x < wr; ++x) r[x] = (int16_t)((acc[x] + half) >> j->row_shift);
+            }
+        }
+        for(o = 0; o < oc; ++o){
+            p = 0;
+            for(g = 0; g < group; ++g){
+                k = o + g;
+                const int16_t *r = ring + (size_t)k*fh*rs;
+                if(j->separable){
+                    for(fy = 0; fy < fh; fy += 2, ++p){
+                        src[2*p] = r + ring_slot(y - ry + fy, fh)*rs;
+                        src[2*p + 1] = r + ring_slot(y - ry + MIN(fy + 1, fh - 1), fh)*rs;
+                    }
+                } else {
+                    for(fy = 0; fy < fh; ++fy){
+                        const int16_t *s = r + ring_slot(y - ry + fy, fh)*rs;
+                        for(x = 0; x < fw; x += 2, ++p){
+                            src[2*p] = s + x;
+                            src[2*p + 1] = s + x + 1;
+                        }
+                    }
+                }
+            }
+            kernel(src, j->taps + o*pairs, pairs, acc, wr);
+            unsigned char *d = packed_row(j->out, y, o);
+            int32_t half = 1 << (j->shift - 1);
+            for(x = 0; x < im.w; ++x){
+                int32_t v = (acc[x] + half) >> j->shift;
+                d[x] = (unsigned char)MIN(MAX(v, 0), 255);
+            }
+        }
+    }
+    free(ring);
+    free(wide);
+    free(acc);
+    free(src);
+}
+
+// Sum and largest absolute value of the channels of a filter an output
+// channel reads, the largest over output channels if preserve.
+static void filter_range(image f, int c, int preserve, double *sum, double *peak)
+{
+    int n = f.w*f.h;
+    int i, k;
+    *sum = *peak = 0;
+    for(k = 0; k < c; ++k){
+        float *d = f.data + (f.c == 1 ? 0 : k*n);
+        double s = 0;
+        for(i = 0; i < n; ++i){
+            *peak = MAX(*peak, fabs(d[i]));
+            s += fabs(d[i]);
+        }
+        *sum = preserve ? MAX(*sum, s) : *sum + s;
+    }
+}
+
+// Sum of the rounding errors of taps with s fraction bits, grouped over
+// channels like filter_range.
+static double rounding_error(image f, int c, int preserve, int s)
+{
+    int n = f.w*f.h;
+    int i, k;
+    double err = 0;
+    for(k = 0; k < c; ++k){
+        float *d = f.data + (f.c == 1 ? 0 : k*n);
+        double e = 0;
+        for(i = 0; i < n; ++i) e += fabs(d[i] - ldexp(lrint(ldexp(d[i], s)), -s));
+        err = preserve ? MAX(err, e) : err + e;
+    }
+    return err;
+}
+
+// Largest number of fraction bits in [lo, 30] that fits taps of at most
+// peak in int16 and sums of n taps times values up to vmax in int32, with
+// extra fraction bits on the values. -1 if not even lo fits.
+static int fraction_bits(double peak, double sum, int n, double vmax, int extra, int lo)
+{
+    int s;
+    for(s = MIN(30, 30 - extra); s >= lo; --s){
+        double scale = ldexp(1, s);
+        if(peak*scale + .5 > 32767) continue;
+        if(vmax*(sum*scale + .5*n) + ldexp(1, s + extra) < 2147483647.) return s;
+    }
+    return -1;
+}
+
+// Pack taps a pair at a time. For each output channel, the filter channels
+// it sums come one after another. Pairs run along the rows of a filter,
+// with rows padded to an even width, or down a column filter if column,
+// padded to an even height.
+static int32_t *pack_taps(image f, int c, int preserve, int s, int column)
+{
+    int n = f.w*f.h;
+    int per = column ? f.h + (f.h & 1) : (f.w + (f.w & 1))*f.h;
+    int16_t *q = calloc((size_t)c*per, sizeof(int16_t));
+    int32_t *pairs = malloc((size_t)c*per/2*sizeof(int32_t));
+    int k, x, y, i;
+    for(k = 0; k < c; ++k){
+        float *d = f.data + (f.c == 1 ? 0 : k*n);
+        for(y = 0; y < f.h; ++y){
+            for(x = 0; x < f.w; ++x){
+                int at = column ? y : y*(f.w + (f.w & 1)) + x;
+                q[k*per + at] = (int16_t)lrint(ldexp(d[y*f.w + x], s));
+            }
+        }
+    }
+    for(i = 0; i < c*per/2; ++i) pairs[i] = tap_pair(q[2*i], q[2*i + 1]);
+    free(q);
+    return pairs;
+}
+
+// Set up a separable fixed point convolution.
+// returns: 1 if the error bound allows it, 0 otherwise.
+static int fixed_separable(fixed_job *j, image filter)
+{
+    packed_image im = j->im;
+    image row, col;
+    if(filter.w == 1 || filter.h == 1 || !separate_filter(filter, &row, &col)) return 0;
+    double rsum, rpeak, csum, cpeak;
+    filter_range(row, im.c, 1, &rsum, &rpeak);
+    filter_range(col, im.c, j->preserve, &csum, &cpeak);
+    int nc = j->preserve ? filter.h : filter.h*im.c;
+    // Row values get t fraction bits and must fit in int16
+    double rmax = 255*rsum + 1;
+    int t = (int)floor(log2(32767/rmax));
+    int s1 = t >= 0 ? fraction_bits(rpeak, rsum, filter.w, 255, -t - 1, t) : -1;
+    int s2 = s1 >= 0 ? fraction_bits(cpeak, csum, nc, 32767, t - 1, MAX(0, 1 - t)) : -1;
+    int ok = 0;
+    if(s2 >= 0){
+        // Error of a row value, then of the column sum of row values
+        double e1 = ldexp(1, -(t + 1)) + 255*rounding_error(row, im.c, 1, s1);
+        double bound = rounding_error(col, im.c, j->preserve, s2)*(255*rsum + e1) + csum*e1;
+        if(bound < .5){
+            j->separable = 1;
+            j->row_shift = s1 - t;
+            j->shift = s2 + t;
+            j->row_taps = pack_taps(row, im.c, 1, s1, 0);
+            j->taps = pack_taps(col, im.c, j->preserve, s2, 1);
+            ok = 1;
+        }
+    }
+    free_image(row);
+    free_image(col);
+    return ok;
+}
+
+// Quantize a filter and convolve with it in fixed point, if its error bound
+// allows.
+// returns: 1 if out was filled, 0 if the filter needs the float path.
+static int convolve_fixed(packed_image im, image filter, int preserve, packed_image out)
+{
+    fixed_job j = {im, out, preserve, filter.w, filter.h};
+    if(!fixed_separable(&j, filter)){
+        if(filter.w*filter.h >= FIXED_MAX_TAPS) return 0;
+        double sum, peak;
+        filter_range(filter, im.c, preserve, &sum, &peak);
+        int n = preserve ? filter.w*filter.h : filter.w*filter.h*im.c;
+        int s = fraction_bits(peak, sum, n, 255, -1, 1);
+        if(s < 0 || 255*rounding_error(filter, im.c, preserve, s) >= .5) return 0;
+        j.shift = s;
+        j.taps = pack_taps(filter, im.c, preserve, s, 0);
+    }
+    parallel_for(im.h, 16, fixed_rows, &j);
+    free(j.taps);
+    free(j.row_taps);
+    return 1;
+}
+
+// Convolve a packed image. 8 bit images use the fixed point path above
+// when the filter allows, within 1 level of the float result. Otherwise
+// rows are widened to floats a strip at a time with a halo of filter.h/2
+// rows, and only the strip's interior rows are kept, so results match
+// convolve_image.
+// returns: packed image with the same storage type as im.
+packed_image convolve_packed(packed_image im, image filter, int preserve)
+{
+    PROFILE_FUNC();
+    assert(im.c == filter.c || filter.c == 1);
+    int oc = preserve ? im.c : 1;
+    packed_image out = make_packed_image(im.w, im.h, oc, im.type);
+    if(im.type == STORE_U8 && convolve_fixed(im, filter, preserve, out)){
+        PROFILE_BYTES((size_t)im.w*im.h*im.c, (size_t)out.w*out.h*out.c);
+        return out;
+    }
+    int ry = filter.h / 2;
+    int halo = filter.h - 1;
+    image strip = make_image(im.w, STRIP_ROWS + halo, im.c);
+    image res = make_image(im.w, STRIP_ROWS + halo, oc);
+    int y0, j, k;
+    for(y0 = 0; y0 < im.h; y0 += STRIP_ROWS){
+        int rows = MIN(STRIP_ROWS, im.h - y0);
+        strip.h = res.h = rows + halo;
+        load_packed_strip(im, y0 - ry, y0 - ry + strip.h, strip);
+        convolve_view(view_image(strip), filter, preserve, view_image(res));
+        for(k = 0; k < oc; ++k){
+            for(j = 0; j < rows; ++j){
+                store_packed_row(out, y0 + j, k, res.data + (k*res.h + j + ry)*res.w);
+            }
+        }
+    }
+    free_image(strip);
+    free_image(res);
+    return out;
+}
+
+// Bilinear sample of a packed image, same weights as bilinear_interpolate.
+float bilinear_interpolate_packed(packed_image im, float x, float y, int c)
+{
+    float top = floorf(y), bottom = top + 1;
+    float left = floorf(x), right = left + 1;
+    float q1 = (bottom - y)*get_packed_pixel(im, left, top, c) + (y - top)*get_packed_pixel(im, left, bottom, c);
+    float q2 = (bottom - y)*get_packed_pixel(im, right, top, c) + (y - top)*get_packed_pixel(im, right, bottom, c);
+    return (right - x)*q1 + (x - left)*q2;
+}
+
+static packed_image resize_packed(packed_image im, int w, int h, int bilinear)
+{
+    packed_image out = make_packed_image(w, h, im.c, im.type);
+    image src = make_image(im.w, 2, im.c);
+    image dst = make_image(w, 1, im.c);
+    float ay = 1.0 * im.h / h;
+    float by = 0.5 * (ay - 1.0);
+    int row, k;
+    for(row = 0; row < h; ++row){
+        float yi = ay * row + by;
+        // Widen the one or two source rows this output row reads
+        int top = bilinear ? (int)floorf(yi) : (int)roundf(yi);
+        load_packed_strip(im, top, top + 2, src);
+        image_view sv = view_image(src);
+        image_view dv = view_image(dst);
+        if(bilinear){
+            // Resample the two row strip onto one row at the right offset
+            int col;
+            float ax = 1.0 * im.w / w;
+            float bx = 0.5 * (ax - 1.0);
+            for(k = 0; k < im.c; ++k){
+                for(col = 0; col < w; ++col){
+                    dst.data[k*w + col] = bilinear_interpolate_view(sv, ax*col + bx, yi - top, k);
+                }
+            }
+        } else {
+            nn_resize_view(crop_view(sv, 0, 0, im.w, 1), dv);
+        }
+        for(k = 0; k < im.c; ++k) store_packed_row(out, row, k, dst.data + k*w);
+    }
+    free_image(src);
+    free_image(dst);
+    return out;
+}
+
+packed_image nn_resize_packed(packed_image im, int w, int h)
+{
+    PROFILE_FUNC();
+    return resize_packed(im, w, h, 0);
+}
+
+packed_image bilinear_resize_packed(packed_image im, int w, int h)
+{
+    PROFILE_FUNC();
+    return resize_packed(im, w, h, 1);
+}
+
+static void color_packed(packed_image im, void (*fn)(image_view))
+{
+    assert(im.c == 3);
+    image row = make_image(im.w, 1, 3);
+    int j, k;
+    for(j = 0; j < im.h; ++j){
+        for(k = 0; k < 3; ++k) load_packed_row(im, j, k, row.data + k*im.w);
+        fn(view_image(row));
+        for(k = 0; k < 3; ++k) store_packed_row(im, j, k, row.data + k*im.w);
+    }
+    free_image(row);
+}
+
+void rgb_to_hsv_packed(packed_image im)
+{
+    PROFILE_FUNC();
+    color_packed(im, rgb_to_hsv_view);
+}
+
+void hsv_to_rgb_packed(packed_image im)
+{
+    PROFILE_FUNC();
+    color_packed(im, hsv_to_rgb_view);
+}
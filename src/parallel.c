@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "image.h"
+#include "parallel.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Tiles are handed out through a shared counter, so threads that finish
+// early keep taking work. Without OpenMP the threads come from a pool that
+// is started on first use and sleeps between loops; the calling thread
+// works on tiles too.
+
+#define TILES_PER_THREAD 4
+
+static pthread_once_t parallel_once = PTHREAD_ONCE_INIT;
+static int num_threads = 1;
+static int tile_override = 0;
+static __thread int in_parallel = 0;
+
+static void parallel_init()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = cores > 0 ? cores : 1;
+    char *env = getenv("UWIMG_THREADS");
+    if(env && atoi(env) > 0) num_threads = atoi(env);
+    env = getenv("UWIMG_TILE");
+    if(env && atoi(env) > 0) tile_override = atoi(env);
+}
+
+int get_num_threads()
+{
+    pthread_once(&parallel_once, parallel_init);
+    return num_threads;
+}
+
+void set_num_threads(int n)
+{
+    pthread_once(&parallel_once, parallel_init);
+    num_threads = MAX(n, 1);
+}
+
+#ifndef _OPENMP
+
+typedef struct{
+    range_fn fn;
+    void *ctx;
+    int n, tile;
+    int next;
+    int threads;
+    int active;
+} job;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static job current;
+static unsigned long generation;
+static int busy;
+static int n_workers;
+
+// Take tiles off the shared counter until there are none left.
+static void run_tiles(job *j)
+{
+    int start;
+    while((start = __atomic_fetch_add(&j->next, j->tile, __ATOMIC_RELAXED)) < j->n){
+        j->fn(j->ctx, start, MIN(start + j->tile, j->n));
+    }
+}
+
+static void *worker(void *arg)
+{
+    int id = (int)(size_t)arg;
+    unsigned long seen = 0;
+    in_parallel = 1;
+    pthread_mutex_lock(&pool_lock);
+    for(;;){
+        while(generation == seen) pthread_cond_wait(&start_cond, &pool_lock);
+        seen = generation;
+        // Workers beyond the current thread count sit this loop out
+        int joins = id < current.threads - 1;
+        pthread_mutex_unlock(&pool_lock);
+        if(joins) run_tiles(&current);
+        pthread_mutex_lock(&pool_lock);
+        if(--current.active == 0) pthread_cond_signal(&done_cond);
+    }
+    return 0;
+}
+
+// Make sure there are at least n workers. Called with pool_lock held.
+static void grow_pool(int n)
+{
+    while(n_workers < n){
+        pthread_t t;
+        if(pthread_create(&t, 0, worker, (void *)(size_t)n_workers)) break;
+        pthread_detach(t);
+        ++n_workers;
+    }
+}
+
+#endif
+
+void parallel_for(int n, int grain, range_fn fn, void *ctx)
+{
+    if(n <= 0) return;
+    pthread_once(&parallel_once, parallel_init);
+    int threads = num_threads;
+    int tile = tile_override;
+    if(!tile) tile = MAX(grain, (n + threads*TILES_PER_THREAD - 1) / (threads*TILES_PER_THREAD));
+    tile = MAX(tile, 1);
+    if(threads == 1 || n <= tile || in_parallel){
+        fn(ctx, 0, n);
+        return;
+    }
+#ifdef _OPENMP
+    int tiles = (n + tile - 1) / tile;
+    int t;
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(threads)
+    for(t = 0; t < tiles; ++t){
+        in_parallel = 1;
+        fn(ctx, t*tile, MIN((t + 1)*tile, n));
+        in_parallel = 0;
+    }
+#else
+    pthread_mutex_lock(&pool_lock);
+    if(busy){
+        // Another thread owns the pool, don't wait for it
+        pthread_mutex_unlock(&pool_lock);
+        fn(ctx, 0, n);
+        return;
+    }
+    busy = 1;
+    grow_pool(threads - 1);
+    current.fn = fn;
+    current.ctx = ctx;
+    current.n = n;
+    current.tile = tile;
+    current.next = 0;
+    current.threads = threads;
+    current.active = n_workers;
+    ++generation;
+    pthread_cond_broadcast(&start_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    in_parallel = 1;
+    run_tiles(&current);
+    in_parallel = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    while(current.active > 0) pthread_cond_wait(&done_cond, &pool_lock);
+    busy = 0;
+    pthread_mutex_unlock(&pool_lock);
+#endif
+}
@@ -0,0 +1,22 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+// Body of a parallel loop, called on the half open range [start, end).
+// void *ctx: caller data shared by every call, read only or written at
+//            disjoint indices.
+typedef void (*range_fn)(void *ctx, int start, int end);
+
+// Split [0, n) into tiles and run fn over them on the thread pool, or on
+// OpenMP threads when built with OPENMP=1. Returns once every tile is done.
+// Calls from inside a running loop execute serially on the calling thread.
+// int n: number of iterations, usually rows.
+// int grain: smallest tile worth handing to another thread.
+// The environment variables UWIMG_THREADS and UWIMG_TILE override the number
+// of threads (default: all cores) and the tile size.
+void parallel_for(int n, int grain, range_fn fn, void *ctx);
+
+// Number of threads parallel_for spreads work over, including the caller.
+int get_num_threads();
+void set_num_threads(int n);
+
+#endif
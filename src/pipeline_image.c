@@ -0,0 +1,444 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "image.h"
+#include "parallel.h"
+#include "profile.h"
+
+// A pipeline is a graph of stages over images of one size. Stages are
+// added after the stages they read, so their numbers are a topological
+// order. run_pipeline decides how each stage is computed:
+//
+// - Roots are computed whole into an image: the inputs, the output, and
+//   stages that can't be computed a strip at a time, i.e. the inputs of
+//   normalizations, which need every pixel first, and the inputs of
+//   stencils too tall to tile.
+// - Every other stage a root depends on is computed a strip of rows at a
+//   time into a buffer holding just the rows the strip needs, plus the
+//   halo its stencil consumers read above and below. Strips are sized so
+//   these buffers stay in L2 and run in parallel.
+// - A point-wise stage whose only consumer is point-wise is fused into it:
+//   it's computed a row at a time into a one row buffer, right before its
+//   consumer reads the row.
+//
+// Roots whose inputs are all roots run through the whole image engines,
+// convolve_view and gradient_view, which pick their own algorithms.
+
+#define STAGE_INPUTS 4
+// Bytes of strip buffers one thread should keep in cache
+#define PIPE_CACHE (256*1024)
+// Inputs of stencils reading more rows than this are computed whole
+#define PIPE_HALO 32
+// Strips are at least this many times taller than the rows read past them
+#define PIPE_RECOMPUTE 4
+
+typedef enum{
+    STAGE_INPUT, STAGE_CONVOLVE, STAGE_GRADIENT, STAGE_NORMALIZE, STAGE_MAP
+} STAGE;
+
+// int c: number of channels it produces.
+// int top, bottom: rows above and below an output row it reads.
+typedef struct{
+    STAGE type;
+    int c;
+    int in[STAGE_INPUTS];
+    int n;
+    int top, bottom;
+    image_view view;
+    image filter;
+    int preserve;
+    int flags;
+    map_fn fn;
+    void *ctx;
+} stage;
+
+struct pipeline{
+    int w, h;
+    int n, size;
+    stage *s;
+};
+
+// Schedule of one run_pipeline call, see the top of the file.
+typedef struct{
+    pipeline *p;
+    int *users;
+    int *root;
+    int *fused;
+    int *member;
+    int *top, *bottom;
+    image_view *full;
+    pixel_stats **stats;
+    int target;
+    int strip;
+} plan;
+
+// Buffers of one thread working through strips.
+typedef struct{
+    plan *pl;
+    float **buf;
+    image_view *view;
+    int *lo, *hi;
+} strip_state;
+
+pipeline *make_pipeline()
+{
+    return calloc(1, sizeof(pipeline));
+}
+
+void free_pipeline(pipeline *p)
+{
+    int i;
+    for(i = 0; i < p->n; ++i){
+        if(p->s[i].type == STAGE_CONVOLVE) free_image(p->s[i].filter);
+    }
+    free(p->s);
+    free(p);
+}
+
+static int is_pointwise(stage *s)
+{
+    return s->type == STAGE_NORMALIZE || s->type == STAGE_MAP;
+}
+
+static int add_stage(pipeline *p, stage s)
+{
+    int i;
+    for(i = 0; i < s.n; ++i) assert(0 <= s.in[i] && s.in[i] < p->n);
+    if(p->n == p->size){
+        p->size = p->size ? 2*p->size : 8;
+        p->s = realloc(p->s, p->size*sizeof(stage));
+    }
+    p->s[p->n] = s;
+    return p->n++;
+}
+
+// Add an image to read from. Every input of a pipeline has the same size.
+// image_view im: pixels to read, must stay valid until the pipeline runs.
+// returns: stage number.
+int pipe_input(pipeline *p, image_view im)
+{
+    int i;
+    for(i = 0; i < p->n; ++i) if(p->s[i].type == STAGE_INPUT) break;
+    if(i == p->n){
+        p->w = im.w;
+        p->h = im.h;
+    }
+    assert(im.w == p->w && im.h == p->h);
+    stage s = {STAGE_INPUT, im.c};
+    s.view = im;
+    return add_stage(p, s);
+}
+
+// Add a convolution of a stage, as convolve_view computes it.
+// image filter: filter with 1 channel or as many as the stage read, copied.
+// int preserve: 1 keeps channels separate, 0 sums them into one channel.
+// returns: stage number.
+int pipe_convolve(pipeline *p, int in, image filter, int preserve)
+{
+    assert(0 <= in && in < p->n);
+    assert(filter.c == 1 || filter.c == p->s[in].c);
+    stage s = {STAGE_CONVOLVE, preserve ? p->s[in].c : 1, {in}, 1};
+    s.top = filter.h/2;
+    s.bottom = filter.h - 1 - filter.h/2;
+    s.filter = copy_image(filter);
+    s.preserve = preserve;
+    return add_stage(p, s);
+}
+
+// Add Sobel gradients of a stage, as gradient_view computes them.
+// int flags: GRADIENT values or'ed together.
+// returns: stage number, one channel for each flag set.
+int pipe_gradient(pipeline *p, int in, int flags)
+{
+    int n = 0, flag;
+    for(flag = GRADIENT_X; flag <= GRADIENT_XY; flag <<= 1) n += !!(flags & flag);
+    assert(n > 0);
+    stage s = {STAGE_GRADIENT, n, {in}, 1, 1, 1};
+    s.flags = flags;
+    return add_stage(p, s);
+}
+
+// Add a stage scaling each channel of another to [0, 1] like
+// feature_normalize. The stage it reads is computed whole first.
+// returns: stage number.
+int pipe_normalize(pipeline *p, int in)
+{
+    assert(0 <= in && in < p->n);
+    stage s = {STAGE_NORMALIZE, p->s[in].c, {in}, 1};
+    return add_stage(p, s);
+}
+
+// Add a point-wise stage.
+// const int *in: stages it reads, at most 4.
+// int n: number of stages it reads.
+// int c: number of channels it produces.
+// map_fn fn: computes out from the same pixels of each stage in in.
+// void *ctx: passed to fn, must stay valid until the pipeline runs.
+// returns: stage number.
+int pipe_map(pipeline *p, const int *in, int n, int c, map_fn fn, void *ctx)
+{
+    assert(0 < n && n <= STAGE_INPUTS && c > 0);
+    stage s = {STAGE_MAP, c};
+    memcpy(s.in, in, n*sizeof(int));
+    s.n = n;
+    s.fn = fn;
+    s.ctx = ctx;
+    return add_stage(p, s);
+}
+
+static void normalize_rows(pixel_stats *stats, image_view in, image_view out)
+{
+    int x, y, c;
+    for(c = 0; c < in.c; ++c){
+        float min = stats[c].min, max = MAX(stats[c].max, 0);
+        float scale = max - min > 0 ? 1/(max - min) : 0;
+        for(y = 0; y < in.h; ++y){
+            const float *s = view_ptr(in, 0, y, c);
+            float *d = view_ptr(out, 0, y, c);
+            for(x = 0; x < in.w; ++x) d[x*out.xs] = (s[x*in.xs] - min)*scale;
+        }
+    }
+}
+
+// Compute rows [y0, y1) of a point-wise stage into out, a view of just
+// those rows. Fused inputs are computed first, a row at a time.
+static void point_rows(strip_state *t, int s, int y0, int y1, image_view out)
+{
+    plan *pl = t->pl;
+    stage *st = pl->p->s + s;
+    image_view in[STAGE_INPUTS];
+    int k, y, fused = 0;
+    for(k = 0; k < st->n; ++k) fused |= pl->fused[st->in[k]];
+    if(fused && y1 - y0 > 1){
+        for(y = y0; y < y1; ++y) point_rows(t, s, y, y + 1, crop_view(out, 0, y - y0, out.w, 1));
+        return;
+    }
+    for(k = 0; k < st->n; ++k){
+        int i = st->in[k];
+        if(pl->fused[i]){
+            in[k] = strip_view(t->buf[i], pl->p->w, 1, pl->p->s[i].c, 0, 1);
+            point_rows(t, i, y0, y1, in[k]);
+        } else {
+            in[k] = crop_view(t->view[i], 0, y0, pl->p->w, y1 - y0);
+        }
+    }
+    if(st->type == STAGE_NORMALIZE) normalize_rows(pl->stats[s], in[0], out);
+    else st->fn(st->ctx, in, out);
+}
+
+// Compute rows [y0, y1) of a stage that isn't fused into t->view[s].
+static void stage_rows(strip_state *t, int s, int y0, int y1)
+{
+    plan *pl = t->pl;
+    stage *st = pl->p->s + s;
+    image_view out = t->view[s];
+    image_view outs[7];
+    int k;
+    switch(st->type){
+        case STAGE_CONVOLVE:
+            convolve_view_rows(t->view[st->in[0]], st->filter, st->preserve, out, y0, y1);
+            break;
+        case STAGE_GRADIENT:
+            for(k = 0; k < st->c; ++k) outs[k] = channel_view(out, k);
+            gradient_view_rows(t->view[st->in[0]], st->flags, outs, y0, y1);
+            break;
+        case STAGE_NORMALIZE:
+        case STAGE_MAP:
+            point_rows(t, s, y0, y1, crop_view(out, 0, y0, out.w, y1 - y0));
+            break;
+        case STAGE_INPUT:
+            break;
+    }
+}
+
+// Run strips [start, end) of the plan's target root.
+static void run_strips(void *ctx, int start, int end)
+{
+    plan *pl = ctx;
+    pipeline *p = pl->p;
+    int n = p->n, w = p->w, h = p->h, r = pl->target;
+    strip_state t = {pl};
+    t.buf = calloc(n, sizeof(float *));
+    t.view = calloc(n, sizeof(image_view));
+    t.lo = calloc(n, sizeof(int));
+    t.hi = calloc(n, sizeof(int));
+    int i, k, s, strip;
+    for(i = 0; i < n; ++i){
+        if(pl->root[i]) t.view[i] = pl->full[i];
+        if(!pl->member[i]) continue;
+        int rows = pl->fused[i] ? 1 : MIN(pl->strip + pl->top[i] + pl->bottom[i], h);
+        t.buf[i] = malloc((size_t)w*rows*p->s[i].c*sizeof(float));
+    }
+
+    for(strip = start; strip < end; ++strip){
+        for(i = 0; i < n; ++i){
+            t.lo[i] = h;
+            t.hi[i] = 0;
+        }
+        t.lo[r] = strip*pl->strip;
+        t.hi[r] = MIN(t.lo[r] + pl->strip, h);
+        // Rows each member needs, from the consumers down
+        for(s = r; s >= 0; --s){
+            if(s != r && !pl->member[s]) continue;
+            stage *st = p->s + s;
+            for(k = 0; k < st->n; ++k){
+                i = st->in[k];
+                if(!pl->member[i]) continue;
+                t.lo[i] = MIN(t.lo[i], MAX(t.lo[s] - st->top, 0));
+                t.hi[i] = MAX(t.hi[i], MIN(t.hi[s] + st->bottom, h));
+            }
+        }
+        for(s = 0; s <= r; ++s){
+            if(s != r && (!pl->member[s] || pl->fused[s])) continue;
+            if(s != r) t.view[s] = strip_view(t.buf[s], w, h, p->s[s].c, t.lo[s], t.hi[s]);
+            stage_rows(&t, s, t.lo[s], t.hi[s]);
+        }
+    }
+
+    for(i = 0; i < n; ++i) free(t.buf[i]);
+    free(t.buf);
+    free(t.view);
+    free(t.lo);
+    free(t.hi);
+}
+
+// Compute a root stage into pl->full[r].
+static void run_root(plan *pl, int r)
+{
+    pipeline *p = pl->p;
+    stage *st = p->s + r;
+    int i, s, k, inputs_root = 1;
+    for(k = 0; k < st->n; ++k) inputs_root &= pl->root[st->in[k]];
+    if(inputs_root && st->type == STAGE_CONVOLVE){
+        convolve_view(pl->full[st->in[0]], st->filter, st->preserve, pl->full[r]);
+        return;
+    }
+    if(inputs_root && st->type == STAGE_GRADIENT){
+        image_view outs[7];
+        for(k = 0; k < st->c; ++k) outs[k] = channel_view(pl->full[r], k);
+        gradient_view(pl->full[st->in[0]], st->flags, outs);
+        return;
+    }
+
+    // Members are the stages r reads through stages that aren't roots, and
+    // how far above and below a strip of r they're read
+    int bytes = 0;
+    memset(pl->member, 0, p->n*sizeof(int));
+    memset(pl->top, 0, p->n*sizeof(int));
+    memset(pl->bottom, 0, p->n*sizeof(int));
+    for(s = r; s >= 0; --s){
+        if(s != r && !pl->member[s]) continue;
+        for(k = 0; k < p->s[s].n; ++k){
+            i = p->s[s].in[k];
+            if(pl->root[i]) continue;
+            pl->member[i] = 1;
+            pl->top[i] = MAX(pl->top[i], pl->top[s] + p->s[s].top);
+            pl->bottom[i] = MAX(pl->bottom[i], pl->bottom[s] + p->s[s].bottom);
+        }
+    }
+    // Rows read past a strip are computed again by the strips next to it,
+    // so strips stay a few times taller than that even when their buffers
+    // spill out of L2
+    int halo = 0;
+    for(i = 0; i <= r; ++i){
+        if(i != r && (!pl->member[i] || pl->fused[i])) continue;
+        if(i != r) bytes += p->w*p->s[i].c*sizeof(float);
+        halo = MAX(halo, pl->top[i] + pl->bottom[i] + p->s[i].top + p->s[i].bottom);
+    }
+    pl->strip = bytes ? MAX(PIPE_CACHE/bytes, PIPE_RECOMPUTE*halo) : 32;
+    pl->strip = MAX(pl->strip, 8);
+    pl->target = r;
+    parallel_for((p->h + pl->strip - 1)/pl->strip, 1, run_strips, pl);
+}
+
+// Mark the stages out depends on and count how many of them read each.
+static void count_users(pipeline *p, int out, int *needed, int *users)
+{
+    int s, k;
+    needed[out] = 1;
+    for(s = out; s >= 0; --s){
+        if(!needed[s]) continue;
+        for(k = 0; k < p->s[s].n; ++k){
+            needed[p->s[s].in[k]] = 1;
+            users[p->s[s].in[k]]++;
+        }
+    }
+}
+
+// Run the stages a stage depends on and return its result.
+// int out: stage to compute.
+// returns: new image of p's size with the stage's channels.
+image run_pipeline(pipeline *p, int out)
+{
+    PROFILE_FUNC();
+    assert(0 <= out && out < p->n);
+    int n = p->n, s, k;
+    plan pl = {p};
+    int *needed = calloc(n, sizeof(int));
+    pl.users = calloc(n, sizeof(int));
+    pl.root = calloc(n, sizeof(int));
+    pl.fused = calloc(n, sizeof(int));
+    pl.member = calloc(n, sizeof(int));
+    pl.top = calloc(n, sizeof(int));
+    pl.bottom = calloc(n, sizeof(int));
+    pl.full = calloc(n, sizeof(image_view));
+    pl.stats = calloc(n, sizeof(pixel_stats *));
+    image *owned = calloc(n, sizeof(image));
+    count_users(p, out, needed, pl.users);
+
+    pl.root[out] = 1;
+    for(s = 0; s <= out; ++s){
+        stage *st = p->s + s;
+        if(!needed[s]) continue;
+        if(st->type == STAGE_INPUT) pl.root[s] = 1;
+        for(k = 0; k < st->n; ++k){
+            if(st->type == STAGE_NORMALIZE || st->top + st->bottom > PIPE_HALO) pl.root[st->in[k]] = 1;
+        }
+    }
+    // A point-wise stage read by one point-wise stage is fused into it
+    for(s = 0; s <= out; ++s){
+        stage *st = p->s + s;
+        if(!needed[s]) continue;
+        for(k = 0; k < st->n; ++k){
+            int i = st->in[k];
+            if(is_pointwise(st) && is_pointwise(p->s + i) && !pl.root[i] && pl.users[i] == 1) pl.fused[i] = 1;
+        }
+    }
+
+    for(s = 0; s <= out; ++s){
+        if(!needed[s] || !pl.root[s]) continue;
+        stage *st = p->s + s;
+        if(st->type == STAGE_INPUT){
+            pl.full[s] = st->view;
+            PROFILE_BYTES(IMAGE_BYTES(st->view), 0);
+        } else {
+            owned[s] = make_image(p->w, p->h, st->c);
+            pl.full[s] = view_image(owned[s]);
+            run_root(&pl, s);
+        }
+        // Normalizations reading this stage can run now that it's whole
+        for(k = s + 1; k <= out; ++k){
+            if(!needed[k] || p->s[k].type != STAGE_NORMALIZE || p->s[k].in[0] != s) continue;
+            pl.stats[k] = calloc(st->c, sizeof(pixel_stats));
+            channel_stats(pl.full[s], pl.stats[k]);
+        }
+    }
+
+    image result = p->s[out].type == STAGE_INPUT ? view_to_image(pl.full[out]) : owned[out];
+    PROFILE_BYTES(0, IMAGE_BYTES(result));
+    for(s = 0; s < n; ++s){
+        if(s != out) free_image(owned[s]);
+        free(pl.stats[s]);
+    }
+    free(owned);
+    free(needed);
+    free(pl.users);
+    free(pl.root);
+    free(pl.fused);
+    free(pl.member);
+    free(pl.top);
+    free(pl.bottom);
+    free(pl.full);
+    free(pl.stats);
+    return result;
+}
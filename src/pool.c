@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "pool.h"
+
+// Buffers are rounded up to size classes, four per power of two so no
+// more than a quarter of a buffer is wasted. Freed buffers go to a small
+// per-thread cache first, then to a shared cache guarded by a mutex, and
+// only go back to the system once both are full.
+
+#define MIN_SHIFT 8
+#define NUM_CLASSES ((48 - MIN_SHIFT)*4 + 1)
+#define THREAD_SLOTS 4
+#define THREAD_BYTES ((size_t)64 << 20)
+#define DEFAULT_POOL_MB 512
+#define HUGE_PAGE ((size_t)2 << 20)
+#define POOL_MAGIC 0x9001beefu
+
+// Bookkeeping stored in the POOL_ALIGN bytes in front of every buffer.
+typedef struct block{
+    size_t cap;
+    int cls;
+    int huge;
+    unsigned magic;
+    struct block *next;
+} block;
+
+typedef struct{
+    block *free[NUM_CLASSES];
+    int count[NUM_CLASSES];
+    size_t bytes;
+} thread_cache;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static block *shared_free[NUM_CLASSES];
+static size_t shared_bytes;
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static __thread thread_cache *tcache;
+static int pool_enabled = 1;
+static int use_huge_pages = 0;
+static size_t pool_limit = (size_t)DEFAULT_POOL_MB << 20;
+
+static size_t n_hits, n_misses, n_frees, n_huge;
+static size_t bytes_in_use, bytes_peak, bytes_cached;
+
+static int size_class(size_t size, size_t *cap)
+{
+    if(size <= ((size_t)1 << MIN_SHIFT)){
+        *cap = (size_t)1 << MIN_SHIFT;
+        return 0;
+    }
+    int e = 63 - __builtin_clzll(size - 1);
+    size_t base = (size_t)1 << e;
+    size_t step = base / 4;
+    size_t q = (size - base + step - 1) / step;
+    *cap = base + q*step;
+    return (e - MIN_SHIFT)*4 + (int)q;
+}
+
+static void free_block(block *b)
+{
+    if(b->huge) munmap(b, b->cap + POOL_ALIGN);
+    else free(b);
+}
+
+static void push_shared(block *b)
+{
+    pthread_mutex_lock(&pool_lock);
+    if(shared_bytes + b->cap <= pool_limit){
+        b->next = shared_free[b->cls];
+        shared_free[b->cls] = b;
+        shared_bytes += b->cap;
+        b = 0;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if(b){
+        __atomic_sub_fetch(&bytes_cached, b->cap, __ATOMIC_RELAXED);
+        free_block(b);
+    }
+}
+
+static void flush_thread_cache(void *p)
+{
+    thread_cache *tc = p;
+    int i;
+    for(i = 0; i < NUM_CLASSES; ++i){
+        while(tc->free[i]){
+            block *b = tc->free[i];
+            tc->free[i] = b->next;
+            push_shared(b);
+        }
+    }
+    free(tc);
+}
+
+static void pool_init()
+{
+    pthread_key_create(&cache_key, flush_thread_cache);
+    char *env = getenv("UWIMG_POOL");
+    if(env && 0 == strcmp(env, "0")) pool_enabled = 0;
+    env = getenv("UWIMG_POOL_MB");
+    if(env) pool_limit = (size_t)atol(env) << 20;
+    env = getenv("UWIMG_HUGEPAGES");
+    if(env && 0 != strcmp(env, "0")) use_huge_pages = 1;
+}
+
+static thread_cache *get_thread_cache()
+{
+    if(!tcache){
+        tcache = calloc(1, sizeof(thread_cache));
+        pthread_setspecific(cache_key, tcache);
+    }
+    return tcache;
+}
+
+static block *new_block(size_t cap, int cls)
+{
+    block *b = 0;
+    size_t total = cap + POOL_ALIGN;
+    int huge = 0;
+#ifdef MADV_HUGEPAGE
+    if(use_huge_pages && total >= HUGE_PAGE){
+        total = (total + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+        void *p = mmap(0, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(p != MAP_FAILED){
+            madvise(p, total, MADV_HUGEPAGE);
+            b = p;
+            huge = 1;
+            cap = total - POOL_ALIGN;
+            __atomic_add_fetch(&n_huge, 1, __ATOMIC_RELAXED);
+        }
+    }
+#endif
+    if(!b && posix_memalign((void **)&b, POOL_ALIGN, total)) return 0;
+    b->cap = cap;
+    b->cls = cls;
+    b->huge = huge;
+    b->magic = POOL_MAGIC;
+    b->next = 0;
+    return b;
+}
+
+static block *take_cached(int cls)
+{
+    if(!pool_enabled) return 0;
+    thread_cache *tc = get_thread_cache();
+    block *b = tc->free[cls];
+    if(b){
+        tc->free[cls] = b->next;
+        tc->count[cls]--;
+        tc->bytes -= b->cap;
+        return b;
+    }
+    pthread_mutex_lock(&pool_lock);
+    b = shared_free[cls];
+    if(b){
+        shared_free[cls] = b->next;
+        shared_bytes -= b->cap;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return b;
+}
+
+void *pool_alloc(size_t size)
+{
+    pthread_once(&pool_once, pool_init);
+    size_t cap;
+    int cls = size_class(size, &cap);
+    assert(cls < NUM_CLASSES);
+    block *b = take_cached(cls);
+    void *p;
+    if(b){
+        __atomic_add_fetch(&n_hits, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&bytes_cached, b->cap, __ATOMIC_RELAXED);
+        p = (char *)b + POOL_ALIGN;
+        memset(p, 0, size);
+    } else {
+        __atomic_add_fetch(&n_misses, 1, __ATOMIC_RELAXED);
+        b = new_block(cap, cls);
+        if(!b) return 0;
+        p = (char *)b + POOL_ALIGN;
+        // Fresh mmap memory is already zero
+        if(!b->huge) memset(p, 0, size);
+    }
+    size_t used = __atomic_add_fetch(&bytes_in_use, b->cap, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&bytes_peak, __ATOMIC_RELAXED);
+    while(used > peak && !__atomic_compare_exchange_n(&bytes_peak, &peak, used, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return p;
+}
+
+void pool_free(void *p)
+{
+    if(!p) return;
+    block *b = (block *)((char *)p - POOL_ALIGN);
+    assert(b->magic == POOL_MAGIC);
+    __atomic_add_fetch(&n_frees, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&bytes_in_use, b->cap, __ATOMIC_RELAXED);
+    if(!pool_enabled){
+        free_block(b);
+        return;
+    }
+    __atomic_add_fetch(&bytes_cached, b->cap, __ATOMIC_RELAXED);
+    thread_cache *tc = get_thread_cache();
+    if(tc->count[b->cls] < THREAD_SLOTS && tc->bytes + b->cap <= THREAD_BYTES){
+        b->next = tc->free[b->cls];
+        tc->free[b->cls] = b;
+        tc->count[b->cls]++;
+        tc->bytes += b->cap;
+        return;
+    }
+    push_shared(b);
+}
+
+void pool_trim()
+{
+    pthread_once(&pool_once, pool_init);
+    int i;
+    thread_cache *tc = get_thread_cache();
+    for(i = 0; i < NUM_CLASSES; ++i){
+        while(tc->free[i]){
+            block *b = tc->free[i];
+            tc->free[i] = b->next;
+            __atomic_sub_fetch(&bytes_cached, b->cap, __ATOMIC_RELAXED);
+            free_block(b);
+        }
+        tc->count[i] = 0;
+    }
+    tc->bytes = 0;
+    pthread_mutex_lock(&pool_lock);
+    for(i = 0; i < NUM_CLASSES; ++i){
+        while(shared_free[i]){
+            block *b = shared_free[i];
+            shared_free[i] = b->next;
+            __atomic_sub_fetch(&bytes_cached, b->cap, __ATOMIC_RELAXED);
+            free_block(b);
+        }
+    }
+    shared_bytes = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+pool_stats get_pool_stats()
+{
+    pool_stats s;
+    s.hits = __atomic_load_n(&n_hits, __ATOMIC_RELAXED);
+    s.misses = __atomic_load_n(&n_misses, __ATOMIC_RELAXED);
+    s.frees = __atomic_load_n(&n_frees, __ATOMIC_RELAXED);
+    s.in_use = __atomic_load_n(&bytes_in_use, __ATOMIC_RELAXED);
+    s.peak = __atomic_load_n(&bytes_peak, __ATOMIC_RELAXED);
+    s.cached = __atomic_load_n(&bytes_cached, __ATOMIC_RELAXED);
+    s.huge = __atomic_load_n(&n_huge, __ATOMIC_RELAXED);
+    return s;
+}
+
+void print_pool_stats(FILE *fp)
+{
+    pool_stats s = get_pool_stats();
+    fprintf(fp, "pool: %zu hits, %zu misses, %zu frees, %.1f MB in use, %.1f MB peak, %.1f MB cached, %zu huge\n",
+            s.hits, s.misses, s.frees, s.in_use/1048576., s.peak/1048576., s.cached/1048576., s.huge);
+}
@@ -0,0 +1,33 @@
+#ifndef POOL_H
+#define POOL_H
+#include <stdio.h>
+#include <stddef.h>
+
+#define POOL_ALIGN 64
+
+// Counters for the buffer pool behind make_image/free_image.
+// hits: allocations served from a cached buffer.
+// misses: allocations that had to go to the system allocator.
+// frees: buffers returned to the pool.
+// in_use, peak: bytes handed out now, and the most ever at once.
+// cached: bytes held in caches, ready for reuse.
+// huge: allocations backed by huge pages.
+typedef struct{
+    size_t hits, misses, frees;
+    size_t in_use, peak, cached;
+    size_t huge;
+} pool_stats;
+
+// Allocate a zeroed, POOL_ALIGN aligned buffer from the pool.
+void *pool_alloc(size_t size);
+
+// Return a buffer from pool_alloc to the pool. NULL is ignored.
+void pool_free(void *p);
+
+// Release every cached buffer back to the system.
+void pool_trim();
+
+pool_stats get_pool_stats();
+void print_pool_stats(FILE *fp);
+
+#endif
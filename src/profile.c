@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "profile.h"
+
+// Finished calls are appended to one shared event list. Counters belong to
+// the innermost timed call on each thread, so a function's bytes and
+// allocations don't include those of the functions it calls.
+
+#define MAX_EVENTS (1 << 22)
+
+typedef struct{
+    const char *name;
+    double ts, dur;
+    size_t bytes_in, bytes_out;
+    size_t allocs, alloc_bytes;
+    int tid;
+} prof_event;
+
+typedef struct{
+    const char *name;
+    int calls;
+    double total;
+    size_t bytes_in, bytes_out;
+    size_t allocs, alloc_bytes;
+} prof_summary;
+
+static pthread_once_t prof_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static int enabled = 0;
+static char *trace_path;
+static double t0;
+static prof_event *events;
+static size_t n_events, cap_events, dropped;
+static int next_tid;
+static __thread int thread_id = -1;
+static __thread prof_scope *current;
+
+static double now_us()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1e6 + t.tv_nsec/1e3;
+}
+
+static int compare_summary(const void *a, const void *b)
+{
+    double ta = ((prof_summary *)a)->total;
+    double tb = ((prof_summary *)b)->total;
+    return (ta < tb) - (ta > tb);
+}
+
+// Sum the events by function and print them, slowest first.
+static void print_summary(FILE *fp)
+{
+    prof_summary *s = calloc(n_events + 1, sizeof(prof_summary));
+    int n = 0, i;
+    size_t e;
+    for(e = 0; e < n_events; ++e){
+        prof_event *ev = events + e;
+        for(i = 0; i < n; ++i) if(s[i].name == ev->name || 0 == strcmp(s[i].name, ev->name)) break;
+        if(i == n) s[n++].name = ev->name;
+        s[i].calls++;
+        s[i].total += ev->dur;
+        s[i].bytes_in += ev->bytes_in;
+        s[i].bytes_out += ev->bytes_out;
+        s[i].allocs += ev->allocs;
+        s[i].alloc_bytes += ev->alloc_bytes;
+    }
+    qsort(s, n, sizeof(prof_summary), compare_summary);
+    fprintf(fp, "%-32s %8s %12s %10s %10s %8s %10s\n", "function", "calls", "total ms", "in MB", "out MB", "allocs", "alloc MB");
+    for(i = 0; i < n; ++i){
+        fprintf(fp, "%-32s %8d %12.3f %10.2f %10.2f %8zu %10.2f\n", s[i].name, s[i].calls, s[i].total/1e3,
+                s[i].bytes_in/1048576., s[i].bytes_out/1048576., s[i].allocs, s[i].alloc_bytes/1048576.);
+    }
+    if(dropped) fprintf(fp, "%zu calls not recorded, trace full\n", dropped);
+    free(s);
+}
+
+static void write_trace()
+{
+    pthread_mutex_lock(&prof_lock);
+    FILE *fp = fopen(trace_path, "w");
+    if(!fp){
+        fprintf(stderr, "Couldn't write profile to %s\n", trace_path);
+    } else {
+        size_t e;
+        fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+        for(e = 0; e < n_events; ++e){
+            prof_event *ev = events + e;
+            fprintf(fp, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+                    "\"args\": {\"bytes_in\": %zu, \"bytes_out\": %zu, \"allocs\": %zu, \"alloc_bytes\": %zu}}%s\n",
+                    ev->name, ev->tid, ev->ts, ev->dur, ev->bytes_in, ev->bytes_out, ev->allocs, ev->alloc_bytes,
+                    e + 1 < n_events ? "," : "");
+        }
+        fprintf(fp, "]}\n");
+        fclose(fp);
+    }
+    print_summary(stderr);
+    pthread_mutex_unlock(&prof_lock);
+}
+
+static void profile_init()
+{
+    char *env = getenv("UWIMG_PROFILE");
+    if(!env || !*env || 0 == strcmp(env, "0")) return;
+    trace_path = strdup(0 == strcmp(env, "1") ? "uwimg_trace.json" : env);
+    t0 = now_us();
+    enabled = 1;
+    atexit(write_trace);
+}
+
+int profile_enabled()
+{
+    pthread_once(&prof_once, profile_init);
+    return enabled;
+}
+
+void prof_begin(prof_scope *s, const char *name)
+{
+    s->name = 0;
+    if(!profile_enabled()) return;
+    s->name = name;
+    s->bytes_in = s->bytes_out = 0;
+    s->allocs = s->alloc_bytes = 0;
+    s->parent = current;
+    current = s;
+    s->start = now_us();
+}
+
+void prof_end(prof_scope *s)
+{
+    if(!s->name) return;
+    double end = now_us();
+    current = s->parent;
+    pthread_mutex_lock(&prof_lock);
+    if(thread_id < 0) thread_id = next_tid++;
+    if(n_events == cap_events && cap_events < MAX_EVENTS){
+        cap_events = cap_events ? 2*cap_events : 1024;
+        events = realloc(events, cap_events*sizeof(prof_event));
+    }
+    if(n_events < cap_events){
+        prof_event *ev = events + n_events++;
+        ev->name = s->name;
+        ev->ts = s->start - t0;
+        ev->dur = end - s->start;
+        ev->bytes_in = s->bytes_in;
+        ev->bytes_out = s->bytes_out;
+        ev->allocs = s->allocs;
+        ev->alloc_bytes = s->alloc_bytes;
+        ev->tid = thread_id;
+    } else {
+        ++dropped;
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+
+void prof_bytes(size_t in, size_t out)
+{
+    if(!current) return;
+    current->bytes_in += in;
+    current->bytes_out += out;
+}
+
+void prof_alloc(size_t bytes)
+{
+    if(!current) return;
+    current->allocs++;
+    current->alloc_bytes += bytes;
+}
@@ -0,0 +1,54 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Built in instrumentation, compiled in with `make PROFILE=1` and switched on
+// at runtime with the environment variable UWIMG_PROFILE. Set it to a file
+// name, or to 1 for uwimg_trace.json. At exit the trace is written in Chrome
+// trace format (load it in chrome://tracing or Perfetto) and a per function
+// summary is printed to stderr. Without PROFILE the macros below compile to
+// nothing.
+//
+// PROFILE_FUNC() times the enclosing function until it returns.
+// PROFILE_BYTES(in, out) adds bytes read and written to the innermost timed
+// function on this thread. Allocations made by make_image and make_matrix are
+// counted the same way.
+
+// One timed call, lives on the stack of the function being timed.
+typedef struct prof_scope{
+    const char *name;
+    double start;
+    size_t bytes_in, bytes_out;
+    size_t allocs, alloc_bytes;
+    struct prof_scope *parent;
+} prof_scope;
+
+int profile_enabled();
+void prof_begin(prof_scope *s, const char *name);
+void prof_end(prof_scope *s);
+void prof_bytes(size_t in, size_t out);
+void prof_alloc(size_t bytes);
+
+#ifdef PROFILE
+#define PROFILE_FUNC() \
+    prof_scope prof_scope_ __attribute__((cleanup(prof_end))); \
+    prof_begin(&prof_scope_, __func__)
+#define PROFILE_BYTES(in, out) prof_bytes((in), (out))
+#define PROFILE_ALLOC(bytes) prof_alloc(bytes)
+#else
+#define PROFILE_FUNC() do{}while(0)
+#define PROFILE_BYTES(in, out) do{}while(0)
+#define PROFILE_ALLOC(bytes) do{}while(0)
+#endif
+
+// Bytes of pixel data in an image or view.
+#define IMAGE_BYTES(im) ((size_t)(im).w*(im).h*(im).c*sizeof(float))
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,302 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "image.h"
+#include "parallel.h"
+#include "profile.h"
+
+// Pyramids are cached by the data pointer and size of their image, so
+// every caller asking for the same image shares its levels. Entries also
+// keep a checksum of the pixels they were built from: an image changed in
+// place since gets a new pyramid instead of stale levels. free_image drops
+// the entry before the memory can be handed out again.
+//
+// pyramid_lock guards the list, each entry's own lock its levels, so
+// building one image's levels doesn't hold up other images.
+
+typedef struct pyramid_entry{
+    pyramid p;
+    float *data;
+    int w, h, c;
+    uint64_t sum;
+    pthread_mutex_t lock;
+    struct pyramid_entry *next;
+} pyramid_entry;
+
+static pthread_mutex_t pyramid_lock = PTHREAD_MUTEX_INITIALIZER;
+static pyramid_entry *pyramids;
+static int n_pyramids;
+
+// 5 tap binomial, the classic Burt and Adelson kernel.
+static const float binomial[5] = {1/16.f, 4/16.f, 6/16.f, 4/16.f, 1/16.f};
+
+typedef struct{
+    image im, out;
+} pyramid_job;
+
+static void reduce_rows(void *ctx, int start, int end)
+{
+    pyramid_job *j = ctx;
+    image im = j->im, out = j->out;
+    float *tmp = malloc(im.w*sizeof(float));
+    int x, y, k, c;
+    for(c = 0; c < im.c; ++c){
+        float *src = im.data + c*im.w*im.h;
+        for(y = start; y < end; ++y){
+            // Blur the 5 source rows down to one, then blur and keep every
+            // other column
+            for(x = 0; x < im.w; ++x) tmp[x] = 0;
+            for(k = 0; k < 5; ++k){
+                float *r = src + MIN(MAX(2*y - 2 + k, 0), im.h - 1)*im.w;
+                for(x = 0; x < im.w; ++x) tmp[x] += binomial[k]*r[x];
+            }
+            float *d = out.data + (c*out.h + y)*out.w;
+            int x1 = MAX((im.w - 3)/2, 1);
+            for(x = 0; x < out.w; ++x){
+                if(x == 1) x = MAX(x1, 1);
+                if(x >= out.w) break;
+                float sum = 0;
+                for(k = 0; k < 5; ++k) sum += binomial[k]*tmp[MIN(MAX(2*x - 2 + k, 0), im.w - 1)];
+                d[x] = sum;
+            }
+            for(x = 1; x < x1; ++x){
+                const float *t = tmp + 2*x - 2;
+                d[x] = binomial[0]*(t[0] + t[4]) + binomial[1]*(t[1] + t[3]) + binomial[2]*t[2];
+            }
+        }
+    }
+    free(tmp);
+}
+
+// Blur an image with a 5x5 binomial and drop every other row and column.
+// image im: image to reduce.
+// returns: (im.w + 1)/2 x (im.h + 1)/2 image.
+image reduce_image(image im)
+{
+    PROFILE_FUNC();
+    image out = make_image((im.w + 1)/2, (im.h + 1)/2, im.c);
+    PROFILE_BYTES(IMAGE_BYTES(im), IMAGE_BYTES(out));
+    pyramid_job j = {im, out};
+    parallel_for(out.h, 8, reduce_rows, &j);
+    return out;
+}
+
+// Value of an upsampled line at position i of 2n. Zeros are put between
+// samples and the result is blurred with twice the binomial, which leaves
+// weights of 1 6 1 / 8 on even positions and 1 1 / 2 on odd ones.
+static float expand_at(const float *s, int stride, int n, int i)
+{
+    int k = i/2;
+    int lo = MAX(k - 1, 0), hi = MIN(k + 1, n - 1);
+    if(i & 1) return .5f*(s[k*stride] + s[hi*stride]);
+    return .125f*(s[lo*stride] + 6*s[k*stride] + s[hi*stride]);
+}
+
+static void expand_rows(void *ctx, int start, int end)
+{
+    pyramid_job *j = ctx;
+    image im = j->im, out = j->out;
+    float *tmp = malloc(im.w*sizeof(float));
+    int x, y, c;
+    for(c = 0; c < im.c; ++c){
+        float *src = im.data + c*im.w*im.h;
+        for(y = start; y < end; ++y){
+            for(x = 0; x < im.w; ++x) tmp[x] = expand_at(src + x, im.w, im.h, y);
+            float *d = out.data + (c*out.h + y)*out.w;
+            // Interior pairs of outputs without clamping
+            int x1 = MIN(im.w - 1, out.w/2);
+            d[0] = expand_at(tmp, 1, im.w, 0);
+            for(x = 1; x < x1; ++x){
+                d[2*x - 1] = .5f*(tmp[x - 1] + tmp[x]);
+                d[2*x] = .125f*(tmp[x - 1] + 6*tmp[x] + tmp[x + 1]);
+            }
+            for(x = MAX(2*x1 - 1, 1); x < out.w; ++x) d[x] = expand_at(tmp, 1, im.w, x);
+        }
+    }
+    free(tmp);
+}
+
+// Upsample an image 2x with the binomial, the inverse of reduce_image.
+// image im: image to expand.
+// int w, h: size of the result, at most 2*im.w x 2*im.h.
+// returns: w x h image.
+image expand_image(image im, int w, int h)
+{
+    PROFILE_FUNC();
+    assert(w <= 2*im.w && h <= 2*im.h);
+    image out = make_image(w, h, im.c);
+    PROFILE_BYTES(IMAGE_BYTES(im), IMAGE_BYTES(out));
+    pyramid_job j = {im, out};
+    parallel_for(h, 8, expand_rows, &j);
+    return out;
+}
+
+// Gaussian level, building the ones below it. Call with the entry's lock held.
+static image gauss_level(pyramid *p, int level)
+{
+    if(!p->gauss[level].data) p->gauss[level] = reduce_image(gauss_level(p, level - 1));
+    return p->gauss[level];
+}
+
+// 64 bit FNV-1a over the bits of the pixels, four lanes at a time so the
+// multiplies overlap.
+static uint64_t image_checksum(image im)
+{
+    const uint32_t *d = (const uint32_t *)im.data;
+    size_t n = (size_t)im.w*im.h*im.c, i;
+    uint64_t h[4] = {0xcbf29ce484222325ULL, 1, 2, 3};
+    int l;
+    for(i = 0; i + 4 <= n; i += 4){
+        for(l = 0; l < 4; ++l) h[l] = (h[l] ^ d[i + l])*0x100000001b3ULL;
+    }
+    for(; i < n; ++i) h[0] = (h[0] ^ d[i])*0x100000001b3ULL;
+    for(l = 1; l < 4; ++l) h[0] = (h[0] ^ h[l])*0x100000001b3ULL;
+    return h[0];
+}
+
+static void free_entries(pyramid_entry *e)
+{
+    while(e){
+        pyramid_entry *next = e->next;
+        int i;
+        for(i = 0; i < e->p.n; ++i){
+            if(i > 0 && e->p.gauss[i].data) free_image(e->p.gauss[i]);
+            if(e->p.lap[i].data) free_image(e->p.lap[i]);
+        }
+        free(e->p.gauss);
+        free(e->p.lap);
+        pthread_mutex_destroy(&e->lock);
+        free(e);
+        e = next;
+    }
+}
+
+// Get the shared pyramid of an image, making an empty one if there is none
+// or the image's pixels changed since its pyramid was made. Levels are only
+// built when asked for and live until the image is freed. Every call reads
+// the whole image once to check it. A pyramid got before the image changed
+// is stale, ask again rather than keeping it.
+// image im: level 0 of the pyramid.
+// returns: pyramid owned by the cache, don't free it.
+pyramid *image_pyramid(image im)
+{
+    PROFILE_FUNC();
+    uint64_t sum = image_checksum(im);
+    pyramid_entry **pe, *e = 0, *stale = 0;
+    pthread_mutex_lock(&pyramid_lock);
+    for(pe = &pyramids; *pe; pe = &(*pe)->next){
+        e = *pe;
+        if(e->data == im.data && e->w == im.w && e->h == im.h && e->c == im.c) break;
+    }
+    if(*pe && e->sum != sum){
+        // Changed in place, levels built from the old pixels go
+        *pe = e->next;
+        e->next = 0;
+        stale = e;
+        __atomic_store_n(&n_pyramids, n_pyramids - 1, __ATOMIC_RELEASE);
+    }
+    if(!*pe || stale){
+        e = calloc(1, sizeof(pyramid_entry));
+        e->data = im.data;
+        e->w = im.w;
+        e->h = im.h;
+        e->c = im.c;
+        e->sum = sum;
+        pthread_mutex_init(&e->lock, 0);
+        int w = im.w, h = im.h;
+        // Halve until the short side is 1 pixel
+        for(e->p.n = 1; MIN(w, h) > 1; ++e->p.n){
+            w = (w + 1)/2;
+            h = (h + 1)/2;
+        }
+        e->p.gauss = calloc(e->p.n, sizeof(image));
+        e->p.lap = calloc(e->p.n, sizeof(image));
+        e->p.gauss[0] = im;
+        e->next = pyramids;
+        pyramids = e;
+        __atomic_store_n(&n_pyramids, n_pyramids + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&pyramid_lock);
+    // Levels are freed outside the lock, they may have pyramids of their own
+    free_entries(stale);
+    return &e->p;
+}
+
+// Get a level of the Gaussian pyramid, level 0 being the image.
+// returns: image owned by the pyramid, don't free it.
+image pyramid_level(pyramid *p, int level)
+{
+    PROFILE_FUNC();
+    assert(0 <= level && level < p->n);
+    pyramid_entry *e = (pyramid_entry *)p;
+    pthread_mutex_lock(&e->lock);
+    image im = gauss_level(p, level);
+    pthread_mutex_unlock(&e->lock);
+    return im;
+}
+
+// Get a level of the Laplacian pyramid: the Gaussian level minus the next
+// one expanded back to its size. The top level is the top Gaussian level.
+// returns: image owned by the pyramid, don't free it.
+image laplacian_level(pyramid *p, int level)
+{
+    PROFILE_FUNC();
+    assert(0 <= level && level < p->n);
+    pyramid_entry *e = (pyramid_entry *)p;
+    pthread_mutex_lock(&e->lock);
+    if(!p->lap[level].data){
+        image g = gauss_level(p, level);
+        if(level == p->n - 1){
+            p->lap[level] = copy_image(g);
+        } else {
+            image up = expand_image(gauss_level(p, level + 1), g.w, g.h);
+            sub_image_into(g, up, up);
+            p->lap[level] = up;
+        }
+    }
+    image im = p->lap[level];
+    pthread_mutex_unlock(&e->lock);
+    return im;
+}
+
+// Rebuild level 0 from the Laplacian levels, expanding from the top down.
+// returns: new image, the pyramid's image up to rounding.
+image collapse_pyramid(pyramid *p)
+{
+    PROFILE_FUNC();
+    image im = copy_image(laplacian_level(p, p->n - 1));
+    int level;
+    for(level = p->n - 2; level >= 0; --level){
+        image lap = laplacian_level(p, level);
+        image up = expand_image(im, lap.w, lap.h);
+        add_image_into(up, lap, up);
+        free_image(im);
+        im = up;
+    }
+    return im;
+}
+
+// Forget the cached pyramid of an image, freeing its levels now rather
+// than when the image is next asked for or freed. free_image calls this so
+// a freed buffer never brings back old levels.
+void drop_pyramid(image im)
+{
+    if(!__atomic_load_n(&n_pyramids, __ATOMIC_ACQUIRE)) return;
+    pyramid_entry **e = &pyramids, *found = 0;
+    pthread_mutex_lock(&pyramid_lock);
+    while(*e){
+        if((*e)->data == im.data){
+            pyramid_entry *d = *e;
+            *e = d->next;
+            d->next = found;
+            found = d;
+            __atomic_store_n(&n_pyramids, n_pyramids - 1, __ATOMIC_RELEASE);
+        } else {
+            e = &(*e)->next;
+        }
+    }
+    pthread_mutex_unlock(&pyramid_lock);
+    free_entries(found);
+}
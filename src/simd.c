@@ -0,0 +1,28 @@
+#include <stdlib.h>
+#include <string.h>
+#include "simd.h"
+
+static SIMD_LEVEL detect_simd_level()
+{
+    SIMD_LEVEL level = SIMD_NONE;
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.1")) level = SIMD_SSE4;
+    if(level == SIMD_SSE4 && __builtin_cpu_supports("avx2")) level = SIMD_AVX2;
+#endif
+    char *cap = getenv("UWIMG_SIMD");
+    if(cap){
+        SIMD_LEVEL max = SIMD_AVX2;
+        if(0 == strcmp(cap, "none")) max = SIMD_NONE;
+        else if(0 == strcmp(cap, "sse4")) max = SIMD_SSE4;
+        if(level > max) level = max;
+    }
+    return level;
+}
+
+SIMD_LEVEL simd_level()
+{
+    static int level = -1;
+    if(level < 0) level = detect_simd_level();
+    return (SIMD_LEVEL) level;
+}
@@ -0,0 +1,15 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#endif
+
+// Instruction set levels kernels can be dispatched on at runtime.
+typedef enum{SIMD_NONE, SIMD_SSE4, SIMD_AVX2} SIMD_LEVEL;
+
+// Highest level supported by this cpu. Setting the environment variable
+// UWIMG_SIMD to none, sse4 or avx2 caps it, e.g. to test the fallbacks.
+SIMD_LEVEL simd_level();
+
+#endif
@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#include "parallel.h"
+#include "profile.h"
+
+// Reductions split each channel into tiles of STATS_ROWS rows. Tiles are
+// reduced in parallel into partial results that are then merged pairwise
+// in a fixed order, so results don't depend on the number of threads.
+// Within a row, REDUCE_LANES independent accumulators keep the loops free
+// of serial dependencies so they vectorize.
+
+#define STATS_ROWS 16
+#define REDUCE_LANES 8
+
+typedef struct{
+    double n, mean, m2, sum;
+    float min, max;
+} partial;
+
+typedef struct{
+    image_view im;
+    int tiles;
+    partial *parts;
+    int bins;
+    float lo, scale;
+    size_t *counts;
+} stats_job;
+
+// Merge b into a, Chan et al.'s update for the mean and squared deviations.
+static void merge_partial(partial *a, const partial *b)
+{
+    if(b->n == 0) return;
+    if(a->n == 0){
+        *a = *b;
+        return;
+    }
+    double n = a->n + b->n;
+    double d = b->mean - a->mean;
+    a->mean += d*b->n/n;
+    a->m2 += b->m2 + d*d*a->n*b->n/n;
+    a->sum += b->sum;
+    a->n = n;
+    a->min = MIN(a->min, b->min);
+    a->max = MAX(a->max, b->max);
+}
+
+// Reduce one row. The deviations are summed in a second pass over the row
+// while it's still in cache, which avoids the cancellation of sum of squares.
+static partial row_partial(const float *r, int xs, int n)
+{
+    partial p = {n};
+    float s[REDUCE_LANES] = {0}, lo[REDUCE_LANES], hi[REDUCE_LANES];
+    int x, l;
+    for(l = 0; l < REDUCE_LANES; ++l) lo[l] = hi[l] = r[0];
+    if(xs == 1){
+        for(x = 0; x + REDUCE_LANES <= n; x += REDUCE_LANES){
+            for(l = 0; l < REDUCE_LANES; ++l){
+                float v = r[x + l];
+                s[l] += v;
+                lo[l] = MIN(lo[l], v);
+                hi[l] = MAX(hi[l], v);
+            }
+        }
+    } else {
+        x = 0;
+    }
+    for(; x < n; ++x){
+        float v = r[x*xs];
+        s[0] += v;
+        lo[0] = MIN(lo[0], v);
+        hi[0] = MAX(hi[0], v);
+    }
+    p.min = lo[0];
+    p.max = hi[0];
+    for(l = 0; l < REDUCE_LANES; ++l){
+        p.sum += s[l];
+        p.min = MIN(p.min, lo[l]);
+        p.max = MAX(p.max, hi[l]);
+    }
+    p.mean = p.sum/n;
+
+    float mean = p.mean, d[REDUCE_LANES] = {0};
+    if(xs == 1){
+        for(x = 0; x + REDUCE_LANES <= n; x += REDUCE_LANES){
+            for(l = 0; l < REDUCE_LANES; ++l) d[l] += (r[x + l] - mean)*(r[x + l] - mean);
+        }
+    } else {
+        x = 0;
+    }
+    for(; x < n; ++x) d[0] += (r[x*xs] - mean)*(r[x*xs] - mean);
+    for(l = 0; l < REDUCE_LANES; ++l) p.m2 += d[l];
+    return p;
+}
+
+static void stats_tiles(void *ctx, int start, int end)
+{
+    stats_job *j = ctx;
+    image_view im = j->im;
+    int t, y;
+    for(t = start; t < end; ++t){
+        int c = t/j->tiles;
+        int y0 = t%j->tiles*STATS_ROWS, y1 = MIN(y0 + STATS_ROWS, im.h);
+        partial p = {0};
+        for(y = y0; y < y1; ++y){
+            partial r = row_partial(view_ptr(im, 0, y, c), im.xs, im.w);
+            merge_partial(&p, &r);
+        }
+        j->parts[t] = p;
+    }
+}
+
+// Merge n partials pairwise in place, a tree of depth log2(n).
+static partial merge_tree(partial *p, int n)
+{
+    int step, i;
+    if(n == 0){
+        partial z = {0};
+        return z;
+    }
+    for(step = 1; step < n; step *= 2){
+        for(i = 0; i + step < n; i += 2*step) merge_partial(p + i, p + i + step);
+    }
+    return p[0];
+}
+
+static pixel_stats to_stats(partial p)
+{
+    pixel_stats s;
+    s.n = (size_t)p.n;
+    s.min = p.min;
+    s.max = p.max;
+    s.sum = p.sum;
+    s.mean = p.mean;
+    s.var = p.n > 0 ? p.m2/p.n : 0;
+    return s;
+}
+
+// Reduce every tile of every channel of a view.
+// returns: im.c*tiles partials, channel after channel; free them.
+static partial *reduce_tiles(image_view im, int *tiles)
+{
+    *tiles = (im.h + STATS_ROWS - 1)/STATS_ROWS;
+    stats_job j = {im, *tiles};
+    j.parts = calloc((size_t)im.c**tiles, sizeof(partial));
+    parallel_for(im.c**tiles, 1, stats_tiles, &j);
+    return j.parts;
+}
+
+// Compute statistics of each channel of a view in one pass.
+// image_view im: view to reduce.
+// pixel_stats *out: gets im.c entries, one per channel.
+void channel_stats(image_view im, pixel_stats *out)
+{
+    PROFILE_FUNC();
+    PROFILE_BYTES((size_t)im.w*im.h*im.c*sizeof(float), 0);
+    int tiles, c;
+    partial *p = reduce_tiles(im, &tiles);
+    for(c = 0; c < im.c; ++c) out[c] = to_stats(merge_tree(p + c*tiles, tiles));
+    free(p);
+}
+
+// Compute statistics over every pixel of every channel of a view.
+pixel_stats view_stats(image_view im)
+{
+    PROFILE_FUNC();
+    PROFILE_BYTES((size_t)im.w*im.h*im.c*sizeof(float), 0);
+    int tiles;
+    partial *p = reduce_tiles(im, &tiles);
+    pixel_stats s = to_stats(merge_tree(p, im.c*tiles));
+    free(p);
+    return s;
+}
+
+static void histogram_tiles(void *ctx, int start, int end)
+{
+    stats_job *j = ctx;
+    image_view im = j->im;
+    int t, x, y;
+    for(t = start; t < end; ++t){
+        int c = t/j->tiles;
+        int y0 = t%j->tiles*STATS_ROWS, y1 = MIN(y0 + STATS_ROWS, im.h);
+        size_t *counts = j->counts + (size_t)t*j->bins;
+        for(y = y0; y < y1; ++y){
+            const float *r = view_ptr(im, 0, y, c);
+            for(x = 0; x < im.w; ++x){
+                int b = (int)floorf((r[x*im.xs] - j->lo)*j->scale);
+                counts[MIN(MAX(b, 0), j->bins - 1)]++;
+            }
+        }
+    }
+}
+
+// Count the pixels of a view falling in each of bins equal bins over
+// [lo, hi). Values outside the range land in the first or last bin.
+// image_view im: view to count, all of its channels.
+// int bins: number of bins.
+// float lo, hi: range the bins cover.
+// size_t *counts: gets bins counts.
+void view_histogram(image_view im, int bins, float lo, float hi, size_t *counts)
+{
+    PROFILE_FUNC();
+    assert(bins > 0 && hi > lo);
+    int tiles = (im.h + STATS_ROWS - 1)/STATS_ROWS;
+    int n = im.c*tiles;
+    stats_job j = {im, tiles, 0, bins, lo, bins/(hi - lo)};
+    j.counts = calloc((size_t)n*bins, sizeof(size_t));
+    parallel_for(n, 1, histogram_tiles, &j);
+    int t, b;
+    memset(counts, 0, bins*sizeof(size_t));
+    for(t = 0; t < n; ++t){
+        for(b = 0; b < bins; ++b) counts[b] += j.counts[(size_t)t*bins + b];
+    }
+    free(j.counts);
+}
@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#include "parallel.h"
+#include "profile.h"
+
+// Images that don't fit in memory are filtered a row at a time. Input rows
+// go into a ring that holds just the rows a batch of output rows reads, so
+// memory depends on the width and the filter, never on the height. A row
+// of an image with c channels is c runs of w floats, one per channel, the
+// same order as a row of each plane of an image.
+//
+// Separable filters run their row pass as rows come in, so the ring holds
+// row filtered data and each output row is a single column pass.
+
+#define STREAM_BATCH 16
+
+typedef struct{
+    int w, h, c;
+    image filter;
+    int preserve;
+    image row, col;
+    int separable;
+    float *ring;
+    int slots;
+    float *out;
+    int first;
+} stream_job;
+
+static float *ring_row(stream_job *j, int y)
+{
+    y = MAX(0, MIN(j->h - 1, y));
+    return j->ring + (size_t)(y % j->slots) * j->w * j->c;
+}
+
+// Filter a row with a 1d filter, clamping at the ends.
+static void filter_row(const float *src, float *dst, int w, const float *f, int n)
+{
+    int r = n / 2;
+    int x0 = MIN(r, w), x1 = MAX(w - (n - 1 - r), x0);
+    int x, k;
+    for (x = 0; x < w; x++) {
+        if (x == x0) x = x1;
+        if (x >= w) break;
+        float q = 0;
+        for (k = 0; k < n; k++) q += f[k] * src[MAX(0, MIN(w - 1, x - r + k))];
+        dst[x] = q;
+    }
+    for (x = x0; x < x1; x++) dst[x] = 0;
+    for (k = 0; k < n; k++) {
+        const float *s = src - r + k;
+        for (x = x0; x < x1; x++) dst[x] += f[k] * s[x];
+    }
+}
+
+// Compute output rows first + [start, end) of the current batch from the
+// ring.
+static void stream_rows(void *ctx, int start, int end)
+{
+    stream_job *j = ctx;
+    int w = j->w;
+    int fw = j->filter.w, fh = j->filter.h;
+    int ry = fh / 2;
+    int oc = j->preserve ? j->c : 1;
+    float *acc = malloc(w * sizeof(float));
+    float *tmp = malloc(w * sizeof(float));
+    const float **rows = malloc(fh * sizeof(float *));
+
+    for (int i = start; i < end; i++) {
+        int y = j->first + i;
+        float *out = j->out + (size_t)i * w * oc;
+        for (int fy = 0; fy < fh; fy++) rows[fy] = ring_row(j, y - ry + fy);
+        for (int c = 0; c < j->c; c++) {
+            int fc = j->filter.c == 1 ? 0 : c;
+            for (int x = 0; x < w; x++) acc[x] = 0;
+            if (j->separable) {
+                const float *f = j->col.data + fc * fh;
+                for (int fy = 0; fy < fh; fy++) {
+                    const float *s = rows[fy] + c * w;
+                    for (int x = 0; x < w; x++) acc[x] += f[fy] * s[x];
+                }
+            } else {
+                const float *f = j->filter.data + fc * fw * fh;
+                for (int fy = 0; fy < fh; fy++) {
+                    const float *s = rows[fy] + c * w;
+                    filter_row(s, tmp, w, f + fy * fw, fw);
+                    for (int x = 0; x < w; x++) acc[x] += tmp[x];
+                }
+            }
+            float *d = out + (j->preserve ? c * w : 0);
+            int accumulate = !j->preserve && c > 0;
+            for (int x = 0; x < w; x++) d[x] = accumulate ? d[x] + acc[x] : acc[x];
+        }
+    }
+    free(acc);
+    free(tmp);
+    free(rows);
+}
+
+// Convolve an image that is read and written a row at a time, with the
+// same results as convolve_image. Only a few rows more than the filter is
+// tall are held at once.
+// int w, h, c: size of the input.
+// image filter: filter with 1 channel or c channels.
+// int preserve: 1 keeps channels separate, 0 sums them into one channel.
+// row_source src, void *src_ctx: called for each input row in order.
+// row_sink sink, void *sink_ctx: called with each output row in order, c
+//                                channels if preserve, else 1.
+// returns: 1 on success, 0 if the source failed.
+int convolve_stream(int w, int h, int c, image filter, int preserve,
+                    row_source src, void *src_ctx, row_sink sink, void *sink_ctx)
+{
+    PROFILE_FUNC();
+    assert(c == filter.c || filter.c == 1);
+    assert(preserve == 0 || preserve == 1);
+    stream_job j = {w, h, c, filter, preserve};
+    int ry = filter.h / 2;
+    int oc = preserve ? c : 1;
+    size_t row_size = (size_t)w * c;
+    int ok = 1;
+
+    j.separable = filter.w > 1 && filter.h > 1 && separate_filter(filter, &j.row, &j.col);
+    j.slots = filter.h + STREAM_BATCH - 1;
+    j.ring = malloc(j.slots * row_size * sizeof(float));
+    j.out = malloc(STREAM_BATCH * (size_t)w * oc * sizeof(float));
+    float *in = j.separable ? malloc(row_size * sizeof(float)) : 0;
+    int read = 0;
+
+    for (j.first = 0; j.first < h && ok; j.first += STREAM_BATCH) {
+        int n = MIN(STREAM_BATCH, h - j.first);
+        // Pull in every row the batch reads below its first row
+        int need = MIN(j.first + n - 1 + (filter.h - 1 - ry), h - 1);
+        for (; read <= need; read++) {
+            float *slot = j.ring + (size_t)(read % j.slots) * row_size;
+            if (!src(src_ctx, j.separable ? in : slot)) {
+                ok = 0;
+                break;
+            }
+            if (j.separable) {
+                for (int k = 0; k < c; k++) {
+                    int fc = filter.c == 1 ? 0 : k;
+                    filter_row(in + k * w, slot + k * w, w, j.row.data + fc * filter.w, filter.w);
+                }
+            }
+        }
+        if (!ok) break;
+        parallel_for(n, 1, stream_rows, &j);
+        for (int i = 0; i < n; i++) sink(sink_ctx, j.out + (size_t)i * w * oc);
+    }
+
+    if (j.separable) {
+        free_image(j.row);
+        free_image(j.col);
+    }
+    free(j.ring);
+    free(j.out);
+    free(in);
+    return ok;
+}
+
+// Read an integer from a PNM header, skipping whitespace and comments.
+static int read_header_int(FILE *fp)
+{
+    int ch, v;
+    while ((ch = fgetc(fp)) != EOF) {
+        if (ch == '#') {
+            while ((ch = fgetc(fp)) != EOF && ch != '\n');
+        } else if (ch != ' ' && ch != '\t' && ch != '\r' && ch != '\n') {
+            ungetc(ch, fp);
+            break;
+        }
+    }
+    if (fscanf(fp, "%d", &v) != 1) return -1;
+    return v;
+}
+
+// Open a binary PGM (P5) or PPM (P6) file for reading row by row.
+// const char *fname: file to read.
+// returns: stream with fp set to 0 if the file couldn't be read.
+pnm_stream open_pnm(const char *fname)
+{
+    PROFILE_FUNC();
+    pnm_stream s = {0};
+    char magic[3] = {0};
+    s.fp = fopen(fname, "rb");
+    if (!s.fp || fread(magic, 1, 2, s.fp) != 2 || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6')) {
+        fprintf(stderr, "Cannot read PGM/PPM image \"%s\"\n", fname);
+        if (s.fp) fclose(s.fp);
+        s.fp = 0;
+        return s;
+    }
+    s.c = magic[1] == '5' ? 1 : 3;
+    s.w = read_header_int(s.fp);
+    s.h = read_header_int(s.fp);
+    s.maxval = read_header_int(s.fp);
+    // One whitespace character separates the header from the pixels
+    if (s.w <= 0 || s.h <= 0 || s.maxval <= 0 || s.maxval > 65535 || fgetc(s.fp) == EOF) {
+        fprintf(stderr, "Bad header in \"%s\"\n", fname);
+        fclose(s.fp);
+        s.fp = 0;
+        return s;
+    }
+    s.buf = malloc((size_t)s.w * s.c * (s.maxval > 255 ? 2 : 1));
+    return s;
+}
+
+// Create a binary PGM or PPM file to write row by row, 8 bits a sample.
+// const char *fname: file to write.
+// int w, h, c: size of the image, c is 1 for PGM or 3 for PPM.
+// returns: stream with fp set to 0 if the file couldn't be created.
+pnm_stream create_pnm(const char *fname, int w, int h, int c)
+{
+    PROFILE_FUNC();
+    assert(c == 1 || c == 3);
+    pnm_stream s = {0};
+    s.fp = fopen(fname, "wb");
+    if (!s.fp) {
+        fprintf(stderr, "Failed to write image %s\n", fname);
+        return s;
+    }
+    s.w = w;
+    s.h = h;
+    s.c = c;
+    s.maxval = 255;
+    fprintf(s.fp, "P%d\n%d %d\n255\n", c == 1 ? 5 : 6, w, h);
+    s.buf = malloc((size_t)w * c);
+    return s;
+}
+
+// Read the next row of a stream from open_pnm, a row_source.
+// void *stream: the pnm_stream.
+// float *row: gets s.c runs of s.w values in [0, 1].
+// returns: 1 on success, 0 at the end of the file.
+int read_pnm_row(void *stream, float *row)
+{
+    pnm_stream *s = stream;
+    int n = s->w * s->c;
+    int wide = s->maxval > 255;
+    if (fread(s->buf, wide ? 2 : 1, n, s->fp) != (size_t)n) return 0;
+    float scale = 1.f / s->maxval;
+    for (int i = 0; i < n; i++) {
+        int v = wide ? (s->buf[2 * i] << 8) | s->buf[2 * i + 1] : s->buf[i];
+        row[(i % s->c) * s->w + i / s->c] = v * scale;
+    }
+    return 1;
+}
+
+// Write the next row of a stream from create_pnm, a row_sink. Values are
+// clamped to [0, 1].
+// void *stream: the pnm_stream.
+// const float *row: s.c runs of s.w values.
+void write_pnm_row(void *stream, const float *row)
+{
+    pnm_stream *s = stream;
+    int n = s->w * s->c;
+    for (int i = 0; i < n; i++) {
+        float v = row[(i % s->c) * s->w + i / s->c];
+        s->buf[i] = (unsigned char)(255 * MAX(0, MIN(1, v)) + .5f);
+    }
+    fwrite(s->buf, 1, n, s->fp);
+}
+
+void close_pnm(pnm_stream s)
+{
+    PROFILE_FUNC();
+    if (s.fp) fclose(s.fp);
+    free(s.buf);
+}
@@ -6,6 +6,8 @@
 #include "image.h"
 #include "test.h"
 #include "args.h"
+#include "pool.h"
+#include "parallel.h"
 
 
 float avg_diff(image a, image b)
@@ -196,6 +198,204 @@ void test_hsv_to_rgb()
     free_image(c);
 }
 
+void test_view()
+{
+    image im = load_image("data/dog.jpg");
+    image_view crop = crop_view(view_image(im), 10, 20, 30, 40);
+    // Views read through to the parent image
+    TEST(within_eps(get_view_pixel(crop, 0, 0, 0), get_pixel(im, 10, 20, 0), EPS));
+    TEST(within_eps(get_view_pixel(crop, 5, 7, 2), get_pixel(im, 15, 27, 2), EPS));
+    // Clamping happens at the view's edges, not the parent's
+    TEST(within_eps(get_view_pixel(crop, -3, 50, 1), get_pixel(im, 10, 59, 1), EPS));
+
+    image c = view_to_image(crop);
+    image_view g = channel_view(crop, 2);
+    TEST(c.w == 30 && c.h == 40 && c.c == 3 && g.c == 1);
+    TEST(within_eps(get_pixel(c, 29, 39, 2), get_view_pixel(g, 29, 39, 0), EPS));
+
+    // Writes through a view land in the parent image
+    set_view_pixel(crop, 1, 1, 0, .25);
+    TEST(within_eps(get_pixel(im, 11, 21, 0), .25, EPS));
+    free_image(im);
+    free_image(c);
+}
+
+void test_layout()
+{
+    image im = load_image("data/dog.jpg");
+    image hwc = load_image_hwc("data/dog.jpg");
+    image_view v = layout_view(hwc, LAYOUT_HWC);
+    TEST(view_layout(v) == LAYOUT_HWC && view_layout(view_image(im)) == LAYOUT_CHW);
+    TEST(within_eps(get_view_pixel(v, 13, 17, 1), get_pixel(im, 13, 17, 1), EPS));
+
+    image chw = convert_layout(hwc, LAYOUT_HWC, LAYOUT_CHW);
+    TEST(same_image(chw, im, EPS));
+    image back = convert_layout(chw, LAYOUT_CHW, LAYOUT_HWC);
+    TEST(same_image(back, hwc, EPS));
+
+    // Color conversion in interleaved layout matches planar
+    rgb_to_hsv(im);
+    rgb_to_hsv_view(v);
+    image hsv = convert_layout(hwc, LAYOUT_HWC, LAYOUT_CHW);
+    TEST(same_image(hsv, im, EPS));
+
+    // Resizing straight between interleaved buffers
+    image small = make_image(im.w/3, im.h/3, im.c);
+    bilinear_resize_view(v, layout_view(small, LAYOUT_HWC));
+    image small_chw = convert_layout(small, LAYOUT_HWC, LAYOUT_CHW);
+    image gt = bilinear_resize(im, im.w/3, im.h/3);
+    TEST(same_image(small_chw, gt, EPS));
+
+    free_image(im);
+    free_image(hwc);
+    free_image(chw);
+    free_image(back);
+    free_image(hsv);
+    free_image(small);
+    free_image(small_chw);
+    free_image(gt);
+}
+
+void test_padded_image()
+{
+    image im = load_image("data/dogsmall.jpg");
+    int pad = 4;
+    image rep = make_padded_image(view_image(im), pad, BORDER_REPLICATE);
+    image zero = make_padded_image(view_image(im), pad, BORDER_ZERO);
+    image ref = make_padded_image(view_image(im), pad, BORDER_REFLECT);
+    image_view r = padded_interior(rep, pad);
+    image_view z = padded_interior(zero, pad);
+    image_view f = padded_interior(ref, pad);
+    TEST(rep.w == im.w + 2*pad && rep.h == im.h + 2*pad && r.w == im.w && r.h == im.h);
+
+    // Replicated borders read the same as get_pixel's clamping
+    TEST(within_eps(view_at(r, -4, -4, 0), get_pixel(im, 0, 0, 0), EPS));
+    TEST(within_eps(view_at(r, im.w + 3, 7, 1), get_pixel(im, im.w - 1, 7, 1), EPS));
+    TEST(within_eps(view_at(r, 5, im.h + 2, 2), get_pixel(im, 5, im.h - 1, 2), EPS));
+    TEST(within_eps(view_at(r, 9, 11, 2), get_pixel(im, 9, 11, 2), EPS));
+
+    TEST(within_eps(view_at(z, -1, 3, 0), 0, EPS));
+    TEST(within_eps(view_at(z, im.w + 3, im.h + 3, 2), 0, EPS));
+
+    TEST(within_eps(view_at(f, -1, 3, 0), get_pixel(im, 1, 3, 0), EPS));
+    TEST(within_eps(view_at(f, -3, -2, 1), get_pixel(im, 3, 2, 1), EPS));
+    TEST(within_eps(view_at(f, im.w, im.h + 1, 2), get_pixel(im, im.w - 2, im.h - 3, 2), EPS));
+
+    free_image(im);
+    free_image(rep);
+    free_image(zero);
+    free_image(ref);
+}
+
+void test_pool()
+{
+    image a = make_image(123, 45, 3);
+    TEST(((size_t)a.data % POOL_ALIGN) == 0);
+    a.data[17] = 5;
+    free_image(a);
+
+    pool_stats before = get_pool_stats();
+    image b = make_image(123, 45, 3);
+    pool_stats after = get_pool_stats();
+    // Same size class again is served from the cache, and comes back zeroed
+    TEST(after.hits == before.hits + 1);
+    TEST(within_eps(b.data[17], 0, EPS));
+    TEST(after.peak >= after.in_use);
+    free_image(b);
+}
+
+static void count_range(void *ctx, int start, int end)
+{
+    int *hits = ctx;
+    for(int i = start; i < end; ++i) __atomic_add_fetch(&hits[i], 1, __ATOMIC_RELAXED);
+}
+
+void test_parallel()
+{
+    int old = get_num_threads();
+    set_num_threads(4);
+    int hits[1000] = {0};
+    parallel_for(1000, 1, count_range, hits);
+    int once = 1;
+    for(int i = 0; i < 1000; ++i) once = once && hits[i] == 1;
+    TEST(once);
+
+    // Splitting rows across threads doesn't change any results
+    image im = load_image("data/dog.jpg");
+    image f = make_gaussian_filter(2);
+    image threaded = convolve_image(im, f, 0);
+    set_num_threads(1);
+    image serial = convolve_image(im, f, 0);
+    TEST(0 == memcmp(threaded.data, serial.data, im.w*im.h*sizeof(float)));
+    set_num_threads(old);
+    free_image(im);
+    free_image(f);
+    free_image(threaded);
+    free_image(serial);
+}
+
+void test_packed_image()
+{
+    image im = load_image("data/dogsmall.jpg");
+    packed_image u8 = pack_image(im, STORE_U8);
+    packed_image f16 = pack_image(im, STORE_F16);
+    image a = unpack_image(u8);
+    image b = unpack_image(f16);
+    // jpgs decode to bytes so u8 storage is exact, half floats are close
+    TEST(same_image(a, im, EPS));
+    TEST(same_image(b, im, 1e-3));
+    TEST(within_eps(get_packed_pixel(f16, 13, 17, 1), get_pixel(im, 13, 17, 1), 1e-3));
+
+    // Kernels on packed images match the float ones up to storage rounding
+    image f = make_gaussian_filter(2);
+    image blur = convolve_image(im, f, 1);
+    packed_image pblur = convolve_packed(f16, f, 1);
+    image ublur = unpack_image(pblur);
+    TEST(same_image(ublur, blur, 2e-3));
+
+    image big = bilinear_resize(im, im.w*3, im.h*3);
+    packed_image pbig = bilinear_resize_packed(u8, im.w*3, im.h*3);
+    image ubig = unpack_image(pbig);
+    TEST(same_image(ubig, big, 1./255 + EPS));
+
+    free_image(im);
+    free_image(a);
+    free_image(b);
+    free_image(f);
+    free_image(blur);
+    free_image(ublur);
+    free_image(big);
+    free_image(ubig);
+    free_packed_image(u8);
+    free_packed_image(f16);
+    free_packed_image(pblur);
+    free_packed_image(pbig);
+}
+
+void test_convolve_u8()
+{
+    image im = load_image("data/dogsmall.jpg");
+    packed_image u8 = pack_image(im, STORE_U8);
+    image filters[4] = {make_gaussian_filter(2), make_box_filter(5), make_highpass_filter(), make_emboss_filter()};
+    int preserve[4] = {1, 0, 0, 1};
+    int k, i, err = 0;
+    for(k = 0; k < 4; ++k){
+        image blur = convolve_image(im, filters[k], preserve[k]);
+        packed_image ref = pack_image(blur, STORE_U8);
+        packed_image fixed = convolve_packed(u8, filters[k], preserve[k]);
+        unsigned char *a = ref.data, *b = fixed.data;
+        // Fixed point taps keep every level within 1 of the float path
+        for(i = 0; i < ref.w*ref.h*ref.c; ++i) err = MAX(err, abs(a[i] - b[i]));
+        free_image(blur);
+        free_image(filters[k]);
+        free_packed_image(ref);
+        free_packed_image(fixed);
+    }
+    TEST(err <= 1);
+    free_image(im);
+    free_packed_image(u8);
+}
+
 void test_nn_interpolate()
 {
     image im = load_image("data/dogsmall.jpg");
@@ -272,6 +472,158 @@ void test_multiple_resize()
     free_image(gt);
 }
 
+void test_resize_tables()
+{
+    image im = load_image("data/dog.jpg");
+    // Whole coordinates take the pixel itself
+    TEST(within_eps(bilinear_interpolate(im, 3, 4, 0), get_pixel(im, 3, 4, 0), EPS));
+    image same = bilinear_resize(im, im.w, im.h);
+    TEST(same_image(same, im, EPS));
+
+    // Tables give what the per pixel samplers give
+    int sizes[2][2] = {{173, 61}, {im.w*3/2 + 1, im.h*5/4}};
+    int i, x, y, c, ok = 1;
+    for(i = 0; i < 2; ++i){
+        int w = sizes[i][0], h = sizes[i][1];
+        image bl = bilinear_resize(im, w, h);
+        image nn = nn_resize(im, w, h);
+        float ax = 1.0*im.w/w, bx = 0.5*(ax - 1.0);
+        float ay = 1.0*im.h/h, by = 0.5*(ay - 1.0);
+        for(c = 0; c < im.c; ++c){
+            for(y = 0; y < h; ++y){
+                for(x = 0; x < w; ++x){
+                    ok = ok && within_eps(get_pixel(bl, x, y, c), bilinear_interpolate(im, ax*x + bx, ay*y + by, c), EPS);
+                    ok = ok && within_eps(get_pixel(nn, x, y, c), nn_interpolate(im, ax*x + bx, ay*y + by, c), EPS);
+                }
+            }
+        }
+        free_image(bl);
+        free_image(nn);
+    }
+    TEST(ok);
+    free_image(im);
+    free_image(same);
+}
+
+// Average of im over [x0, x1) x [y0, y1) in pixel units, by brute force.
+static double area_average(image im, double x0, double x1, double y0, double y1, int c)
+{
+    double sum = 0;
+    int x, y;
+    for(y = floor(y0); y < ceil(y1); ++y){
+        for(x = floor(x0); x < ceil(x1); ++x){
+            double cover = (MIN(x1, x + 1) - MAX(x0, x))*(MIN(y1, y + 1) - MAX(y0, y));
+            sum += cover*get_pixel(im, x, y, c);
+        }
+    }
+    return sum/((x1 - x0)*(y1 - y0));
+}
+
+void test_area_resize()
+{
+    image im = load_image("data/dog.jpg");
+    int sizes[3][2] = {{173, 61}, {im.w/4, im.h/4}, {im.w/2, im.h/2}};
+    int i, x, y, c, ok = 1;
+    for(i = 0; i < 3; ++i){
+        int w = sizes[i][0], h = sizes[i][1];
+        double ax = (double)im.w/w, ay = (double)im.h/h;
+        image small = area_resize(im, w, h);
+        for(c = 0; c < im.c; ++c){
+            for(y = 0; y < h; ++y){
+                for(x = 0; x < w; ++x){
+                    float avg = area_average(im, x*ax, (x + 1)*ax, y*ay, (y + 1)*ay, c);
+                    ok = ok && within_eps(get_pixel(small, x, y, c), avg, 1e-4);
+                }
+            }
+        }
+        free_image(small);
+    }
+    TEST(ok);
+
+    // Halving twice is a quarter, odd sizes average the last pixel with itself
+    image crop = view_to_image(crop_view(view_image(im), 0, 0, im.w/4*4, im.h/4*4));
+    image h1 = half_image(crop);
+    image h2 = half_image(h1);
+    image quarter = area_resize(crop, crop.w/4, crop.h/4);
+    TEST(same_image(h2, quarter, EPS));
+    image odd = view_to_image(crop_view(view_image(im), 0, 0, 9, 7));
+    image hodd = half_image(odd);
+    TEST(hodd.w == 5 && hodd.h == 4);
+    TEST(within_eps(get_pixel(hodd, 4, 3, 1), get_pixel(odd, 8, 6, 1), EPS));
+    TEST(within_eps(get_pixel(hodd, 4, 1, 0), (get_pixel(odd, 8, 2, 0) + get_pixel(odd, 8, 3, 0))/2, EPS));
+    free_image(im);
+    free_image(crop);
+    free_image(h1);
+    free_image(h2);
+    free_image(quarter);
+    free_image(odd);
+    free_image(hodd);
+}
+
+static double lanczos3(double x)
+{
+    if(x == 0) return 1;
+    if(fabs(x) >= 3) return 0;
+    return 3*sin(M_PI*x)*sin(M_PI*x/3)/(M_PI*M_PI*x*x);
+}
+
+// Lanczos-3 sample of im around (x, y) by brute force, the kernel
+// stretched by s when shrinking.
+static double lanczos_sample(image im, double x, double y, double sx, double sy, int c)
+{
+    double sum = 0, norm = 0;
+    int i, j;
+    for(j = floor(y - 3*sy) - 1; j <= ceil(y + 3*sy) + 1; ++j){
+        for(i = floor(x - 3*sx) - 1; i <= ceil(x + 3*sx) + 1; ++i){
+            double w = lanczos3((i - x)/sx)*lanczos3((j - y)/sy);
+            sum += w*get_pixel(im, i, j, c);
+            norm += w;
+        }
+    }
+    return sum/norm;
+}
+
+void test_filter_resize()
+{
+    image im = load_image("data/dogsmall.jpg");
+    // Same size keeps every pixel, flat images stay flat
+    image same = bicubic_resize(im, im.w, im.h);
+    image same3 = lanczos_resize(im, im.w, im.h, 3);
+    TEST(same_image(same, im, EPS));
+    TEST(same_image(same3, im, EPS));
+    image flat = make_image(31, 17, 2);
+    int i, x, y, c, ok = 1;
+    for(i = 0; i < flat.w*flat.h*flat.c; ++i) flat.data[i] = .7;
+    image flat2 = bicubic_resize(flat, 7, 40);
+    image flat3 = lanczos_resize(flat, 50, 5, 2);
+    for(i = 0; i < flat2.w*flat2.h*flat2.c; ++i) ok = ok && within_eps(flat2.data[i], .7, 1e-5);
+    for(i = 0; i < flat3.w*flat3.h*flat3.c; ++i) ok = ok && within_eps(flat3.data[i], .7, 1e-5);
+    TEST(ok);
+
+    // Tables give the brute force sums, growing and shrinking
+    int sizes[2][2] = {{im.w*7/3, im.h*3/2}, {im.w/3, im.h*2/5}};
+    for(i = 0; i < 2; ++i){
+        int w = sizes[i][0], h = sizes[i][1];
+        double ax = (double)im.w/w, ay = (double)im.h/h;
+        image r = lanczos_resize(im, w, h, 3);
+        for(c = 0; c < im.c; ++c){
+            for(y = 0; y < h; ++y){
+                for(x = 0; x < w; ++x){
+                    double v = lanczos_sample(im, ax*x + .5*(ax - 1), ay*y + .5*(ay - 1), MAX(ax, 1), MAX(ay, 1), c);
+                    ok = ok && within_eps(get_pixel(r, x, y, c), v, 1e-4);
+                }
+            }
+        }
+        free_image(r);
+    }
+    TEST(ok);
+    free_image(im);
+    free_image(same);
+    free_image(same3);
+    free_image(flat);
+    free_image(flat2);
+    free_image(flat3);
+}
 
 void test_highpass_filter(){
     image im = load_image("data/dog.jpg");
@@ -332,6 +684,31 @@ void test_convolution(){
     free_image(gt);
 }
 
+void test_convolve_view(){
+    image im = load_image("data/dog.jpg");
+    image_view crop = crop_view(view_image(im), 40, 30, 100, 80);
+    image sub = view_to_image(crop);
+    image f = make_gaussian_filter(2);
+
+    image gt = convolve_image(sub, f, 1);
+    image out = make_image(crop.w, crop.h, crop.c);
+    convolve_view(crop, f, 1, view_image(out));
+    TEST(same_image(out, gt, EPS));
+
+    image gt1 = convolve_image(sub, f, 0);
+    image out1 = make_image(crop.w, crop.h, 1);
+    convolve_view(crop, f, 0, view_image(out1));
+    TEST(same_image(out1, gt1, EPS));
+
+    free_image(im);
+    free_image(sub);
+    free_image(f);
+    free_image(gt);
+    free_image(out);
+    free_image(gt1);
+    free_image(out1);
+}
+
 void test_gaussian_filter(){
     image f = make_gaussian_filter(7);
     int i;
@@ -360,6 +737,512 @@ void test_gaussian_blur(){
     free_image(gt);
 }
 
+void test_convolve3x3(){
+    image im = load_image("data/dog.jpg");
+    image sub = view_to_image(crop_view(view_image(im), 10, 20, 37, 29));
+    image hwc = convert_layout(sub, LAYOUT_CHW, LAYOUT_HWC);
+    image f = make_image(3, 3, 3);
+    int i;
+    srand(3);
+    for(i = 0; i < 27; ++i) f.data[i] = rand()/(float)RAND_MAX - .5;
+    // Interleaved views aren't row contiguous, so they take the generic path
+    image fast = convolve_image(sub, f, 1);
+    image slow = make_image(sub.w, sub.h, sub.c);
+    convolve_view(layout_view(hwc, LAYOUT_HWC), f, 1, view_image(slow));
+    TEST(same_image(fast, slow, EPS));
+    image fast1 = convolve_image(sub, f, 0);
+    image slow1 = make_image(sub.w, sub.h, 1);
+    convolve_view(layout_view(hwc, LAYOUT_HWC), f, 0, view_image(slow1));
+    TEST(same_image(fast1, slow1, EPS));
+    free_image(im);
+    free_image(sub);
+    free_image(hwc);
+    free_image(f);
+    free_image(fast);
+    free_image(slow);
+    free_image(fast1);
+    free_image(slow1);
+}
+
+static void lookup_kernels(void *ctx, int start, int end)
+{
+    const kernel **k = ctx;
+    for(int i = start; i < end; ++i) k[i] = get_kernel(KERNEL_GAUSSIAN, 1 + i%8*.25f);
+}
+
+void test_kernel_cache(){
+    const kernel *k = get_kernel(KERNEL_GAUSSIAN, 2);
+    const kernel *k2 = get_kernel(KERNEL_GAUSSIAN, 2);
+    const kernel *k25 = get_kernel(KERNEL_GAUSSIAN, 2.5);
+    TEST(k == k2);
+    TEST(k != k25);
+    release_kernel(k2);
+    release_kernel(k25);
+    image f = make_gaussian_filter(2);
+    TEST(same_image(f, k->filter, EPS));
+    TEST(f.data != k->filter.data);
+
+    // The factors hold the same filter
+    int x, y;
+    float err = 0;
+    for(y = 0; y < f.h; ++y){
+        for(x = 0; x < f.w; ++x){
+            err = MAX(err, fabsf(k->row.data[x]*k->col.data[y] - f.data[y*f.w + x]));
+        }
+    }
+    TEST(err < 1e-6);
+    const kernel *emboss = get_kernel(KERNEL_EMBOSS, 0);
+    TEST(emboss->row.w == 0);
+    release_kernel(emboss);
+
+    // Evicting kernels that don't separate, a 1x1 box among them, hands
+    // every buffer back once: fresh images stay distinct
+    for(x = 1; x < 40; ++x) free_image(make_box_filter(x));
+    image small[6];
+    int distinct = 1;
+    for(x = 0; x < 6; ++x){
+        small[x] = make_image(1, 1, 1);
+        for(y = 0; y < x; ++y) distinct = distinct && small[x].data != small[y].data;
+    }
+    for(x = 0; x < 6; ++x) free_image(small[x]);
+    TEST(distinct);
+
+    // Sweeping sigma drops old Gaussians, but not one still in use: k
+    // stays readable and asking again builds a new entry
+    for(x = 0; x < 100; ++x) free_image(make_gaussian_filter(4 + x*.01f));
+    TEST(same_image(f, k->filter, EPS));
+    k2 = get_kernel(KERNEL_GAUSSIAN, 2);
+    TEST(k2 != k && same_image(f, k2->filter, EPS));
+    release_kernel(k);
+    release_kernel(k2);
+
+    // Threads asking at once all get the one shared kernel
+    int old = get_num_threads();
+    set_num_threads(4);
+    const kernel *seen[64];
+    parallel_for(64, 1, lookup_kernels, seen);
+    set_num_threads(old);
+    int shared = 1;
+    for(x = 0; x < 64; ++x){
+        const kernel *again = get_kernel(KERNEL_GAUSSIAN, 1 + x%8*.25f);
+        shared = shared && seen[x] == again;
+        release_kernel(again);
+    }
+    for(x = 0; x < 64; ++x) release_kernel(seen[x]);
+    TEST(shared);
+    free_image(f);
+}
+
+void test_separable_convolve(){
+    image im = load_image("data/dog.jpg");
+    image f = make_gaussian_filter(3);
+    image sep = convolve_image(im, f, 1);
+    // Nudging one tap makes the filter rank 2, so it isn't split into passes
+    f.data[f.w*(f.h/2) + f.w/2 + 1] *= 1.001;
+    image full = convolve_image(im, f, 1);
+    TEST(same_image(sep, full, EPS));
+    free_image(im);
+    free_image(f);
+    free_image(sep);
+    free_image(full);
+}
+
+void test_box_convolve(){
+    image dog = load_image("data/dog.jpg");
+    image_view v = crop_view(view_image(dog), 200, 150, 91, 67);
+    image boxes[2] = {make_box_filter(31), make_image(9, 4, 3)};
+    int i, x, y, c, fx, fy;
+    for(i = 0; i < boxes[1].w*boxes[1].h*3; ++i) boxes[1].data[i] = (1 + i/(boxes[1].w*boxes[1].h))*.01;
+    int ok = 1;
+    for(i = 0; i < 2; ++i){
+        image f = boxes[i];
+        int preserve;
+        for(preserve = 0; preserve < 2; ++preserve){
+            // Clamped brute force in double as the reference
+            image slow = make_image(v.w, v.h, preserve ? v.c : 1);
+            for(c = 0; c < v.c; ++c){
+                for(y = 0; y < v.h; ++y){
+                    for(x = 0; x < v.w; ++x){
+                        double sum = 0;
+                        for(fy = 0; fy < f.h; ++fy){
+                            for(fx = 0; fx < f.w; ++fx){
+                                int sx = MAX(0, MIN(v.w - 1, x + fx - f.w/2));
+                                int sy = MAX(0, MIN(v.h - 1, y + fy - f.h/2));
+                                sum += f.data[(f.c == 1 ? 0 : c)*f.w*f.h + fy*f.w + fx]*get_view_pixel(v, sx, sy, c);
+                            }
+                        }
+                        int oc = preserve ? c : 0;
+                        set_pixel(slow, x, y, oc, get_pixel(slow, x, y, oc)*(preserve ? 0 : 1) + sum);
+                    }
+                }
+            }
+            image fast = make_image(slow.w, slow.h, slow.c);
+            convolve_view(v, f, preserve, view_image(fast));
+            ok = ok && same_image(slow, fast, EPS);
+            free_image(slow);
+            free_image(fast);
+        }
+    }
+    TEST(ok);
+
+    // Running sums don't drift: a wide box along a long random row and a
+    // long random column, sums near 500. A float running sum would wander
+    // off by ~1e-2 over 200k updates.
+    int n = 200000, r = 1001, k, j;
+    float err = 0;
+    srand(3);
+    for(k = 0; k < 2; ++k){
+        image line = k ? make_image(1, n, 1) : make_image(n, 1, 1);
+        image f = k ? make_image(1, r, 1) : make_image(r, 1, 1);
+        for(i = 0; i < n; ++i) line.data[i] = rand()/(float)RAND_MAX;
+        for(i = 0; i < r; ++i) f.data[i] = 1;
+        image sum = convolve_image(line, f, 1);
+        for(i = 0; i < n; ++i){
+            double ref = 0;
+            for(j = i - r/2; j <= i + r/2; ++j) ref += line.data[MAX(0, MIN(n - 1, j))];
+            err = MAX(err, fabs(sum.data[i] - ref));
+        }
+        free_image(line);
+        free_image(f);
+        free_image(sum);
+    }
+    TEST(err < 2e-4);
+    free_image(boxes[0]);
+    free_image(boxes[1]);
+    free_image(dog);
+}
+
+void test_fft_convolve(){
+    image dog = load_image("data/dog.jpg");
+    image_view v = crop_view(view_image(dog), 300, 200, 97, 83);
+    image f = make_image(17, 17, 1);
+    int i, x, y, c, fx, fy;
+    srand(2);
+    for(i = 0; i < f.w*f.h; ++i) f.data[i] = rand()/(float)RAND_MAX - .5;
+    image slow = make_image(v.w, v.h, 1);
+    for(y = 0; y < v.h; ++y){
+        for(x = 0; x < v.w; ++x){
+            float sum = 0;
+            for(c = 0; c < v.c; ++c){
+                for(fy = 0; fy < f.h; ++fy){
+                    for(fx = 0; fx < f.w; ++fx){
+                        int sx = MAX(0, MIN(v.w - 1, x + fx - f.w/2));
+                        int sy = MAX(0, MIN(v.h - 1, y + fy - f.h/2));
+                        sum += f.data[fy*f.w + fx]*get_view_pixel(v, sx, sy, c);
+                    }
+                }
+            }
+            set_pixel(slow, x, y, 0, sum);
+        }
+    }
+    image fast = make_image(v.w, v.h, 1);
+    convolve_view(v, f, 0, view_image(fast));
+    TEST(same_image(slow, fast, EPS));
+
+    // A small filter zero padded to 17x17 has to give the same result
+    image im = view_to_image(v);
+    image hp = make_highpass_filter();
+    image direct = convolve_image(im, hp, 1);
+    image big = make_image(f.w, f.h, 1);
+    for(fy = 0; fy < hp.h; ++fy){
+        for(fx = 0; fx < hp.w; ++fx){
+            set_pixel(big, f.w/2 - 1 + fx, f.h/2 - 1 + fy, 0, get_pixel(hp, fx, fy, 0));
+        }
+    }
+    image padded = convolve_fft(im, big, 1);
+    TEST(same_image(direct, padded, EPS));
+
+    spectrum s = fft_image(im);
+    image back = ifft_image(s);
+    TEST(same_image(im, back, EPS));
+    free_spectrum(s);
+    free_image(dog);
+    free_image(f);
+    free_image(slow);
+    free_image(fast);
+    free_image(im);
+    free_image(hp);
+    free_image(direct);
+    free_image(big);
+    free_image(padded);
+    free_image(back);
+}
+
+void test_iir_smooth(){
+    image im = load_image("data/dog.jpg");
+    image f = make_gaussian_filter(5);
+    image fir = convolve_image(im, f, 1);
+    image iir = smooth_image_iir(im, 5);
+    // The recursive filter only approximates the Gaussian
+    TEST(same_image(fir, iir, .03));
+    image flat = make_image(5, 2, 1);
+    int i;
+    for(i = 0; i < flat.w*flat.h; ++i) flat.data[i] = .5;
+    image flat_iir = smooth_image_iir(flat, 8);
+    TEST(same_image(flat, flat_iir, EPS));
+    free_image(im);
+    free_image(f);
+    free_image(fir);
+    free_image(iir);
+    free_image(flat);
+    free_image(flat_iir);
+}
+
+typedef struct{
+    image im;
+    int y;
+} row_cursor;
+
+static int image_row_source(void *ctx, float *row){
+    row_cursor *r = ctx;
+    int c;
+    if(r->y == r->im.h) return 0;
+    for(c = 0; c < r->im.c; ++c) memcpy(row + c*r->im.w, r->im.data + (c*r->im.h + r->y)*r->im.w, r->im.w*sizeof(float));
+    r->y++;
+    return 1;
+}
+
+static void image_row_sink(void *ctx, const float *row){
+    row_cursor *r = ctx;
+    int c;
+    for(c = 0; c < r->im.c; ++c) memcpy(r->im.data + (c*r->im.h + r->y)*r->im.w, row + c*r->im.w, r->im.w*sizeof(float));
+    r->y++;
+}
+
+void test_convolve_stream(){
+    image dog = load_image("data/dog.jpg");
+    image im = view_to_image(crop_view(view_image(dog), 100, 50, 61, 45));
+    image f = make_image(5, 7, 1);
+    int i;
+    srand(3);
+    for(i = 0; i < f.w*f.h; ++i) f.data[i] = rand()/(float)RAND_MAX - .5;
+    image g = make_gaussian_filter(3);
+
+    // Separable and non-separable filters, summing and keeping channels
+    image filters[2] = {g, f};
+    int k, preserve;
+    for(k = 0; k < 2; ++k){
+        for(preserve = 0; preserve < 2; ++preserve){
+            image ref = convolve_image(im, filters[k], preserve);
+            image out = make_image(im.w, im.h, ref.c);
+            row_cursor src = {im, 0}, dst = {out, 0};
+            TEST(convolve_stream(im.w, im.h, im.c, filters[k], preserve, image_row_source, &src, image_row_sink, &dst));
+            TEST(dst.y == im.h);
+            TEST(same_image(ref, out, EPS));
+            free_image(ref);
+            free_image(out);
+        }
+    }
+
+    // Blur a PPM file into another one
+    pnm_stream w = create_pnm("data/stream.ppm", im.w, im.h, im.c);
+    row_cursor src = {im, 0};
+    float *row = calloc(im.w*im.c, sizeof(float));
+    while(image_row_source(&src, row)) write_pnm_row(&w, row);
+    close_pnm(w);
+    pnm_stream in = open_pnm("data/stream.ppm");
+    pnm_stream out = create_pnm("data/stream_blur.ppm", in.w, in.h, in.c);
+    TEST(in.w == im.w && in.h == im.h && in.c == 3 && in.maxval == 255);
+    TEST(convolve_stream(in.w, in.h, in.c, g, 1, read_pnm_row, &in, write_pnm_row, &out));
+    close_pnm(in);
+    close_pnm(out);
+    image ref = convolve_image(im, g, 1);
+    image blur = make_image(im.w, im.h, im.c);
+    row_cursor dst = {blur, 0};
+    in = open_pnm("data/stream_blur.ppm");
+    while(read_pnm_row(&in, row)) image_row_sink(&dst, row);
+    close_pnm(in);
+    TEST(dst.y == im.h);
+    // Two rounds through 8 bits
+    TEST(same_image(ref, blur, 1/255.));
+    remove("data/stream.ppm");
+    remove("data/stream_blur.ppm");
+
+    free(row);
+    free_image(dog);
+    free_image(im);
+    free_image(f);
+    free_image(g);
+    free_image(ref);
+    free_image(blur);
+}
+
+void test_stats(){
+    image im = load_image("data/dog.jpg");
+    pixel_stats s[3];
+    channel_stats(view_image(im), s);
+    int i, c, n = im.w*im.h, ok = 1;
+    size_t hist[10], gt_hist[10] = {0};
+    for(c = 0; c < im.c; ++c){
+        double sum = 0, var = 0;
+        float min = im.data[c*n], max = im.data[c*n];
+        for(i = 0; i < n; ++i){
+            float v = im.data[c*n + i];
+            sum += v;
+            min = MIN(min, v);
+            max = MAX(max, v);
+            gt_hist[MIN((int)(v*10), 9)]++;
+        }
+        for(i = 0; i < n; ++i) var += (im.data[c*n + i] - sum/n)*(im.data[c*n + i] - sum/n);
+        ok = ok && s[c].n == n && s[c].min == min && s[c].max == max;
+        ok = ok && within_eps(s[c].mean, sum/n, 1e-5) && within_eps(s[c].var, var/n, 1e-5);
+    }
+    TEST(ok);
+    pixel_stats all = view_stats(view_image(im));
+    TEST(all.n == 3*n && within_eps(all.mean, (s[0].sum + s[1].sum + s[2].sum)/(3*n), 1e-5));
+    view_histogram(view_image(im), 10, 0, 1, hist);
+    TEST(0 == memcmp(hist, gt_hist, sizeof(hist)));
+
+    // Strided views and thread counts give the same answers
+    image hwc = convert_layout(im, LAYOUT_CHW, LAYOUT_HWC);
+    pixel_stats t[3];
+    int old = get_num_threads();
+    set_num_threads(3);
+    channel_stats(layout_view(hwc, LAYOUT_HWC), t);
+    set_num_threads(old);
+    ok = 1;
+    for(c = 0; c < 3; ++c) ok = ok && t[c].min == s[c].min && t[c].max == s[c].max && within_eps(t[c].mean, s[c].mean, 1e-6);
+    TEST(ok);
+
+    feature_normalize(im);
+    channel_stats(view_image(im), s);
+    TEST(within_eps(s[1].min, 0, 1e-6) && within_eps(s[1].max, 1, 1e-6));
+    free_image(im);
+    free_image(hwc);
+}
+
+static void pipe_scale(void *ctx, const image_view *in, image_view out)
+{
+    float k = *(float *)ctx;
+    int x, y, c;
+    for(c = 0; c < out.c; ++c){
+        for(y = 0; y < out.h; ++y){
+            for(x = 0; x < out.w; ++x) *view_ptr(out, x, y, c) = k*view_at(in[0], x, y, c);
+        }
+    }
+}
+
+static void pipe_mix(void *ctx, const image_view *in, image_view out)
+{
+    int x, y;
+    for(y = 0; y < out.h; ++y){
+        for(x = 0; x < out.w; ++x){
+            *view_ptr(out, x, y, 0) = view_at(in[0], x, y, 0) + view_at(in[1], x, y, 0)*view_at(in[1], x, y, 1);
+        }
+    }
+}
+
+void test_pipeline(){
+    image im = load_image("data/dog.jpg");
+    int i, n = im.w*im.h;
+
+    // colorize_sobel against its steps run one after the other
+    image g3 = make_gaussian_filter(3);
+    image blur = convolve_image(im, g3, 1);
+    free_image(g3);
+    image *sobel = sobel_image(blur);
+    feature_normalize(sobel[0]);
+    feature_normalize(sobel[1]);
+    image ref = make_image(im.w, im.h, 3);
+    memcpy(ref.data, sobel[1].data, n*sizeof(float));
+    memcpy(ref.data + n, sobel[0].data, n*sizeof(float));
+    memcpy(ref.data + 2*n, sobel[0].data, n*sizeof(float));
+    hsv_to_rgb(ref);
+    image color = colorize_sobel(im);
+    TEST(same_image(ref, color, EPS));
+
+    // A box blur read by a stencil and by a map fused into another map,
+    // which feeds a box too tall to tile
+    image box = make_image(7, 5, 1);
+    for(i = 0; i < 35; ++i) box.data[i] = 1/35.;
+    image g = make_gaussian_filter(2);
+    image wide = make_box_filter(41);
+    float k = .5;
+    pipeline *p = make_pipeline();
+    int in = pipe_input(p, view_image(im));
+    int a = pipe_convolve(p, in, box, 1);
+    int b = pipe_convolve(p, a, g, 0);
+    int d = pipe_gradient(p, b, GRADIENT_X | GRADIENT_Y);
+    int half = pipe_map(p, &a, 1, 3, pipe_scale, &k);
+    int mixed[2] = {half, d};
+    int mix = pipe_map(p, mixed, 2, 1, pipe_mix, 0);
+    int out = pipe_convolve(p, mix, wide, 1);
+    image fast = run_pipeline(p, out);
+
+    image ra = convolve_image(im, box, 1);
+    image rb = convolve_image(ra, g, 0);
+    image rd = gradient_image(rb, GRADIENT_X | GRADIENT_Y);
+    image rmix = make_image(im.w, im.h, 1);
+    for(i = 0; i < n; ++i) rmix.data[i] = k*ra.data[i] + rd.data[i]*rd.data[n + i];
+    image slow = convolve_image(rmix, wide, 1);
+    TEST(same_image(slow, fast, EPS));
+
+    // Any number of threads gives the same result
+    int old = get_num_threads();
+    set_num_threads(3);
+    image threaded = run_pipeline(p, out);
+    set_num_threads(old);
+    TEST(same_image(fast, threaded, 1e-6));
+    free_pipeline(p);
+
+    free_image(im);
+    free_image(blur);
+    free_image(sobel[0]);
+    free_image(sobel[1]);
+    free(sobel);
+    free_image(ref);
+    free_image(color);
+    free_image(box);
+    free_image(g);
+    free_image(wide);
+    free_image(fast);
+    free_image(ra);
+    free_image(rb);
+    free_image(rd);
+    free_image(rmix);
+    free_image(slow);
+    free_image(threaded);
+}
+
+void test_gradient(){
+    image im = load_image("data/dog.jpg");
+    image fx = make_gx_filter();
+    image fy = make_gy_filter();
+    image gx = convolve_image(im, fx, 0);
+    image gy = convolve_image(im, fy, 0);
+    image g = gradient_image(im, GRADIENT_X | GRADIENT_Y | GRADIENT_ANGLE | GRADIENT_XY);
+    int i, c, n = im.w*im.h;
+    float err = 0, angle_err = 0;
+    for(i = 0; i < n; ++i){
+        float ref[4] = {gx.data[i], gy.data[i], atan2f(gy.data[i], gx.data[i]), gx.data[i]*gy.data[i]};
+        // Angles of rounding noise in flat areas mean nothing, and on the
+        // negative x axis the sign of a zero gy picks pi or -pi
+        int flat = fabsf(gx.data[i]) + fabsf(gy.data[i]) < 1e-4;
+        for(c = 0; c < 4; ++c){
+            float d = fabsf(g.data[c*n + i] - ref[c]);
+            if(c == 2 && flat) continue;
+            if(c == 2 && d > M_PI) d = fabsf(d - 2*M_PI);
+            err = MAX(err, d);
+        }
+        // The angle against atan2 of the same gradients, only the
+        // approximation's error
+        if(!flat){
+            float d = fabsf(g.data[2*n + i] - atan2f(g.data[n + i], g.data[i]));
+            if(d > M_PI) d = fabsf(d - 2*M_PI);
+            angle_err = MAX(angle_err, d);
+        }
+    }
+    // same_image's tolerance grows with large values, products reach 60
+    TEST(err < EPS);
+    TEST(angle_err < 3e-6);
+    free_image(im);
+    free_image(fx);
+    free_image(fy);
+    free_image(gx);
+    free_image(gy);
+    free_image(g);
+}
+
 void test_hybrid_image(){
     image melisa = load_image("data/melisa.png");
     image aria = load_image("data/aria.png");
@@ -381,6 +1264,30 @@ void test_hybrid_image(){
     free_image(gt);
 }
 
+void test_fused_hybrid(){
+    image melisa = load_image("data/melisa.png");
+    image aria = load_image("data/aria.png");
+    image f = make_gaussian_filter(2);
+    image lfreq_m = convolve_image(melisa, f, 1);
+    image lfreq_a = convolve_image(aria, f, 1);
+    image gt = load_image("figs/hybrid.png");
+    // Written in place over one of its inputs
+    hybrid_image_into(lfreq_m, aria, lfreq_a, lfreq_a);
+    TEST(same_image(lfreq_a, gt, EPS));
+
+    image diff = make_image(aria.w, aria.h, aria.c);
+    sub_image_into(aria, melisa, diff);
+    add_image_into(diff, melisa, diff);
+    TEST(same_image(diff, aria, EPS));
+    free_image(melisa);
+    free_image(aria);
+    free_image(f);
+    free_image(lfreq_m);
+    free_image(lfreq_a);
+    free_image(gt);
+    free_image(diff);
+}
+
 void test_frequency_image(){
     image im = load_image("data/dog.jpg");
     image f = make_gaussian_filter(2);
@@ -405,6 +1312,46 @@ void test_frequency_image(){
     free_image(high_freq);
 }
 
+void test_pyramid(){
+    image im = load_image("data/dog.jpg");
+    pyramid *p = image_pyramid(im);
+    TEST(p == image_pyramid(im));
+    TEST(pyramid_level(p, 0).data == im.data);
+
+    // Level 1 is a 5x5 binomial blur sampled at even pixels
+    float b[5] = {1, 4, 6, 4, 1};
+    image f = make_image(5, 5, 1);
+    int x, y, c;
+    for(y = 0; y < 5; ++y) for(x = 0; x < 5; ++x) set_pixel(f, x, y, 0, b[x]*b[y]/256);
+    image blur = convolve_image(im, f, 1);
+    image g1 = pyramid_level(p, 1);
+    image gt = make_image((im.w + 1)/2, (im.h + 1)/2, im.c);
+    for(c = 0; c < im.c; ++c){
+        for(y = 0; y < gt.h; ++y){
+            for(x = 0; x < gt.w; ++x) set_pixel(gt, x, y, c, get_pixel(blur, 2*x, 2*y, c));
+        }
+    }
+    TEST(same_image(g1, gt, EPS));
+    TEST(pyramid_level(p, p->n - 1).w == 1 || pyramid_level(p, p->n - 1).h == 1);
+
+    image back = collapse_pyramid(p);
+    TEST(same_image(back, im, EPS));
+
+    // Changing the image in place gets levels of the new pixels
+    shift_image(im, 0, .25);
+    p = image_pyramid(im);
+    image g1_new = pyramid_level(p, 1);
+    image fresh = reduce_image(im);
+    TEST(same_image(g1_new, fresh, EPS) && !same_image(g1_new, gt, EPS));
+    TEST(p == image_pyramid(im));
+    free_image(fresh);
+    free_image(f);
+    free_image(blur);
+    free_image(gt);
+    free_image(back);
+    free_image(im);
+}
+
 void test_sobel(){
     image im = load_image("data/dog.jpg");
     image *res = sobel_image(im);
@@ -703,6 +1650,13 @@ void test_hw0()
     test_grayscale();
     test_rgb_to_hsv();
     test_hsv_to_rgb();
+    test_view();
+    test_layout();
+    test_padded_image();
+    test_pool();
+    test_parallel();
+    test_packed_image();
+    test_convolve_u8();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw1()
@@ -712,6 +1666,9 @@ void test_hw1()
     test_bl_interpolate();
     test_bl_resize();
     test_multiple_resize();
+    test_resize_tables();
+    test_area_resize();
+    test_filter_resize();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw2()
@@ -721,9 +1678,22 @@ void test_hw2()
     test_emboss_filter();
     test_highpass_filter();
     test_convolution();
+    test_convolve_view();
     test_gaussian_blur();
+    test_convolve3x3();
+    test_separable_convolve();
+    test_kernel_cache();
+    test_box_convolve();
+    test_fft_convolve();
+    test_iir_smooth();
+    test_convolve_stream();
     test_hybrid_image();
+    test_fused_hybrid();
     test_frequency_image();
+    test_pyramid();
+    test_stats();
+    test_pipeline();
+    test_gradient();
     test_sobel();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
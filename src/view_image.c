@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "image.h"
+#include "profile.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Create a view covering an entire image.
+// image im: image to view.
+// returns: view sharing the pixels of im.
+image_view view_image(image im)
+{
+    image_view v;
+    v.w = im.w;
+    v.h = im.h;
+    v.c = im.c;
+    v.xs = 1;
+    v.ys = im.w;
+    v.cs = im.w*im.h;
+    v.data = im.data;
+    return v;
+}
+
+// Create a view of a rectangular region inside another view.
+// image_view v: parent view.
+// int x, y: top left corner of the region in parent coordinates.
+// int w, h: size of the region, must lie inside the parent.
+// returns: view sharing the pixels of v.
+image_view crop_view(image_view v, int x, int y, int w, int h)
+{
+    assert(x >= 0 && y >= 0 && w >= 0 && h >= 0);
+    assert(x + w <= v.w && y + h <= v.h);
+    image_view r = v;
+    r.w = w;
+    r.h = h;
+    r.data = v.data + x*v.xs + y*v.ys;
+    return r;
+}
+
+// Create a single channel view of one channel of another view.
+// image_view v: parent view.
+// int c: channel to select.
+// returns: 1 channel view sharing the pixels of v.
+image_view channel_view(image_view v, int c)
+{
+    assert(0 <= c && c < v.c);
+    image_view r = v;
+    r.c = 1;
+    r.data = v.data + c*v.cs;
+    return r;
+}
+
+// Create a view of a w x h image of which only rows [y0, y1) are held, in
+// a buffer of y1 - y0 rows of each channel. Rows outside of [y0, y1) must
+// not be read or written through the view.
+// float *data: the rows, channel after channel.
+// returns: w x h view, row y of channel k at data + (k*(y1 - y0) + y - y0)*w.
+image_view strip_view(float *data, int w, int h, int c, int y0, int y1)
+{
+    assert(0 <= y0 && y0 <= y1 && y1 <= h);
+    image_view v;
+    v.w = w;
+    v.h = h;
+    v.c = c;
+    v.xs = 1;
+    v.ys = w;
+    v.cs = w*(y1 - y0);
+    v.data = data - (size_t)y0*w;
+    return v;
+}
+
+// Read a pixel from a view, clamping coordinates to the view's edges.
+float get_view_pixel(image_view v, int x, int y, int c)
+{
+    assert(0 <= c && c < v.c);
+    x = MIN(MAX(x, 0), v.w - 1);
+    y = MIN(MAX(y, 0), v.h - 1);
+    return v.data[x*v.xs + y*v.ys + c*v.cs];
+}
+
+// Write a pixel into a view, ignoring coordinates outside of it.
+void set_view_pixel(image_view v, int x, int y, int c, float val)
+{
+    if (x < 0 || x >= v.w || y < 0 || y >= v.h || c < 0 || c >= v.c) return;
+    v.data[x*v.xs + y*v.ys + c*v.cs] = val;
+}
+
+// Interleave one row of three planes into RGBRGB... order.
+static void interleave3_row(const float *r, const float *g, const float *b, float *d, int n)
+{
+    int i = 0;
+#ifdef __SSE2__
+    for(; i + 4 <= n; i += 4){
+        __m128 vr = _mm_loadu_ps(r + i);
+        __m128 vg = _mm_loadu_ps(g + i);
+        __m128 vb = _mm_loadu_ps(b + i);
+        __m128 rg_lo = _mm_unpacklo_ps(vr, vg);                     // r0 g0 r1 g1
+        __m128 rg_hi = _mm_unpackhi_ps(vr, vg);                     // r2 g2 r3 g3
+        __m128 t0 = _mm_shuffle_ps(vb, rg_lo, _MM_SHUFFLE(2,2,0,0)); // b0 b0 r1 r1
+        __m128 t1 = _mm_shuffle_ps(rg_lo, vb, _MM_SHUFFLE(1,1,3,3)); // g1 g1 b1 b1
+        __m128 t2 = _mm_shuffle_ps(vb, rg_hi, _MM_SHUFFLE(3,2,3,2)); // b2 b3 r3 g3
+        _mm_storeu_ps(d + 3*i + 0, _mm_shuffle_ps(rg_lo, t0, _MM_SHUFFLE(2,0,1,0)));
+        _mm_storeu_ps(d + 3*i + 4, _mm_shuffle_ps(t1, rg_hi, _MM_SHUFFLE(1,0,2,0)));
+        _mm_storeu_ps(d + 3*i + 8, _mm_shuffle_ps(t2, t2, _MM_SHUFFLE(1,3,2,0)));
+    }
+#endif
+    for(; i < n; ++i){
+        d[3*i+0] = r[i];
+        d[3*i+1] = g[i];
+        d[3*i+2] = b[i];
+    }
+}
+
+// Split one RGBRGB... row into three planes.
+static void deinterleave3_row(const float *s, float *r, float *g, float *b, int n)
+{
+    int i = 0;
+#ifdef __SSE2__
+    for(; i + 4 <= n; i += 4){
+        __m128 v0 = _mm_loadu_ps(s + 3*i + 0);                    // r0 g0 b0 r1
+        __m128 v1 = _mm_loadu_ps(s + 3*i + 4);                    // g1 b1 r2 g2
+        __m128 v2 = _mm_loadu_ps(s + 3*i + 8);                    // b2 r3 g3 b3
+        __m128 ur = _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(0,1,2,2)); // r2 r2 r3 b2
+        __m128 ga = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(0,0,1,1)); // g0 g0 g1 g1
+        __m128 gb = _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(2,2,3,3)); // g2 g2 g3 g3
+        __m128 ba = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(1,1,2,2)); // b0 b0 b1 b1
+        __m128 bb = _mm_shuffle_ps(v2, v2, _MM_SHUFFLE(3,3,0,0)); // b2 b2 b3 b3
+        _mm_storeu_ps(r + i, _mm_shuffle_ps(v0, ur, _MM_SHUFFLE(2,1,3,0)));
+        _mm_storeu_ps(g + i, _mm_shuffle_ps(ga, gb, _MM_SHUFFLE(2,0,2,0)));
+        _mm_storeu_ps(b + i, _mm_shuffle_ps(ba, bb, _MM_SHUFFLE(2,0,2,0)));
+    }
+#endif
+    for(; i < n; ++i){
+        r[i] = s[3*i+0];
+        g[i] = s[3*i+1];
+        b[i] = s[3*i+2];
+    }
+}
+
+// Copy the pixels of one view into another.
+// image_view dst: destination, same width and height as src and at least
+//                 as many channels. Only the first src.c channels are written.
+// image_view src: source view.
+void copy_view(image_view dst, image_view src)
+{
+    PROFILE_FUNC();
+    assert(dst.w == src.w && dst.h == src.h && dst.c >= src.c);
+    PROFILE_BYTES(IMAGE_BYTES(src), IMAGE_BYTES(src));
+    int i, j, k;
+    if(src.c == 3 && dst.c == 3 && src.xs == 1 && dst.xs == 3 && dst.cs == 1){
+        for(j = 0; j < src.h; ++j){
+            float *s = src.data + j*src.ys;
+            interleave3_row(s, s + src.cs, s + 2*src.cs, dst.data + j*dst.ys, src.w);
+        }
+        return;
+    }
+    if(src.c == 3 && dst.c == 3 && src.xs == 3 && src.cs == 1 && dst.xs == 1){
+        for(j = 0; j < src.h; ++j){
+            float *d = dst.data + j*dst.ys;
+            deinterleave3_row(src.data + j*src.ys, d, d + dst.cs, d + 2*dst.cs, src.w);
+        }
+        return;
+    }
+    for(k = 0; k < src.c; ++k){
+        for(j = 0; j < src.h; ++j){
+            float *s = src.data + j*src.ys + k*src.cs;
+            float *d = dst.data + j*dst.ys + k*dst.cs;
+            if(src.xs == 1 && dst.xs == 1){
+                memmove(d, s, src.w*sizeof(float));
+            } else {
+                for(i = 0; i < src.w; ++i) d[i*dst.xs] = s[i*src.xs];
+            }
+        }
+    }
+}
+
+// Copy the pixels of a view into a new, densely packed image.
+image view_to_image(image_view v)
+{
+    PROFILE_FUNC();
+    image im = make_image(v.w, v.h, v.c);
+    copy_view(view_image(im), v);
+    return im;
+}
+
+// View the buffer of an image in a given memory layout.
+// image im: image whose data holds w*h*c floats.
+// LAYOUT layout: how the floats are arranged in memory.
+// returns: view sharing the pixels of im.
+image_view layout_view(image im, LAYOUT layout)
+{
+    image_view v = view_image(im);
+    if(layout == LAYOUT_HWC){
+        v.xs = im.c;
+        v.ys = im.w*im.c;
+        v.cs = 1;
+    }
+    return v;
+}
+
+// Report the layout of a view. Single channel views are always planar.
+LAYOUT view_layout(image_view v)
+{
+    return (v.c > 1 && v.cs == 1) ? LAYOUT_HWC : LAYOUT_CHW;
+}
+
+// Copy an image buffer into a new buffer with a different layout.
+// image im: source buffer.
+// LAYOUT from, to: layouts of the source and the result.
+// returns: new buffer holding the same pixels in layout to.
+image convert_layout(image im, LAYOUT from, LAYOUT to)
+{
+    PROFILE_FUNC();
+    image out = make_image(im.w, im.h, im.c);
+    copy_view(layout_view(out, to), layout_view(im, from));
+    return out;
+}
+
+// Map a coordinate outside of [0, n) back inside using a border rule.
+// returns: index to read, or -1 for a zero border.
+static int border_index(int i, int n, BORDER border)
+{
+    if(i >= 0 && i < n) return i;
+    if(border == BORDER_ZERO) return -1;
+    if(border == BORDER_REFLECT && n > 1){
+        int period = 2*(n - 1);
+        i = abs(i) % period;
+        return (i < n) ? i : period - i;
+    }
+    return (i < 0) ? 0 : n - 1;
+}
+
+// Allocate a copy of a view surrounded by a border.
+// image_view src: pixels for the interior.
+// int pad: border width on every side.
+// BORDER border: how to fill the border.
+// returns: (w+2*pad) x (h+2*pad) x c image. Use padded_interior to get a
+//          view of the original pixels that may be read up to pad pixels
+//          past its edges without clamping.
+image make_padded_image(image_view src, int pad, BORDER border)
+{
+    PROFILE_FUNC();
+    assert(pad >= 0);
+    image p = make_image(src.w + 2*pad, src.h + 2*pad, src.c);
+    copy_view(padded_interior(p, pad), src);
+    fill_border(p, pad, border);
+    return p;
+}
+
+// View the interior of a padded image.
+image_view padded_interior(image padded, int pad)
+{
+    return crop_view(view_image(padded), pad, pad, padded.w - 2*pad, padded.h - 2*pad);
+}
+
+// Refill the border of a padded image from its interior, e.g. after the
+// interior has been written to.
+void fill_border(image padded, int pad, BORDER border)
+{
+    PROFILE_FUNC();
+    int w = padded.w - 2*pad;
+    int h = padded.h - 2*pad;
+    assert(w > 0 && h > 0);
+    int i, j, k;
+    for(k = 0; k < padded.c; ++k){
+        float *plane = padded.data + k*padded.w*padded.h;
+        // Left and right edges of the interior rows
+        for(j = pad; j < pad + h; ++j){
+            float *row = plane + j*padded.w;
+            for(i = 0; i < pad; ++i){
+                int l = border_index(i - pad, w, border);
+                int r = border_index(w + i, w, border);
+                row[i] = (l < 0) ? 0 : row[pad + l];
+                row[pad + w + i] = (r < 0) ? 0 : row[pad + r];
+            }
+        }
+        // Whole rows above and below, corners included
+        for(j = 0; j < pad; ++j){
+            int t = border_index(j - pad, h, border);
+            int b = border_index(h + j, h, border);
+            float *top = plane + j*padded.w;
+            float *bot = plane + (pad + h + j)*padded.w;
+            if(t < 0) memset(top, 0, padded.w*sizeof(float));
+            else memcpy(top, plane + (pad + t)*padded.w, padded.w*sizeof(float));
+            if(b < 0) memset(bot, 0, padded.w*sizeof(float));
+            else memcpy(bot, plane + (pad + b)*padded.w, padded.w*sizeof(float));
+        }
+    }
+}